@@ -1,22 +1,63 @@
 LOCAL_PATH := $(call my-dir)
-include $(CLEAR_VARS)
-
-LOCAL_SRC_FILES := \
-    container.c \
-	keys.c \
-    stache.c
 
-LOCAL_C_INCLUDES := \
+stache_c_includes := \
     external/keyutils \
 	external/libsodium/src/libsodium/include
 
-LOCAL_SHARED_LIBRARIES := \
+stache_shared_libraries := \
     libkeyutils \
 	liblog \
 	libsodium
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    backend.c \
+	backend_fscrypt.c \
+	backend_legacy.c \
+	backend_memory.c \
+	cipher.c \
+	client.c \
+	container.c \
+	copy.c \
+	evict.c \
+	feature_matrix.c \
+	handover.c \
+	keys.c \
+	lane.c \
+	metadata.c \
+	migrate.c \
+	placement.c \
+	random_pool.c \
+	record.c \
+	secmem.c \
+	stats.c \
+	trace.c \
+	usage.c \
+	walk.c \
+	warm.c
+
+LOCAL_C_INCLUDES := $(stache_c_includes)
+
+LOCAL_MODULE := libstache
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    stache.c
+
+LOCAL_C_INCLUDES := $(stache_c_includes)
+
+LOCAL_STATIC_LIBRARIES := libstache
+LOCAL_SHARED_LIBRARIES := $(stache_shared_libraries)
+
 LOCAL_MODULE := stached
 LOCAL_MODULE_TAGS := optional
 LOCAL_INIT_RC := stached.rc
 
 include $(BUILD_EXECUTABLE)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -0,0 +1,257 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "stache.h"
+
+#ifndef F2FS_SUPER_MAGIC
+#define F2FS_SUPER_MAGIC 0xF2F52010
+#endif
+
+// Filesystems speaking the fscrypt ioctls. f2fs shares their numbers with ext4.
+struct crypt_filesystem {
+    const char *name;
+    unsigned long magic;
+    const char *feature_path;       // present when the kernel driver can encrypt
+    const char *key_prefix;         // of v1 keys in the session keyring, as long as "ext4:"
+    // -1 until probed, then 0 or 1. The answer is a property of the driver, so it is cached.
+    volatile int v2_support;
+};
+
+static struct crypt_filesystem filesystems[] = {
+    { "ext4", EXT4_SUPER_MAGIC, "/sys/fs/ext4/features/encryption", EXT4_KEY_DESC_PREFIX, -1 },
+    { "f2fs", F2FS_SUPER_MAGIC, "/sys/fs/f2fs/features/encryption", "f2fs:", -1 },
+};
+
+static struct crypt_filesystem memory_filesystem = { "memory", 0, NULL, EXT4_KEY_DESC_PREFIX, 1 };
+
+// Backends by policy version, swapped for the memory ones by backend_use().
+static const struct crypt_backend *backends[] = {
+    [1] = &legacy_backend,
+    [2] = &fscrypt_backend,
+};
+static bool use_memory = false;
+
+int backend_use(const char *setting)
+{
+    if ( strcmp(setting, "kernel") == 0 ) {
+        backends[1] = &legacy_backend;
+        backends[2] = &fscrypt_backend;
+        use_memory = false;
+        return 0;
+    }
+
+    if ( strncmp(setting, "memory", 6) != 0 || (setting[6] != '\0' && setting[6] != ':') ) {
+        fprintf(stderr, "Unknown backend: %s\n", setting);
+        return -1;
+    }
+
+    if ( memory_backend_configure(setting[6] == ':' ? setting + 7 : NULL) < 0 )
+        return -1;
+
+    backends[1] = &memory_legacy_backend;
+    backends[2] = &memory_fscrypt_backend;
+    use_memory = true;
+    return 0;
+}
+
+static
+struct crypt_filesystem *filesystem_for_type(unsigned long magic)
+{
+    if ( use_memory )
+        return &memory_filesystem;
+
+    for ( size_t i = 0; i < sizeof(filesystems) / sizeof(filesystems[0]); i++ ) {
+        if ( filesystems[i].magic == magic )
+            return &filesystems[i];
+    }
+
+    return NULL;
+}
+
+//
+// Checks the given path is on a filesystem the backends can encrypt: ext4 or
+// f2fs for the kernel backends, anything for the memory one.
+//
+bool backend_filesystem_supported(const char *path)
+{
+    struct statfs fs;
+
+    if ( statfs(path, &fs) != 0 ) {
+        fprintf(stderr, "Cannot get filesystem information for %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const struct crypt_filesystem *filesystem = filesystem_for_type(fs.f_type);
+    if ( filesystem == NULL )
+        return false;
+
+    // Only a hint: older kernels do not advertise their features.
+    if ( filesystem->feature_path != NULL && access(filesystem->feature_path, F_OK) != 0 &&
+         access("/sys/fs", F_OK) == 0 )
+        fprintf(stderr, "Warning: the %s driver does not advertise encryption support.\n", filesystem->name);
+
+    return true;
+}
+
+//
+// Name of the filesystem holding _dirfd_, or NULL if it cannot be encrypted.
+//
+const char *backend_filesystem_name(int dirfd)
+{
+    struct statfs fs;
+
+    if ( fstatfs(dirfd, &fs) != 0 )
+        return NULL;
+
+    const struct crypt_filesystem *filesystem = filesystem_for_type(fs.f_type);
+    return filesystem ? filesystem->name : NULL;
+}
+
+//
+// Kernels before the generic "fscrypt:" prefix only search v1 keys under the
+// prefix of their filesystem.
+//
+const char *backend_key_prefix(int dirfd)
+{
+    struct statfs fs;
+
+    const struct crypt_filesystem *filesystem = (fstatfs(dirfd, &fs) == 0) ? filesystem_for_type(fs.f_type) : NULL;
+    return filesystem ? filesystem->key_prefix : EXT4_KEY_DESC_PREFIX;
+}
+
+struct saved_filesystem {
+    uint64_t magic;
+    int32_t v2_support;
+} __attribute__((__packed__));
+
+int backend_save(FILE *out)
+{
+    struct saved_filesystem saved[sizeof(filesystems) / sizeof(filesystems[0])];
+
+    for ( size_t i = 0; i < sizeof(filesystems) / sizeof(filesystems[0]); i++ ) {
+        saved[i].magic = filesystems[i].magic;
+        saved[i].v2_support = filesystems[i].v2_support;
+    }
+
+    return handover_write_section(out, HANDOVER_SECTION_FILESYSTEMS, saved, sizeof(saved));
+}
+
+int backend_restore(struct handover_reader *section)
+{
+    struct saved_filesystem saved;
+
+    while ( handover_read(section, &saved, sizeof(saved)) == 0 ) {
+        for ( size_t i = 0; i < sizeof(filesystems) / sizeof(filesystems[0]); i++ ) {
+            if ( filesystems[i].magic == saved.magic && saved.v2_support >= -1 && saved.v2_support <= 1 )
+                filesystems[i].v2_support = saved.v2_support;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Checks whether the filesystem holding _dirfd_ speaks the fscrypt v2 API.
+// Drivers without it do not know FS_IOC_GET_ENCRYPTION_POLICY_EX at all.
+// The answer is cached per filesystem type.
+//
+bool fscrypt_v2_supported(int dirfd)
+{
+    struct statfs fs;
+    struct crypt_filesystem *filesystem = NULL;
+
+    if ( use_memory || fstatfs(dirfd, &fs) == 0 )
+        filesystem = filesystem_for_type(use_memory ? 0 : fs.f_type);
+
+    if ( filesystem != NULL && filesystem->v2_support != -1 )
+        return filesystem->v2_support == 1;
+
+    struct fscrypt_get_policy_ex_arg arg;
+
+    arg.policy_size = sizeof(arg.policy);
+    if ( ioctl(dirfd, FS_IOC_GET_ENCRYPTION_POLICY_EX, &arg) == 0 || (errno != ENOTTY && errno != EOPNOTSUPP) ) {
+        if ( filesystem != NULL )
+            filesystem->v2_support = 1;
+        return true;
+    }
+
+    // EOPNOTSUPP may only mean that this instance was formatted without encryption.
+    if ( errno == ENOTTY && filesystem != NULL )
+        filesystem->v2_support = 0;
+
+    return false;
+}
+
+const struct crypt_backend *backend_for_version(int version)
+{
+    if ( version < 1 || version > 2 )
+        return NULL;
+
+    return backends[version];
+}
+
+//
+// Selects the backend for a new container.
+// Version 0 picks fscrypt v2 when the kernel supports it.
+//
+const struct crypt_backend *backend_select(int dirfd, int requested_version)
+{
+    bool has_v2 = fscrypt_v2_supported(dirfd);
+
+    if ( requested_version == 0 )
+        return backends[has_v2 ? 2 : 1];
+
+    if ( requested_version == 2 && !has_v2 ) {
+        fprintf(stderr, "This kernel does not support v2 encryption policies.\n");
+        return NULL;
+    }
+
+    return backend_for_version(requested_version);
+}
+
+//
+// Reads the policy of an existing directory and returns the backend that handles it.
+//
+int backend_get_policy(int dirfd, struct stache_policy *policy, bool *has_policy,
+                       const struct crypt_backend **backend)
+{
+    // FS_IOC_GET_ENCRYPTION_POLICY_EX reports both versions, the legacy ioctl only v1.
+    const struct crypt_backend *reader = backends[fscrypt_v2_supported(dirfd) ? 2 : 1];
+
+    if ( reader->get_policy(dirfd, policy, has_policy) < 0 )
+        return -1;
+
+    if ( *has_policy ) {
+        *backend = backend_for_version(policy->version);
+        if ( *backend == NULL ) {
+            fprintf(stderr, "Unsupported encryption policy version %d.\n", policy->version);
+            return -1;
+        }
+    }
+
+    return 0;
+}
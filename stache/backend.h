@@ -0,0 +1,105 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+/*
+ * Kernel interfaces behind the container_* functions.
+ *
+ * The legacy backend speaks the ext4 v1 policy ioctls and keeps keys in the
+ * session keyring. The fscrypt backend speaks v2 policies and keeps keys in
+ * the per-filesystem keyring (FS_IOC_ADD_ENCRYPTION_KEY and friends).
+ * The memory backend stands in for both, with injected latencies and
+ * failures, so that everything above it runs on any Linux filesystem.
+ */
+
+#define STACHE_KEY_ID_MAX_SIZE FSCRYPT_KEY_IDENTIFIER_SIZE
+
+struct stache_policy {
+    int version;                    // 1 for legacy ext4 policies, 2 for fscrypt v2
+    unsigned char contents_mode;
+    unsigned char filenames_mode;
+    unsigned char flags;
+    unsigned char key_id[STACHE_KEY_ID_MAX_SIZE];   // v1 descriptor or v2 identifier
+};
+
+enum stache_key_status {
+    KEY_STATUS_ABSENT,
+    KEY_STATUS_PRESENT,
+    KEY_STATUS_INCOMPLETELY_REMOVED,
+};
+
+struct crypt_backend {
+    const char *name;
+    int policy_version;
+    size_t key_id_size;
+
+    // Size of the raw master key expected for this policy.
+    size_t (*key_size)(const struct stache_policy *);
+    int (*get_policy)(int dirfd, struct stache_policy *, bool *has_policy);
+    int (*set_policy)(int dirfd, const struct stache_policy *);
+    // Makes the key available for the policy. If _verify_ is false, v2 fills in the
+    // key identifier; otherwise the key is rejected if it does not match the policy.
+    int (*add_key)(int dirfd, struct stache_policy *, const struct ext4_encryption_key *, bool verify);
+    int (*remove_key)(int dirfd, const struct stache_policy *);
+    // _serial_ is set to the keyring serial when the backend has one, -1 otherwise.
+    int (*key_status)(int dirfd, const struct stache_policy *, enum stache_key_status *, key_serial_t *serial);
+};
+
+enum memory_call {
+    MEMORY_GET_POLICY,
+    MEMORY_SET_POLICY,
+    MEMORY_ADD_KEY,
+    MEMORY_REMOVE_KEY,
+    MEMORY_KEY_STATUS,
+    NR_MEMORY_CALLS,
+};
+
+struct memory_fault {
+    uint64_t latency_ns;            // added to every call
+    uint64_t jitter_ns;             // plus a uniform random part below this
+    unsigned failure_ppm;           // calls failing, per million
+    int error;                      // errno of failed calls
+};
+
+extern const struct crypt_backend legacy_backend;
+extern const struct crypt_backend fscrypt_backend;
+extern const struct crypt_backend memory_legacy_backend;
+extern const struct crypt_backend memory_fscrypt_backend;
+
+// _spec_ is a comma separated list of "<call>=<latency>[+<jitter>][/<failure %>]",
+// where <call> is a memory_call name such as add_key, or all. Latencies are in
+// microseconds unless suffixed by ms or s.
+int memory_backend_configure(const char *spec);
+void memory_backend_set_fault(enum memory_call, const struct memory_fault *);
+
+// Switches between the kernel backends and the memory backend, from a
+// "kernel" or "memory[:<spec>]" setting. Must happen before any container call.
+int backend_use(const char *setting);
+bool backend_filesystem_supported(const char *path);
+const char *backend_filesystem_name(int dirfd);
+const char *backend_key_prefix(int dirfd);
+// Hands the filesystem probes over to a successor daemon.
+int backend_save(FILE *out);
+int backend_restore(struct handover_reader *section);
+bool fscrypt_v2_supported(int dirfd);
+const struct crypt_backend *backend_for_version(int version);
+const struct crypt_backend *backend_select(int dirfd, int requested_version);
+int backend_get_policy(int dirfd, struct stache_policy *, bool *has_policy, const struct crypt_backend **);
+
+#endif /* _BACKEND_H */
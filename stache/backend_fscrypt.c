@@ -0,0 +1,320 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <sodium.h>
+
+#include "stache.h"
+
+#define HKDF_CONTEXT_KEY_IDENTIFIER 1
+
+//
+// Fills a key specifier from a policy.
+//
+static
+void policy_to_key_spec(const struct stache_policy *policy, struct fscrypt_key_specifier *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+
+    if ( policy->version == 1 ) {
+        spec->type = FSCRYPT_KEY_SPEC_TYPE_DESCRIPTOR;
+        memcpy(spec->u.descriptor, policy->key_id, FSCRYPT_KEY_DESCRIPTOR_SIZE);
+    }
+    else {
+        spec->type = FSCRYPT_KEY_SPEC_TYPE_IDENTIFIER;
+        memcpy(spec->u.identifier, policy->key_id, FSCRYPT_KEY_IDENTIFIER_SIZE);
+    }
+}
+
+static
+uint32_t key_hash(const struct stache_policy *policy)
+{
+    return trace_hash(policy->key_id, policy->version == 1 ? FSCRYPT_KEY_DESCRIPTOR_SIZE : FSCRYPT_KEY_IDENTIFIER_SIZE);
+}
+
+static
+size_t fscrypt_key_size(const struct stache_policy UNUSED *policy)
+{
+    // v2 master keys go through HKDF, the longest key gives the most margin.
+    return FSCRYPT_MAX_KEY_SIZE;
+}
+
+//
+// Queries the kernel for the encryption policy of any version.
+//
+static
+int fscrypt_get_policy(int dirfd, struct stache_policy *policy, bool *has_policy)
+{
+    struct fscrypt_get_policy_ex_arg arg;
+
+    arg.policy_size = sizeof(arg.policy);
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, FS_IOC_GET_ENCRYPTION_POLICY_EX, &arg);
+    trace_phase(STATS_POLICY, started_ns, 0, rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        switch ( errno ) {
+            case ENODATA:
+                *has_policy = false;
+                return 0;
+
+            case EOPNOTSUPP:
+                fprintf(stderr, "This filesystem does not support encryption.\n");
+                return -1;
+
+            default:
+                fprintf(stderr, "Cannot get encryption policy: %s\n", strerror(errno));
+                return -1;
+        }
+    }
+
+    memset(policy, 0, sizeof(*policy));
+    switch ( arg.policy.version ) {
+        case FSCRYPT_POLICY_V1:
+            policy->version = 1;
+            policy->contents_mode = arg.policy.v1.contents_encryption_mode;
+            policy->filenames_mode = arg.policy.v1.filenames_encryption_mode;
+            policy->flags = arg.policy.v1.flags;
+            memcpy(policy->key_id, arg.policy.v1.master_key_descriptor, FSCRYPT_KEY_DESCRIPTOR_SIZE);
+            break;
+
+        case FSCRYPT_POLICY_V2:
+            policy->version = 2;
+            policy->contents_mode = arg.policy.v2.contents_encryption_mode;
+            policy->filenames_mode = arg.policy.v2.filenames_encryption_mode;
+            policy->flags = arg.policy.v2.flags;
+            memcpy(policy->key_id, arg.policy.v2.master_key_identifier, FSCRYPT_KEY_IDENTIFIER_SIZE);
+            break;
+
+        default:
+            fprintf(stderr, "Unknown encryption policy version %d.\n", arg.policy.version);
+            return -1;
+    }
+
+    *has_policy = true;
+    return 0;
+}
+
+//
+// Applies a v2 encryption policy to directory.
+//
+static
+int fscrypt_set_policy(int dirfd, const struct stache_policy *policy)
+{
+    struct fscrypt_policy_v2 v2 = {
+        .version = FSCRYPT_POLICY_V2,
+        .contents_encryption_mode = policy->contents_mode,
+        .filenames_encryption_mode = policy->filenames_mode,
+        .flags = policy->flags,
+    };
+
+    memcpy(v2.master_key_identifier, policy->key_id, FSCRYPT_KEY_IDENTIFIER_SIZE);
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, FS_IOC_SET_ENCRYPTION_POLICY, &v2);
+    trace_phase(STATS_POLICY, started_ns, key_hash(policy), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        switch ( errno ) {
+            case EOPNOTSUPP:
+                fprintf(stderr, "This filesystem does not support encryption.\n");
+                return -1;
+
+            case EINVAL:
+                fprintf(stderr, "Encryption parameters are not supported by the kernel.\n");
+                return -1;
+
+            case EEXIST:
+                fprintf(stderr, "Encryption parameters do not match with already previous ones.\n");
+                return -1;
+
+            case ENOTEMPTY:
+                fprintf(stderr, "Cannot create encrypted container: directory must be empty.\n");
+                return -1;
+
+            case ENOKEY:
+                fprintf(stderr, "Cannot set encryption policy: key was not added to the filesystem.\n");
+                return -1;
+
+            default:
+                fprintf(stderr, "Cannot set encryption policy: %s\n", strerror(errno));
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Removes a key from the filesystem keyring.
+// Cached plaintext of files that are no longer in use is evicted by the kernel.
+//
+static
+int fscrypt_remove_key(int dirfd, const struct stache_policy *policy)
+{
+    struct fscrypt_remove_key_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    policy_to_key_spec(policy, &arg.key_spec);
+
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, FS_IOC_REMOVE_ENCRYPTION_KEY, &arg);
+    trace_phase(STATS_KEY_REMOVE, started_ns, key_hash(policy), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot remove encryption key: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ( arg.removal_status_flags & FSCRYPT_KEY_REMOVAL_STATUS_FLAG_FILES_BUSY )
+        fprintf(stderr, "Warning: some files are still in use, key removal is incomplete.\n");
+
+    return 0;
+}
+
+//
+// Computes the identifier the kernel gives to _key_: HKDF-SHA512 with an empty
+// salt, expanded with the "fscrypt" key identifier context.
+//
+static
+void compute_key_identifier(const struct ext4_encryption_key *key, uint8_t *identifier)
+{
+    static const uint8_t salt[crypto_auth_hmacsha512_BYTES];
+    static const uint8_t info[] = { 'f', 's', 'c', 'r', 'y', 'p', 't', '\0', HKDF_CONTEXT_KEY_IDENTIFIER, 1 };
+    crypto_auth_hmacsha512_state state;
+    uint8_t prk[crypto_auth_hmacsha512_BYTES];
+
+    // Extract, then the first block of expand is all an identifier needs.
+    crypto_auth_hmacsha512_init(&state, salt, sizeof(salt));
+    crypto_auth_hmacsha512_update(&state, (const uint8_t *) key->raw, key->size);
+    crypto_auth_hmacsha512_final(&state, prk);
+
+    crypto_auth_hmacsha512_init(&state, prk, sizeof(prk));
+    crypto_auth_hmacsha512_update(&state, info, sizeof(info));
+    crypto_auth_hmacsha512_final(&state, prk);
+
+    memcpy(identifier, prk, FSCRYPT_KEY_IDENTIFIER_SIZE);
+    sodium_memzero(&state, sizeof(state));
+    sodium_memzero(prk, sizeof(prk));
+}
+
+//
+// Adds a key to the filesystem keyring. The kernel computes the key identifier,
+// which either becomes the identifier of a new policy, or must match the existing one.
+//
+static
+int fscrypt_add_key(int dirfd, struct stache_policy *policy, const struct ext4_encryption_key *key, bool verify)
+{
+    uint8_t identifier[FSCRYPT_KEY_IDENTIFIER_SIZE];
+
+    // A wrong key is rejected before it reaches the keyring: it may already be
+    // there for another container, and removing it would detach that one.
+    if ( verify ) {
+        compute_key_identifier(key, identifier);
+        if ( memcmp(policy->key_id, identifier, FSCRYPT_KEY_IDENTIFIER_SIZE) != 0 ) {
+            fprintf(stderr, "Wrong passphrase: key does not match the container.\n");
+            errno = EKEYREJECTED;
+            return -1;
+        }
+    }
+
+    int ret = -1;
+    struct fscrypt_add_key_arg *arg = secmem_alloc();
+    if ( arg == NULL )
+        return -1;
+
+    arg->key_spec.type = FSCRYPT_KEY_SPEC_TYPE_IDENTIFIER;
+    arg->raw_size = key->size;
+    memcpy(arg->raw, key->raw, key->size);
+
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, FS_IOC_ADD_ENCRYPTION_KEY, arg);
+    trace_phase(STATS_KEY_ADD, started_ns,
+                trace_hash(arg->key_spec.u.identifier, FSCRYPT_KEY_IDENTIFIER_SIZE), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot add key to filesystem: %s\n", strerror(errno));
+        goto out;
+    }
+
+    if ( !verify )
+        memcpy(policy->key_id, arg->key_spec.u.identifier, FSCRYPT_KEY_IDENTIFIER_SIZE);
+    else if ( memcmp(policy->key_id, arg->key_spec.u.identifier, FSCRYPT_KEY_IDENTIFIER_SIZE) != 0 ) {
+        // Only if the kernel derives identifiers differently. Whoever else
+        // uses that key keeps it: it is left in place.
+        fprintf(stderr, "Key identifier mismatch: key does not match the container.\n");
+        errno = EKEYREJECTED;
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    secmem_free(arg);
+    return ret;
+}
+
+static
+int fscrypt_key_status(int dirfd, const struct stache_policy *policy, enum stache_key_status *status, key_serial_t *serial)
+{
+    struct fscrypt_get_key_status_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    policy_to_key_spec(policy, &arg.key_spec);
+    *serial = -1;
+
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, FS_IOC_GET_ENCRYPTION_KEY_STATUS, &arg);
+    trace_phase(STATS_KEY_SEARCH, started_ns, key_hash(policy), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot get encryption key status: %s\n", strerror(errno));
+        return -1;
+    }
+
+    switch ( arg.status ) {
+        case FSCRYPT_KEY_STATUS_PRESENT:
+            *status = KEY_STATUS_PRESENT;
+            break;
+
+        case FSCRYPT_KEY_STATUS_INCOMPLETELY_REMOVED:
+            *status = KEY_STATUS_INCOMPLETELY_REMOVED;
+            break;
+
+        default:
+            *status = KEY_STATUS_ABSENT;
+            break;
+    }
+
+    return 0;
+}
+
+const struct crypt_backend fscrypt_backend = {
+    .name = "fscrypt (v2 policy, filesystem keyring)",
+    .policy_version = 2,
+    .key_id_size = FSCRYPT_KEY_IDENTIFIER_SIZE,
+    .key_size = fscrypt_key_size,
+    .get_policy = fscrypt_get_policy,
+    .set_policy = fscrypt_set_policy,
+    .add_key = fscrypt_add_key,
+    .remove_key = fscrypt_remove_key,
+    .key_status = fscrypt_key_status,
+};
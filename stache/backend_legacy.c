@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "stache.h"
+
+//
+// Queries the kernel for inode encryption policy.
+//
+static
+int get_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy, bool *has_policy)
+{
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY, policy);
+    trace_phase(STATS_POLICY, started_ns,
+                rc < 0 ? 0 : trace_hash(policy->master_key_descriptor, EXT4_KEY_DESCRIPTOR_SIZE), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        switch ( errno ) {
+            case ENOENT:
+            case ENODATA:
+                *has_policy = false;
+                return 0;
+
+            case ENOTSUP:
+                fprintf(stderr, "This filesystem does not support encryption.\n");
+                fprintf(stderr, "Please ensure your kernel has support for CONFIG_EXT4_ENCRYPTION or\n");
+                fprintf(stderr, "CONFIG_F2FS_FS_ENCRYPTION, and the filesystem has the encrypt feature.\n");
+                return -1;
+
+            default:
+                fprintf(stderr, "Cannot get ext4 encryption policy: %s\n", strerror(errno));
+                return -1;
+        }
+    }
+
+    *has_policy = true;
+    return 0;
+}
+
+//
+// Applies ext4 specified encryption policy to directory.
+//
+static
+int set_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy)
+{
+    uint64_t started_ns = stats_now();
+    int rc = ioctl(dirfd, EXT4_IOC_SET_ENCRYPTION_POLICY, policy);
+    trace_phase(STATS_POLICY, started_ns,
+                trace_hash(policy->master_key_descriptor, EXT4_KEY_DESCRIPTOR_SIZE), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        switch ( errno ) {
+            case ENOTSUP:
+                fprintf(stderr, "This filesystem does not support encryption.\n");
+                fprintf(stderr, "Please ensure your kernel has support for CONFIG_EXT4_ENCRYPTION or\n");
+                fprintf(stderr, "CONFIG_F2FS_FS_ENCRYPTION, and the filesystem has the encrypt feature.\n");
+                return -1;
+
+            case EINVAL:
+                fprintf(stderr, "Encryption parameters do not match with already previous ones.\n");
+                return -1;
+
+            case ENOTEMPTY:
+                fprintf(stderr, "Cannot create encrypted container: directory must be empty.\n");
+                return -1;
+
+            default:
+                fprintf(stderr, "Cannot set ext4 encryption policy: %s\n", strerror(errno));
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+size_t legacy_key_size(const struct stache_policy *policy)
+{
+    if ( policy->contents_mode >= NR_EXT4_ENCRYPTION_MODES )
+        return 0;
+
+    return cipher_modes[policy->contents_mode].cipher_key_size;
+}
+
+static
+int legacy_get_policy(int dirfd, struct stache_policy *policy, bool *has_policy)
+{
+    struct ext4_encryption_policy ext4_policy;
+
+    if ( get_ext4_encryption_policy(dirfd, &ext4_policy, has_policy) < 0 )
+        return -1;
+
+    if ( *has_policy ) {
+        memset(policy, 0, sizeof(*policy));
+        policy->version = 1;
+        policy->contents_mode = ext4_policy.contents_encryption_mode;
+        policy->filenames_mode = ext4_policy.filenames_encryption_mode;
+        policy->flags = ext4_policy.flags;
+        memcpy(policy->key_id, ext4_policy.master_key_descriptor, EXT4_KEY_DESCRIPTOR_SIZE);
+    }
+
+    return 0;
+}
+
+static
+int legacy_set_policy(int dirfd, const struct stache_policy *policy)
+{
+    struct ext4_encryption_policy ext4_policy = {
+        .version = 0,
+        .contents_encryption_mode = policy->contents_mode,
+        .filenames_encryption_mode = policy->filenames_mode,
+        .flags = policy->flags,
+    };
+
+    memcpy(ext4_policy.master_key_descriptor, policy->key_id, EXT4_KEY_DESCRIPTOR_SIZE);
+    return set_ext4_encryption_policy(dirfd, &ext4_policy);
+}
+
+static
+int legacy_add_key(int dirfd, struct stache_policy *policy, const struct ext4_encryption_key *key, bool UNUSED verify)
+{
+    return add_key_for_descriptor(backend_key_prefix(dirfd), (key_desc_t *) policy->key_id, key);
+}
+
+static
+int legacy_remove_key(int dirfd, const struct stache_policy *policy)
+{
+    return remove_key_for_descriptor(backend_key_prefix(dirfd), (key_desc_t *) policy->key_id);
+}
+
+static
+int legacy_key_status(int dirfd, const struct stache_policy *policy, enum stache_key_status *status, key_serial_t *serial)
+{
+    if ( find_key_by_descriptor(backend_key_prefix(dirfd), (key_desc_t *) policy->key_id, serial) == -1 ) {
+        *status = KEY_STATUS_ABSENT;
+        *serial = -1;
+    }
+    else
+        *status = KEY_STATUS_PRESENT;
+
+    return 0;
+}
+
+const struct crypt_backend legacy_backend = {
+    .name = "ext4 (v1 policy, session keyring)",
+    .policy_version = 1,
+    .key_id_size = EXT4_KEY_DESCRIPTOR_SIZE,
+    .key_size = legacy_key_size,
+    .get_policy = legacy_get_policy,
+    .set_policy = legacy_set_policy,
+    .add_key = legacy_add_key,
+    .remove_key = legacy_remove_key,
+    .key_status = legacy_key_status,
+};
@@ -0,0 +1,569 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sodium.h>
+
+#include "stache.h"
+
+/*
+ * In-memory stand-in for the policy ioctls and keyrings.
+ *
+ * Policies are remembered per directory, keyed by device, inode and birth
+ * time so that a recycled inode does not inherit the policy of a removed
+ * directory. Keys are remembered by identifier only: nothing is encrypted,
+ * the key material itself is never kept. Every call can be slowed down and
+ * made to fail, to load-test the daemon on a plain Linux host.
+ */
+
+#define MEMORY_BUCKETS 4096
+
+struct memory_policy {
+    dev_t dev;
+    ino_t ino;
+    int64_t btime_sec;
+    uint32_t btime_nsec;
+    struct stache_policy policy;
+    struct memory_policy *next;
+};
+
+struct memory_key {
+    int version;
+    unsigned char key_id[STACHE_KEY_ID_MAX_SIZE];
+    struct memory_key *next;
+};
+
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memory_policy *policies[MEMORY_BUCKETS];
+static struct memory_key *keys[MEMORY_BUCKETS];
+static struct memory_fault faults[NR_MEMORY_CALLS];
+
+static const char *call_names[NR_MEMORY_CALLS] = {
+    [MEMORY_GET_POLICY] = "get_policy",
+    [MEMORY_SET_POLICY] = "set_policy",
+    [MEMORY_ADD_KEY] = "add_key",
+    [MEMORY_REMOVE_KEY] = "remove_key",
+    [MEMORY_KEY_STATUS] = "key_status",
+};
+
+static __thread uint64_t random_state;
+
+//
+// Cheap per-thread generator for fault injection, not for anything secret.
+//
+static
+uint64_t next_random()
+{
+    if ( random_state == 0 )
+        random_state = stats_now() ^ ((uint64_t) (uintptr_t) &random_state << 16) ^ 0x9e3779b97f4a7c15ULL;
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+//
+// Applies the latency and failure configured for _call_.
+// Returns -1 with errno set when the call is made to fail.
+//
+static
+int inject_fault(enum memory_call call)
+{
+    const struct memory_fault *fault = &faults[call];
+    uint64_t delay_ns = fault->latency_ns;
+
+    if ( fault->jitter_ns )
+        delay_ns += next_random() % fault->jitter_ns;
+
+    if ( delay_ns ) {
+        struct timespec ts = {
+            .tv_sec = delay_ns / 1000000000ULL,
+            .tv_nsec = delay_ns % 1000000000ULL,
+        };
+        while ( nanosleep(&ts, &ts) == -1 && errno == EINTR )
+            ;
+    }
+
+    if ( fault->failure_ppm && next_random() % 1000000 < fault->failure_ppm ) {
+        errno = fault->error ? fault->error : EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+uint32_t key_hash(int version, const unsigned char *key_id)
+{
+    return trace_hash(key_id, version == 1 ? FSCRYPT_KEY_DESCRIPTOR_SIZE : FSCRYPT_KEY_IDENTIFIER_SIZE);
+}
+
+//
+// Identifies the directory behind _dirfd_. The birth time tells a reused inode
+// apart; statx() goes through syscall() since older C libraries lack the
+// wrapper, and without it the inode alone has to do.
+//
+static
+int identify(int dirfd, struct memory_policy *id)
+{
+    memset(id, 0, sizeof(*id));
+
+#if defined(__NR_statx) && defined(STATX_BTIME)
+    struct statx stx;
+
+    if ( syscall(__NR_statx, dirfd, "", AT_EMPTY_PATH, STATX_INO | STATX_BTIME, &stx) == 0 ) {
+        id->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        id->ino = stx.stx_ino;
+        if ( stx.stx_mask & STATX_BTIME ) {
+            id->btime_sec = stx.stx_btime.tv_sec;
+            id->btime_nsec = stx.stx_btime.tv_nsec;
+        }
+        return 0;
+    }
+    if ( errno != ENOSYS )
+        return -1;
+#endif
+
+    struct stat st;
+
+    if ( fstat(dirfd, &st) != 0 )
+        return -1;
+
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    return 0;
+}
+
+static
+unsigned policy_bucket(const struct memory_policy *id)
+{
+    return (id->ino ^ (id->dev * 31)) % MEMORY_BUCKETS;
+}
+
+//
+// Finds the policy of a directory. Stale entries of the same inode are dropped on the way.
+// Called with memory_lock held.
+//
+static
+struct memory_policy *find_policy(const struct memory_policy *id)
+{
+    struct memory_policy **link = &policies[policy_bucket(id)];
+
+    while ( *link ) {
+        struct memory_policy *entry = *link;
+
+        if ( entry->dev == id->dev && entry->ino == id->ino ) {
+            if ( entry->btime_sec == id->btime_sec && entry->btime_nsec == id->btime_nsec )
+                return entry;
+
+            *link = entry->next;
+            free(entry);
+            continue;
+        }
+
+        link = &entry->next;
+    }
+
+    return NULL;
+}
+
+//
+// Finds a key, and the link pointing to it so that it can be removed.
+// Called with memory_lock held.
+//
+static
+struct memory_key **find_key(int version, const unsigned char *key_id)
+{
+    struct memory_key **link = &keys[key_hash(version, key_id) % MEMORY_BUCKETS];
+    size_t size = (version == 1) ? FSCRYPT_KEY_DESCRIPTOR_SIZE : FSCRYPT_KEY_IDENTIFIER_SIZE;
+
+    for ( ; *link; link = &(*link)->next ) {
+        if ( (*link)->version == version && memcmp((*link)->key_id, key_id, size) == 0 )
+            return link;
+    }
+
+    return link;
+}
+
+static
+bool is_empty_directory(int dirfd)
+{
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+    struct dirent *entry;
+    bool empty = true;
+
+    if ( dir == NULL ) {
+        if ( fd != -1 )
+            close(fd);
+        return false;
+    }
+
+    while ( empty && (entry = readdir(dir)) != NULL )
+        empty = (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0);
+
+    closedir(dir);
+    return empty;
+}
+
+static
+int memory_get_policy(int dirfd, struct stache_policy *policy, bool *has_policy)
+{
+    struct memory_policy id;
+
+    uint64_t started_ns = stats_now();
+    int rc = inject_fault(MEMORY_GET_POLICY);
+    if ( rc == 0 )
+        rc = identify(dirfd, &id);
+
+    if ( rc == 0 ) {
+        pthread_mutex_lock(&memory_lock);
+        struct memory_policy *entry = find_policy(&id);
+        *has_policy = (entry != NULL);
+        if ( entry != NULL )
+            *policy = entry->policy;
+        pthread_mutex_unlock(&memory_lock);
+    }
+    trace_phase(STATS_POLICY, started_ns, 0, rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot get encryption policy: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int memory_set_policy(int dirfd, const struct stache_policy *policy)
+{
+    struct memory_policy id;
+    struct memory_policy *entry = NULL;
+    const char *what = NULL;
+
+    uint64_t started_ns = stats_now();
+    int rc = inject_fault(MEMORY_SET_POLICY);
+    if ( rc == 0 )
+        rc = identify(dirfd, &id);
+
+    if ( rc == 0 ) {
+        pthread_mutex_lock(&memory_lock);
+        // Same checks as the kernel, in the same order.
+        struct memory_policy *existing = find_policy(&id);
+        if ( existing != NULL ) {
+            if ( memcmp(&existing->policy, policy, sizeof(*policy)) != 0 ) {
+                what = "Encryption parameters do not match with already previous ones.";
+                errno = EEXIST;
+                rc = -1;
+            }
+        }
+        else if ( !is_empty_directory(dirfd) ) {
+            what = "Cannot create encrypted container: directory must be empty.";
+            errno = ENOTEMPTY;
+            rc = -1;
+        }
+        else if ( policy->version == 2 && *find_key(2, policy->key_id) == NULL ) {
+            what = "Cannot set encryption policy: key was not added to the filesystem.";
+            errno = ENOKEY;
+            rc = -1;
+        }
+        else if ( (entry = malloc(sizeof(*entry))) == NULL ) {
+            rc = -1;
+        }
+        else {
+            *entry = id;
+            entry->policy = *policy;
+            entry->next = policies[policy_bucket(&id)];
+            policies[policy_bucket(&id)] = entry;
+        }
+        pthread_mutex_unlock(&memory_lock);
+    }
+    trace_phase(STATS_POLICY, started_ns, key_hash(policy->version, policy->key_id), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        if ( what != NULL )
+            fprintf(stderr, "%s\n", what);
+        else
+            fprintf(stderr, "Cannot set encryption policy: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int memory_remove_key(int UNUSED dirfd, const struct stache_policy *policy)
+{
+    uint64_t started_ns = stats_now();
+    int rc = inject_fault(MEMORY_REMOVE_KEY);
+
+    if ( rc == 0 ) {
+        pthread_mutex_lock(&memory_lock);
+        struct memory_key **link = find_key(policy->version, policy->key_id);
+        struct memory_key *key = *link;
+        if ( key != NULL ) {
+            *link = key->next;
+            free(key);
+        }
+        else {
+            errno = ENOKEY;
+            rc = -1;
+        }
+        pthread_mutex_unlock(&memory_lock);
+    }
+    trace_phase(STATS_KEY_REMOVE, started_ns, key_hash(policy->version, policy->key_id), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot remove encryption key: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// v2 identifiers are a hash of the key, as with the kernel; v1 keys go by their descriptor.
+//
+static
+int memory_add_key(int dirfd, struct stache_policy *policy, const struct ext4_encryption_key *key, bool verify)
+{
+    unsigned char key_id[STACHE_KEY_ID_MAX_SIZE];
+
+    memcpy(key_id, policy->key_id, sizeof(key_id));
+    if ( policy->version == 2 )
+        crypto_generichash(key_id, FSCRYPT_KEY_IDENTIFIER_SIZE,
+                           (const unsigned char *) key->raw, key->size, NULL, 0);
+
+    uint64_t started_ns = stats_now();
+    int rc = inject_fault(MEMORY_ADD_KEY);
+
+    if ( rc == 0 ) {
+        pthread_mutex_lock(&memory_lock);
+        struct memory_key **link = find_key(policy->version, key_id);
+        if ( *link == NULL ) {
+            struct memory_key *entry = calloc(1, sizeof(*entry));
+            if ( entry != NULL ) {
+                entry->version = policy->version;
+                memcpy(entry->key_id, key_id, sizeof(key_id));
+                *link = entry;
+            }
+            else
+                rc = -1;
+        }
+        pthread_mutex_unlock(&memory_lock);
+    }
+    trace_phase(STATS_KEY_ADD, started_ns, key_hash(policy->version, key_id), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot add key to filesystem: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ( policy->version != 2 )
+        return 0;
+
+    if ( !verify )
+        memcpy(policy->key_id, key_id, FSCRYPT_KEY_IDENTIFIER_SIZE);
+    else if ( memcmp(policy->key_id, key_id, FSCRYPT_KEY_IDENTIFIER_SIZE) != 0 ) {
+        struct stache_policy wrong_key = *policy;
+
+        memcpy(wrong_key.key_id, key_id, FSCRYPT_KEY_IDENTIFIER_SIZE);
+        memory_remove_key(dirfd, &wrong_key);
+
+        fprintf(stderr, "Wrong passphrase: key does not match the container.\n");
+        errno = EKEYREJECTED;
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int memory_key_status(int UNUSED dirfd, const struct stache_policy *policy, enum stache_key_status *status,
+                      key_serial_t *serial)
+{
+    uint64_t started_ns = stats_now();
+    int rc = inject_fault(MEMORY_KEY_STATUS);
+
+    *serial = -1;
+    if ( rc == 0 ) {
+        pthread_mutex_lock(&memory_lock);
+        *status = *find_key(policy->version, policy->key_id) ? KEY_STATUS_PRESENT : KEY_STATUS_ABSENT;
+        pthread_mutex_unlock(&memory_lock);
+    }
+    trace_phase(STATS_KEY_SEARCH, started_ns, key_hash(policy->version, policy->key_id), rc < 0 ? errno : 0);
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Cannot get encryption key status: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+size_t memory_legacy_key_size(const struct stache_policy *policy)
+{
+    return legacy_backend.key_size(policy);
+}
+
+static
+size_t memory_fscrypt_key_size(const struct stache_policy *policy)
+{
+    return fscrypt_backend.key_size(policy);
+}
+
+const struct crypt_backend memory_legacy_backend = {
+    .name = "memory (v1 policy, simulated)",
+    .policy_version = 1,
+    .key_id_size = EXT4_KEY_DESCRIPTOR_SIZE,
+    .key_size = memory_legacy_key_size,
+    .get_policy = memory_get_policy,
+    .set_policy = memory_set_policy,
+    .add_key = memory_add_key,
+    .remove_key = memory_remove_key,
+    .key_status = memory_key_status,
+};
+
+const struct crypt_backend memory_fscrypt_backend = {
+    .name = "memory (v2 policy, simulated)",
+    .policy_version = 2,
+    .key_id_size = FSCRYPT_KEY_IDENTIFIER_SIZE,
+    .key_size = memory_fscrypt_key_size,
+    .get_policy = memory_get_policy,
+    .set_policy = memory_set_policy,
+    .add_key = memory_add_key,
+    .remove_key = memory_remove_key,
+    .key_status = memory_key_status,
+};
+
+//
+// Parses one duration in microseconds, with an optional ms or s suffix.
+//
+static
+int parse_duration(const char *text, char **end, uint64_t *ns)
+{
+    double value = strtod(text, end);
+
+    if ( *end == text || value < 0 )
+        return -1;
+
+    if ( strncmp(*end, "ms", 2) == 0 ) {
+        value *= 1e6;
+        *end += 2;
+    }
+    else if ( strncmp(*end, "us", 2) == 0 ) {
+        value *= 1e3;
+        *end += 2;
+    }
+    else if ( **end == 's' ) {
+        value *= 1e9;
+        (*end)++;
+    }
+    else
+        value *= 1e3;
+
+    *ns = (uint64_t) value;
+    return 0;
+}
+
+//
+// Parses one "<call>=<latency>[+<jitter>][/<failure percent>]" item.
+//
+static
+int parse_fault(const char *item, size_t length)
+{
+    char buf[128];
+    struct memory_fault fault = { 0 };
+    char *value, *end;
+
+    if ( length >= sizeof(buf) )
+        return -1;
+
+    memcpy(buf, item, length);
+    buf[length] = '\0';
+
+    value = strchr(buf, '=');
+    if ( value == NULL )
+        return -1;
+    *value++ = '\0';
+
+    if ( parse_duration(value, &end, &fault.latency_ns) < 0 )
+        return -1;
+
+    if ( *end == '+' && parse_duration(end + 1, &end, &fault.jitter_ns) < 0 )
+        return -1;
+
+    if ( *end == '/' ) {
+        double percent = strtod(end + 1, &end);
+        if ( percent < 0 || percent > 100 )
+            return -1;
+        fault.failure_ppm = (unsigned) (percent * 10000);
+        fault.error = EIO;
+    }
+
+    if ( *end != '\0' )
+        return -1;
+
+    bool found = false;
+    for ( int call = 0; call < NR_MEMORY_CALLS; call++ ) {
+        if ( strcmp(buf, "all") == 0 || strcmp(buf, call_names[call]) == 0 ) {
+            faults[call] = fault;
+            found = true;
+        }
+    }
+
+    return found ? 0 : -1;
+}
+
+int memory_backend_configure(const char *spec)
+{
+    memset(faults, 0, sizeof(faults));
+
+    while ( spec != NULL && *spec != '\0' ) {
+        const char *next = strchr(spec, ',');
+        size_t length = next ? (size_t) (next - spec) : strlen(spec);
+
+        if ( parse_fault(spec, length) < 0 ) {
+            fprintf(stderr, "Invalid memory backend setting: %.*s\n", (int) length, spec);
+            return -1;
+        }
+
+        spec = next ? next + 1 : NULL;
+    }
+
+    return 0;
+}
+
+void memory_backend_set_fault(enum memory_call call, const struct memory_fault *fault)
+{
+    if ( call < NR_MEMORY_CALLS )
+        faults[call] = *fault;
+}
@@ -0,0 +1,22 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    bench.c \
+	bench_io.c \
+	bench_kdf.c \
+	bench_metadata.c \
+	bench_policy.c \
+	bench_random.c
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+	$(stache_c_includes)
+
+LOCAL_STATIC_LIBRARIES := libstache
+LOCAL_SHARED_LIBRARIES := $(stache_shared_libraries)
+
+LOCAL_MODULE := stache_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,447 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+// Throwaway key material: benchmarks measure the kernel, not scrypt.
+static char bench_key[FSCRYPT_MAX_KEY_SIZE];
+static bool bench_key_ready = false;
+
+uint64_t bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// System-wide busy CPU time from /proc/stat. Encryption runs partly in kernel
+// workers, so the time of the benchmark process alone would undercount it.
+//
+uint64_t bench_cpu_busy_ns()
+{
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal = 0;
+    FILE *stat = fopen("/proc/stat", "r");
+    int n = 0;
+
+    if ( stat == NULL )
+        return 0;
+
+    n = fscanf(stat, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(stat);
+
+    if ( n < 7 )
+        return 0;
+
+    return (user + nice + system + irq + softirq + steal) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+//
+// Policy version to benchmark: the requested one, or the best the kernel supports.
+//
+int bench_policy_version(struct bench_options *bopts)
+{
+    if ( bopts->policy_version != 0 )
+        return bopts->policy_version;
+
+    int dirfd = open(bopts->base_dir, O_RDONLY | O_DIRECTORY);
+    if ( dirfd == -1 )
+        return 1;
+
+    bool has_v2 = fscrypt_v2_supported(dirfd);
+    close(dirfd);
+    return has_v2 ? 2 : 1;
+}
+
+int samples_add(struct bench_samples *samples, uint64_t value)
+{
+    if ( samples->count == samples->capacity ) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 64;
+        uint64_t *values = realloc(samples->values, capacity * sizeof(*values));
+        if ( values == NULL )
+            return -1;
+
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+void samples_free(struct bench_samples *samples)
+{
+    free(samples->values);
+    memset(samples, 0, sizeof(*samples));
+}
+
+static
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+uint64_t samples_percentile(struct bench_samples *samples, double percentile)
+{
+    if ( samples->count == 0 )
+        return 0;
+
+    qsort(samples->values, samples->count, sizeof(*samples->values), compare_u64);
+
+    size_t index = (size_t) (percentile / 100.0 * (samples->count - 1) + 0.5);
+    return samples->values[index];
+}
+
+double samples_mean(const struct bench_samples *samples)
+{
+    double sum = 0;
+
+    if ( samples->count == 0 )
+        return 0;
+
+    for ( size_t i = 0; i < samples->count; i++ )
+        sum += samples->values[i];
+
+    return sum / samples->count;
+}
+
+//
+// Default container options for benchmarks, keyed with raw key material.
+//
+void bench_crypt_options(struct ext4_crypt_options *opts, int policy_version)
+{
+    if ( !bench_key_ready ) {
+        randombytes_buf(bench_key, sizeof(bench_key));
+        bench_key_ready = true;
+    }
+
+    *opts = (struct ext4_crypt_options) {
+        .verbose = false,
+        .contents_cipher = "aes-256-xts",
+        .filename_cipher = "aes-256-cts",
+        .filename_padding = 4,
+        .requires_descriptor = true,
+        .secret_fd = -1,
+        .secret = bench_key,
+        .secret_size = 0,
+        .secret_is_key = true,
+        .policy_version = policy_version,
+        .warm = false,
+        .evict = false,
+        .rate_limit = 0,
+    };
+}
+
+static
+int make_scratch_directory(struct bench_options *bopts, const char *label, char *path, size_t path_sz)
+{
+    if ( (size_t) snprintf(path, path_sz, "%s/stache-bench-%s-XXXXXX", bopts->base_dir, label) >= path_sz ) {
+        fprintf(stderr, "Benchmark path is too long.\n");
+        return -1;
+    }
+
+    if ( mkdtemp(path) == NULL ) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int bench_make_plain_directory(struct bench_options *bopts, const char *label, char *path, size_t path_sz)
+{
+    return make_scratch_directory(bopts, label, path, path_sz);
+}
+
+//
+// Creates a fresh container under the benchmark directory.
+// The key size in _opts_ is adjusted to the policy, so that the same options attach it again.
+//
+int bench_make_container(struct bench_options *bopts, const char *label, struct ext4_crypt_options *opts,
+                         char *path, size_t path_sz)
+{
+    if ( make_scratch_directory(bopts, label, path, path_sz) < 0 )
+        return -1;
+
+    // Raw key size follows the policy: the contents cipher for v1, the maximum for v2.
+    opts->secret_size = (opts->policy_version == 1) ? cipher_key_size(opts->contents_cipher) : sizeof(bench_key);
+
+    if ( container_create(path, *opts) < 0 ) {
+        rmdir(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int remove_entry(const char *path, const struct stat UNUSED *st, int type, struct FTW *ftw)
+{
+    // The top directory itself is kept.
+    if ( ftw->level == 0 )
+        return 0;
+
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+void bench_empty_directory(const char *path)
+{
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+void bench_remove_tree(const char *path)
+{
+    bench_empty_directory(path);
+    rmdir(path);
+}
+
+//
+// Removes a benchmark container: its contents while the key is still there, then the key.
+//
+void bench_destroy_container(const char *path, struct ext4_crypt_options opts)
+{
+    bench_empty_directory(path);
+    container_detach(path, opts, stdout);
+    rmdir(path);
+}
+
+void bench_report_latency(struct bench_options *bopts, const char *bench, const char *label,
+                          const char *op, struct bench_samples *samples)
+{
+    fprintf(bopts->out,
+            "{\"bench\":\"%s\",\"fs\":\"%s\",\"case\":\"%s\",\"op\":\"%s\",\"n\":%zu,"
+            "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+            bench, bopts->filesystem, label, op, samples->count,
+            samples_mean(samples) / 1000.0,
+            samples_percentile(samples, 50) / 1000.0,
+            samples_percentile(samples, 99) / 1000.0,
+            samples_percentile(samples, 100) / 1000.0);
+    fflush(bopts->out);
+}
+
+void bench_report_throughput(struct bench_options *bopts, const char *bench, const char *label,
+                             const char *op, uint64_t count, const char *unit, uint64_t elapsed_ns, uint64_t cpu_ns)
+{
+    double seconds = elapsed_ns / 1e9;
+
+    fprintf(bopts->out,
+            "{\"bench\":\"%s\",\"fs\":\"%s\",\"case\":\"%s\",\"op\":\"%s\",\"%s\":%llu,"
+            "\"seconds\":%.6f,\"%s_per_s\":%.3f,\"cpu_ns_per_%s\":%.3f}\n",
+            bench, bopts->filesystem, label, op, unit, (unsigned long long) count,
+            seconds, unit, seconds > 0 ? count / seconds : 0.0,
+            unit, count > 0 ? (double) cpu_ns / count : 0.0);
+    fflush(bopts->out);
+}
+
+static
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <benchmark>\n", program);
+    fprintf(stderr, "Benchmarks for stache encrypted containers. Results are printed as JSON lines.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Benchmarks:\n");
+    fprintf(stderr, "  policy           Attach, status and detach latency for v1 and v2 policies.\n");
+    fprintf(stderr, "  io               Sequential/random throughput, fsync latency and CPU per byte\n");
+    fprintf(stderr, "                   for every supported cipher and padding, against plaintext.\n");
+    fprintf(stderr, "  metadata         Create, stat, readdir and cold lookup rates for every filename\n");
+    fprintf(stderr, "                   padding, against plaintext.\n");
+    fprintf(stderr, "  random           Cost of random names from libc, the CSPRNG and the random pool,\n");
+    fprintf(stderr, "                   and uniqueness and bias checks of the names of the pool.\n");
+    fprintf(stderr, "  kdf              Passphrase derivation latency on each CPU, and with the placement\n");
+    fprintf(stderr, "                   of kdf work given with -C.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d <DIR>:        Scratch directory on the filesystem under test (default is /data/stache).\n");
+    fprintf(stderr, "  -n <COUNT>:      Iterations per measurement (default is 100).\n");
+    fprintf(stderr, "  -o <FILE>:       Write results to FILE instead of standard output.\n");
+    fprintf(stderr, "  -P <VERSION>:    Policy version to benchmark (default is the best supported).\n");
+    fprintf(stderr, "  -s <MB>:         Size of the I/O test file (default is 64).\n");
+    fprintf(stderr, "  -b <KB>:         Block size of sequential I/O (default is 128).\n");
+    fprintf(stderr, "  -f <COUNT>:      Number of files for the metadata benchmark (default is 10000).\n");
+    fprintf(stderr, "  -l <LENGTH>:     File name length for the metadata benchmark (default is 16).\n");
+    fprintf(stderr, "  -B <BACKEND>:    kernel (default), or memory[:<faults>] to simulate the kernel,\n");
+    fprintf(stderr, "                   with the syntax of STACHE_BACKEND.\n");
+    fprintf(stderr, "  -C <CPUS>:       CPU placement of work classes, with the syntax of STACHE_CPUS.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = basename(argv[0]);
+    const char *output = NULL;
+    struct bench_options bopts = {
+        .base_dir = "/data/stache",
+        .filesystem = "unknown",
+        .iterations = 100,
+        .out = NULL,
+        .policy_version = 0,
+        .file_size = 64 << 20,
+        .block_size = 128 << 10,
+        .file_count = 10000,
+        .name_length = 16,
+    };
+    int c;
+
+    while ( (c = getopt(argc, argv, "hd:n:o:P:s:b:f:l:B:C:")) != -1 ) {
+        switch ( c ) {
+            case 'd':
+                bopts.base_dir = optarg;
+                break;
+
+            case 'n':
+                bopts.iterations = atoi(optarg);
+                if ( bopts.iterations == 0 ) {
+                    fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            case 'P':
+                bopts.policy_version = atoi(optarg);
+                if ( bopts.policy_version != 1 && bopts.policy_version != 2 ) {
+                    fprintf(stderr, "Invalid policy version: must be 1 or 2\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 's':
+                bopts.file_size = (size_t) atoi(optarg) << 20;
+                break;
+
+            case 'b':
+                bopts.block_size = (size_t) atoi(optarg) << 10;
+                break;
+
+            case 'f':
+                bopts.file_count = atoi(optarg);
+                break;
+
+            case 'l':
+                bopts.name_length = atoi(optarg);
+                if ( bopts.name_length < 1 || bopts.name_length > NAME_MAX ) {
+                    fprintf(stderr, "Invalid name length: must be between 1 and %d\n", NAME_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'B':
+                if ( backend_use(optarg) < 0 )
+                    return EXIT_FAILURE;
+                break;
+
+            case 'C':
+                if ( placement_configure(optarg) < 0 )
+                    return EXIT_FAILURE;
+                break;
+
+            case 'h':
+                usage(program);
+                return EXIT_SUCCESS;
+
+            default:
+                usage(program);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ( optind >= argc ) {
+        usage(program);
+        return EXIT_FAILURE;
+    }
+
+    if ( bopts.block_size == 0 || bopts.file_size < bopts.block_size ) {
+        fprintf(stderr, "Invalid sizes: the file must hold at least one block.\n");
+        return EXIT_FAILURE;
+    }
+
+    // File names are their index padded to the name length: every index must fit.
+    if ( bopts.file_count > 0 && (unsigned) snprintf(NULL, 0, "%u", bopts.file_count - 1) > bopts.name_length ) {
+        fprintf(stderr, "Invalid name length: %u characters cannot name %u files.\n",
+                bopts.name_length, bopts.file_count);
+        return EXIT_FAILURE;
+    }
+
+    // The container functions report progress on stdout; keep results apart from it.
+    if ( output != NULL )
+        bopts.out = fopen(output, "w");
+    else
+        bopts.out = fdopen(dup(STDOUT_FILENO), "w");
+
+    if ( bopts.out == NULL ) {
+        fprintf(stderr, "Cannot open output: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int devnull = open("/dev/null", O_WRONLY);
+    if ( devnull != -1 ) {
+        fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    if ( crypto_init() == -1 )
+        return EXIT_FAILURE;
+
+    int base_fd = open(bopts.base_dir, O_RDONLY | O_DIRECTORY);
+    if ( base_fd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", bopts.base_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if ( backend_filesystem_name(base_fd) != NULL )
+        bopts.filesystem = backend_filesystem_name(base_fd);
+    close(base_fd);
+
+    int status;
+    const char *benchmark = argv[optind];
+
+    if ( strcmp(benchmark, "policy") == 0 )
+        status = policy_benchmark(&bopts);
+    else if ( strcmp(benchmark, "io") == 0 )
+        status = io_benchmark(&bopts);
+    else if ( strcmp(benchmark, "metadata") == 0 )
+        status = metadata_benchmark(&bopts);
+    else if ( strcmp(benchmark, "random") == 0 )
+        status = random_benchmark(&bopts);
+    else if ( strcmp(benchmark, "kdf") == 0 )
+        status = kdf_benchmark(&bopts);
+    else {
+        fprintf(stderr, "Error: unrecognized benchmark %s\n", benchmark);
+        usage(program);
+        status = -1;
+    }
+
+    fclose(bopts.out);
+    return (status == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACHE_BENCH_H
+#define _STACHE_BENCH_H
+
+#include "stache.h"
+
+struct bench_options {
+    const char *base_dir;       // scratch directory on the filesystem under test
+    const char *filesystem;     // of base_dir, reported with every result
+    unsigned iterations;
+    FILE *out;                  // machine-readable results, one JSON object per line
+    int policy_version;         // 0 for the best supported
+    size_t file_size;
+    size_t block_size;
+    unsigned file_count;
+    unsigned name_length;
+};
+
+struct bench_samples {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+uint64_t bench_now_ns();
+uint64_t bench_cpu_busy_ns();
+int bench_policy_version(struct bench_options *);
+int samples_add(struct bench_samples *, uint64_t);
+void samples_free(struct bench_samples *);
+uint64_t samples_percentile(struct bench_samples *, double);
+double samples_mean(const struct bench_samples *);
+
+void bench_crypt_options(struct ext4_crypt_options *, int policy_version);
+int bench_make_container(struct bench_options *, const char *label, struct ext4_crypt_options *, char *path, size_t);
+int bench_make_plain_directory(struct bench_options *, const char *label, char *path, size_t);
+void bench_empty_directory(const char *path);
+void bench_remove_tree(const char *path);
+void bench_destroy_container(const char *path, struct ext4_crypt_options);
+void bench_report_latency(struct bench_options *, const char *bench, const char *label,
+                          const char *op, struct bench_samples *);
+void bench_report_throughput(struct bench_options *, const char *bench, const char *label,
+                             const char *op, uint64_t count, const char *unit, uint64_t elapsed_ns, uint64_t cpu_ns);
+
+int policy_benchmark(struct bench_options *);
+int io_benchmark(struct bench_options *);
+int metadata_benchmark(struct bench_options *);
+int random_benchmark(struct bench_options *);
+int kdf_benchmark(struct bench_options *);
+
+#endif /* _STACHE_BENCH_H */
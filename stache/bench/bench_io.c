@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+#define RANDOM_IO_SIZE 4096
+
+//
+// Writes the whole file sequentially and makes it durable.
+//
+static
+int sequential_write(struct bench_options *bopts, int fd, const char *buf)
+{
+    for ( size_t offset = 0; offset < bopts->file_size; offset += bopts->block_size ) {
+        if ( pwrite(fd, buf, bopts->block_size, offset) != (ssize_t) bopts->block_size ) {
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return fsync(fd);
+}
+
+static
+int sequential_read(struct bench_options *bopts, int fd, char *buf)
+{
+    for ( size_t offset = 0; offset < bopts->file_size; offset += bopts->block_size ) {
+        if ( pread(fd, buf, bopts->block_size, offset) != (ssize_t) bopts->block_size ) {
+            fprintf(stderr, "Read failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+int random_io(struct bench_options *bopts, int fd, char *buf, size_t count, bool write)
+{
+    uint32_t blocks = bopts->file_size / RANDOM_IO_SIZE;
+
+    for ( size_t i = 0; i < count; i++ ) {
+        off_t offset = (off_t) randombytes_uniform(blocks) * RANDOM_IO_SIZE;
+        ssize_t n = write ? pwrite(fd, buf, RANDOM_IO_SIZE, offset) : pread(fd, buf, RANDOM_IO_SIZE, offset);
+
+        if ( n != RANDOM_IO_SIZE ) {
+            fprintf(stderr, "Random %s failed: %s\n", write ? "write" : "read", strerror(errno));
+            return -1;
+        }
+    }
+
+    return write ? fsync(fd) : 0;
+}
+
+//
+// Drops the cached pages of the file so that reads hit the disk (and the decryption path).
+//
+static
+void drop_file_cache(int fd)
+{
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+//
+// Runs the I/O workload in directory _dir_path_ and reports it under _label_.
+//
+static
+int run_io_case(struct bench_options *bopts, const char *label, const char *dir_path)
+{
+    char path[PATH_MAX];
+    int ret = -1;
+    size_t random_count = bopts->file_size / RANDOM_IO_SIZE / 4;
+    struct bench_samples fsync_latency = { 0 };
+    char *buf = NULL;
+
+    snprintf(path, sizeof(path), "%s/io", dir_path);
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    if ( fd == -1 ) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if ( posix_memalign((void **) &buf, 4096, bopts->block_size) != 0 )
+        goto out;
+    randombytes_buf(buf, bopts->block_size);
+
+    uint64_t start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( sequential_write(bopts, fd, buf) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "io", label, "seq_write", bopts->file_size, "byte",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    drop_file_cache(fd);
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( sequential_read(bopts, fd, buf) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "io", label, "seq_read", bopts->file_size, "byte",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    drop_file_cache(fd);
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( random_io(bopts, fd, buf, random_count, false) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "io", label, "rand_read", random_count * RANDOM_IO_SIZE, "byte",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( random_io(bopts, fd, buf, random_count, true) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "io", label, "rand_write", random_count * RANDOM_IO_SIZE, "byte",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    for ( unsigned i = 0; i < bopts->iterations; i++ ) {
+        off_t offset = (off_t) randombytes_uniform(bopts->file_size / RANDOM_IO_SIZE) * RANDOM_IO_SIZE;
+
+        if ( pwrite(fd, buf, RANDOM_IO_SIZE, offset) != RANDOM_IO_SIZE )
+            goto out;
+
+        start = bench_now_ns();
+        if ( fsync(fd) != 0 )
+            goto out;
+        samples_add(&fsync_latency, bench_now_ns() - start);
+    }
+    bench_report_latency(bopts, "io", label, "fsync", &fsync_latency);
+
+    ret = 0;
+
+out:
+    close(fd);
+    unlink(path);
+    free(buf);
+    samples_free(&fsync_latency);
+    return ret;
+}
+
+int io_benchmark(struct bench_options *bopts)
+{
+    char path[PATH_MAX];
+    char label[64];
+    int policy_version = bench_policy_version(bopts);
+    struct feature_matrix matrix;
+    bool probed = (features_probe(bopts->base_dir, &matrix) == 0);
+
+    if ( !probed )
+        fprintf(stderr, "Cannot probe encryption features, trying every cipher.\n");
+
+    // Plaintext baseline on the same filesystem.
+    if ( bench_make_plain_directory(bopts, "plain", path, sizeof(path)) < 0 )
+        return -1;
+
+    int ret = run_io_case(bopts, "plain", path);
+    bench_remove_tree(path);
+    if ( ret < 0 )
+        return -1;
+
+    for ( size_t mode = 1; mode < NR_EXT4_ENCRYPTION_MODES; mode++ ) {
+        const char *contents_cipher = cipher_modes[mode].cipher_name;
+        if ( contents_cipher == NULL || cipher_preset_filenames(contents_cipher) == NULL )
+            continue;
+
+        for ( unsigned padding = 4; padding <= 32; padding *= 2 ) {
+            struct ext4_crypt_options opts;
+
+            if ( !features_supported(probed ? &matrix : NULL, policy_version, mode, padding_length_to_flags(padding)) )
+                continue;
+
+            bench_crypt_options(&opts, policy_version);
+            opts.contents_cipher = (char *) contents_cipher;
+            opts.filename_cipher = (char *) cipher_preset_filenames(contents_cipher);
+            opts.filename_padding = padding;
+
+            snprintf(label, sizeof(label), "v%d/%s/pad%u", policy_version, contents_cipher, padding);
+            if ( bench_make_container(bopts, "io", &opts, path, sizeof(path)) < 0 ) {
+                fprintf(stderr, "Skipping %s: cannot create container.\n", label);
+                continue;
+            }
+
+            ret = run_io_case(bopts, label, path);
+            bench_destroy_container(path, opts);
+            if ( ret < 0 )
+                return -1;
+        }
+    }
+
+    return 0;
+}
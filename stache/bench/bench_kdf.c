@@ -0,0 +1,125 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+#define KDF_BENCH_RUNS 5                // per CPU: a derivation takes a good fraction of a second
+
+static const char bench_passphrase[] = "stache benchmark passphrase";
+
+static
+int derive(const struct kdf_params *kdf)
+{
+    uint8_t key[EXT4_AES_256_XTS_KEY_SIZE];
+
+    int ret = crypto_pwhash_scryptsalsa208sha256_ll((const uint8_t *) bench_passphrase, sizeof(bench_passphrase) - 1,
+                                                    kdf->salt, kdf->salt_size,
+                                                    (1ULL << kdf->log_n), kdf->r, kdf->p,
+                                                    key, sizeof(key));
+    sodium_memzero(key, sizeof(key));
+    if ( ret != 0 )
+        fprintf(stderr, "scrypt failed: %s\n", strerror(errno));
+    return ret;
+}
+
+//
+// Times derivations with the calling thread pinned to _cpu_, or placed as the
+// kdf class of the daemon when _cpu_ is -1.
+//
+static
+int run_kdf_case(struct bench_options *bopts, const struct kdf_params *kdf, int cpu, unsigned runs)
+{
+    struct bench_samples latency = { 0 };
+    char label[16];
+    int ret = -1;
+
+    if ( cpu >= 0 ) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ( sched_setaffinity(0, sizeof(cpus), &cpus) < 0 ) {
+            fprintf(stderr, "Cannot run on CPU %d: %s\n", cpu, strerror(errno));
+            return -1;
+        }
+        snprintf(label, sizeof(label), "cpu%d", cpu);
+    }
+    else {
+        snprintf(label, sizeof(label), "placed");
+    }
+
+    for ( unsigned i = 0; i < runs; i++ ) {
+        struct placement_token placement;
+
+        if ( cpu < 0 )
+            placement_enter(WORK_KDF, &placement);
+        uint64_t start = bench_now_ns();
+        int derived = derive(kdf);
+        uint64_t elapsed_ns = bench_now_ns() - start;
+        if ( cpu < 0 )
+            placement_leave(WORK_KDF, &placement);
+
+        if ( derived != 0 || samples_add(&latency, elapsed_ns) < 0 )
+            goto out;
+    }
+
+    bench_report_latency(bopts, "kdf", label, "derive", &latency);
+    ret = 0;
+
+out:
+    samples_free(&latency);
+    return ret;
+}
+
+//
+// Cost of a derivation on each CPU, which tells the fast cores from the slow
+// ones on heterogeneous CPUs, then with the placement of the daemon (-C).
+//
+int kdf_benchmark(struct bench_options *bopts)
+{
+    unsigned runs = (bopts->iterations < KDF_BENCH_RUNS) ? bopts->iterations : KDF_BENCH_RUNS;
+    struct kdf_params kdf;
+    cpu_set_t allowed;
+    int ret = 0;
+
+    if ( sched_getaffinity(0, sizeof(allowed), &allowed) < 0 ) {
+        fprintf(stderr, "Cannot get the CPUs of the benchmark: %s\n", strerror(errno));
+        return -1;
+    }
+
+    kdf_params_generate(&kdf);
+    for ( int cpu = 0; cpu < PLACEMENT_MAX_CPUS && ret == 0; cpu++ ) {
+        if ( CPU_ISSET(cpu, &allowed) )
+            ret = run_kdf_case(bopts, &kdf, cpu, runs);
+    }
+
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+    if ( ret == 0 )
+        ret = run_kdf_case(bopts, &kdf, -1, runs);
+
+    placement_print(stderr);
+    return ret;
+}
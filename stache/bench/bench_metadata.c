@@ -0,0 +1,221 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+//
+// Builds the name of file _index_, _length_ characters long.
+// Names are padded with digits so that every file name has the same length;
+// the options were checked to leave room for the largest index.
+//
+static
+void file_name(struct bench_options *bopts, unsigned index, char *name, size_t name_sz)
+{
+    char digits[16];
+    int n = snprintf(digits, sizeof(digits), "%u", index);
+    size_t length = bopts->name_length;
+
+    if ( length >= name_sz )
+        length = name_sz - 1;
+
+    memset(name, '0', length - n);
+    memcpy(name + length - n, digits, n);
+    name[length] = '\0';
+}
+
+//
+// Drops dentries and inodes so that lookups have to read and decrypt directory blocks.
+//
+static
+bool drop_metadata_caches()
+{
+    sync();
+
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if ( fd == -1 )
+        return false;
+
+    bool dropped = (write(fd, "2\n", 2) == 2);
+    close(fd);
+    return dropped;
+}
+
+static
+int count_entries(int dirfd, uint64_t *entries)
+{
+    struct dirent *entry;
+    int fd = dup(dirfd);
+    if ( fd == -1 )
+        return -1;
+
+    DIR *dir = fdopendir(fd);
+    if ( dir == NULL ) {
+        close(fd);
+        return -1;
+    }
+
+    rewinddir(dir);
+    *entries = 0;
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 )
+            (*entries)++;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+//
+// Runs the metadata workload in directory _dir_path_ and reports it under _label_.
+//
+static
+int run_metadata_case(struct bench_options *bopts, const char *label, const char *dir_path)
+{
+    char name[NAME_MAX + 1];
+    struct stat st;
+    uint64_t entries;
+    struct bench_samples cold_lookup = { 0 };
+    int ret = -1;
+
+    int dirfd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if ( dirfd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    for ( unsigned i = 0; i < bopts->file_count; i++ ) {
+        file_name(bopts, i, name, sizeof(name));
+
+        int fd = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+        if ( fd == -1 ) {
+            fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+            goto out;
+        }
+        close(fd);
+    }
+    syncfs(dirfd);
+    bench_report_throughput(bopts, "metadata", label, "create", bopts->file_count, "file",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    for ( unsigned i = 0; i < bopts->file_count; i++ ) {
+        file_name(bopts, i, name, sizeof(name));
+        if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 )
+            goto out;
+    }
+    bench_report_throughput(bopts, "metadata", label, "stat", bopts->file_count, "file",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( count_entries(dirfd, &entries) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "metadata", label, "readdir", entries, "entry",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    if ( !drop_metadata_caches() ) {
+        fprintf(stderr, "Cannot drop caches (not root?), skipping cold measurements.\n");
+        ret = 0;
+        goto out;
+    }
+
+    start = bench_now_ns(), cpu = bench_cpu_busy_ns();
+    if ( count_entries(dirfd, &entries) < 0 )
+        goto out;
+    bench_report_throughput(bopts, "metadata", label, "readdir_cold", entries, "entry",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu);
+
+    drop_metadata_caches();
+    for ( unsigned i = 0; i < bopts->iterations; i++ ) {
+        file_name(bopts, randombytes_uniform(bopts->file_count), name, sizeof(name));
+
+        start = bench_now_ns();
+        if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 )
+            goto out;
+        samples_add(&cold_lookup, bench_now_ns() - start);
+    }
+    bench_report_latency(bopts, "metadata", label, "lookup_cold", &cold_lookup);
+
+    ret = 0;
+
+out:
+    close(dirfd);
+    samples_free(&cold_lookup);
+    return ret;
+}
+
+int metadata_benchmark(struct bench_options *bopts)
+{
+    char path[PATH_MAX];
+    char label[64];
+    int policy_version = bench_policy_version(bopts);
+
+    if ( bopts->file_count == 0 ) {
+        fprintf(stderr, "Invalid file count.\n");
+        return -1;
+    }
+
+    struct feature_matrix matrix;
+    bool probed = (features_probe(bopts->base_dir, &matrix) == 0);
+    if ( !probed )
+        fprintf(stderr, "Cannot probe encryption features, trying every padding.\n");
+
+    if ( bench_make_plain_directory(bopts, "plain", path, sizeof(path)) < 0 )
+        return -1;
+
+    int ret = run_metadata_case(bopts, "plain", path);
+    bench_remove_tree(path);
+    if ( ret < 0 )
+        return -1;
+
+    // Filename encryption cost depends on the filenames cipher and the padding.
+    for ( unsigned padding = 4; padding <= 32; padding *= 2 ) {
+        struct ext4_crypt_options opts;
+
+        bench_crypt_options(&opts, policy_version);
+        opts.filename_padding = padding;
+        if ( !features_supported(probed ? &matrix : NULL, policy_version,
+                                 cipher_string_to_mode(opts.contents_cipher), padding_length_to_flags(padding)) )
+            continue;
+
+        snprintf(label, sizeof(label), "v%d/%s/pad%u/name%u", policy_version, opts.filename_cipher,
+                 padding, bopts->name_length);
+        if ( bench_make_container(bopts, "metadata", &opts, path, sizeof(path)) < 0 ) {
+            fprintf(stderr, "Skipping %s: cannot create container.\n", label);
+            continue;
+        }
+
+        ret = run_metadata_case(bopts, label, path);
+        bench_destroy_container(path, opts);
+        if ( ret < 0 )
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "bench.h"
+
+//
+// Times attach, status and detach on one container of the given policy version.
+//
+static
+int run_policy_case(struct bench_options *bopts, int policy_version)
+{
+    char label[8];
+    char path[PATH_MAX];
+    struct ext4_crypt_options opts;
+    struct bench_samples attach = { 0 }, status = { 0 }, detach = { 0 };
+    int ret = -1;
+
+    snprintf(label, sizeof(label), "v%d", policy_version);
+    bench_crypt_options(&opts, policy_version);
+    if ( bench_make_container(bopts, label, &opts, path, sizeof(path)) < 0 )
+        return -1;
+
+    FILE *devnull = fopen("/dev/null", "w");
+    if ( devnull == NULL )
+        goto out;
+
+    for ( unsigned i = 0; i < bopts->iterations; i++ ) {
+        uint64_t start = bench_now_ns();
+        if ( container_detach(path, opts, devnull) < 0 )
+            goto out;
+        samples_add(&detach, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        if ( container_attach(path, opts) < 0 )
+            goto out;
+        samples_add(&attach, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        if ( container_status(path, devnull) < 0 )
+            goto out;
+        samples_add(&status, bench_now_ns() - start);
+    }
+
+    bench_report_latency(bopts, "policy", label, "attach", &attach);
+    bench_report_latency(bopts, "policy", label, "status", &status);
+    bench_report_latency(bopts, "policy", label, "detach", &detach);
+    ret = 0;
+
+out:
+    if ( devnull != NULL )
+        fclose(devnull);
+
+    bench_destroy_container(path, opts);
+    samples_free(&attach);
+    samples_free(&status);
+    samples_free(&detach);
+    return ret;
+}
+
+int policy_benchmark(struct bench_options *bopts)
+{
+    int dirfd = open(bopts->base_dir, O_RDONLY | O_DIRECTORY);
+    if ( dirfd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", bopts->base_dir, strerror(errno));
+        return -1;
+    }
+
+    bool has_v2 = fscrypt_v2_supported(dirfd);
+    close(dirfd);
+
+    if ( run_policy_case(bopts, 1) < 0 )
+        return -1;
+
+    if ( !has_v2 ) {
+        fprintf(stderr, "Kernel has no fscrypt v2 support, skipping v2 policies.\n");
+        return 0;
+    }
+
+    return run_policy_case(bopts, 2);
+}
@@ -0,0 +1,219 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+#define RANDOM_NAME_LENGTH EXT4_KEY_DESCRIPTOR_SIZE
+#define RANDOM_BENCH_OPS 100000
+#define RANDOM_BENCH_THREADS 4
+#define RANDOM_CHECK_NAMES 1000000
+#define RANDOM_CHI2_LIMIT 111.0             // p = 1e-4 with 61 degrees of freedom
+
+static const char name_charset[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+typedef void (*name_generator_fn)(char *, size_t);
+
+//
+// Names as generated before the pool: libc PRNG and a biased modulo.
+//
+static
+void libc_name(char *name, size_t length)
+{
+    for ( size_t i = 0; i < length; i++ )
+        name[i] = name_charset[ random() % (sizeof(name_charset) - 1) ];
+}
+
+//
+// Names straight from the CSPRNG, one call per character.
+//
+static
+void direct_name(char *name, size_t length)
+{
+    for ( size_t i = 0; i < length; i++ )
+        name[i] = name_charset[ randombytes_uniform(sizeof(name_charset) - 1) ];
+}
+
+static
+void *generate_names(void *arg)
+{
+    name_generator_fn generate = arg;
+    char name[RANDOM_NAME_LENGTH];
+
+    for ( unsigned i = 0; i < RANDOM_BENCH_OPS; i++ )
+        generate(name, sizeof(name));
+
+    return NULL;
+}
+
+//
+// Times single names one by one, then the throughput of concurrent generators.
+//
+static
+int run_generator_case(struct bench_options *bopts, const char *label, name_generator_fn generate)
+{
+    char name[RANDOM_NAME_LENGTH];
+    struct bench_samples latency = { 0 };
+    pthread_t threads[RANDOM_BENCH_THREADS];
+    unsigned started = 0;
+    int ret = -1;
+
+    for ( unsigned i = 0; i < RANDOM_BENCH_OPS; i++ ) {
+        uint64_t start = bench_now_ns();
+        generate(name, sizeof(name));
+        if ( samples_add(&latency, bench_now_ns() - start) < 0 )
+            goto out;
+    }
+    bench_report_latency(bopts, "random", label, "name", &latency);
+
+    uint64_t cpu_start = bench_cpu_busy_ns();
+    uint64_t start = bench_now_ns();
+    for ( ; started < RANDOM_BENCH_THREADS; started++ ) {
+        int err = pthread_create(&threads[started], NULL, generate_names, (void *) generate);
+        if ( err != 0 ) {
+            fprintf(stderr, "Cannot start generator thread: %s\n", strerror(err));
+            goto out;
+        }
+    }
+    for ( unsigned i = 0; i < started; i++ )
+        pthread_join(threads[i], NULL);
+    started = 0;
+
+    bench_report_throughput(bopts, "random", label, "name_mt",
+                            (uint64_t) RANDOM_BENCH_OPS * RANDOM_BENCH_THREADS, "name",
+                            bench_now_ns() - start, bench_cpu_busy_ns() - cpu_start);
+    ret = 0;
+
+out:
+    for ( unsigned i = 0; i < started; i++ )
+        pthread_join(threads[i], NULL);
+
+    samples_free(&latency);
+    return ret;
+}
+
+static
+int compare_names(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+//
+// Checks key descriptor names for duplicates, and each character position
+// for a uniform distribution over the charset with a chi-squared test.
+//
+static
+int check_names(struct bench_options *bopts)
+{
+    const size_t bins = sizeof(name_charset) - 1;
+    uint64_t counts[RANDOM_NAME_LENGTH][sizeof(name_charset) - 1] = { { 0 } };
+    uint64_t *names = malloc(RANDOM_CHECK_NAMES * sizeof(uint64_t));
+    size_t duplicates = 0;
+    double chi2_max = 0;
+
+    if ( names == NULL ) {
+        fprintf(stderr, "Cannot allocate memory for %d names.\n", RANDOM_CHECK_NAMES);
+        return -1;
+    }
+
+    for ( size_t n = 0; n < RANDOM_CHECK_NAMES; n++ ) {
+        char name[RANDOM_NAME_LENGTH];
+
+        generate_random_name(name, sizeof(name));
+        for ( size_t i = 0; i < sizeof(name); i++ ) {
+            const char *c = memchr(name_charset, name[i], bins);
+            if ( c == NULL ) {
+                fprintf(stderr, "Name character 0x%02x out of the charset.\n", (unsigned char) name[i]);
+                free(names);
+                return -1;
+            }
+            counts[i][c - name_charset]++;
+        }
+        memcpy(&names[n], name, sizeof(name));
+    }
+
+    qsort(names, RANDOM_CHECK_NAMES, sizeof(uint64_t), compare_names);
+    for ( size_t n = 1; n < RANDOM_CHECK_NAMES; n++ ) {
+        if ( names[n] == names[n - 1] )
+            duplicates++;
+    }
+    free(names);
+
+    double expected = (double) RANDOM_CHECK_NAMES / bins;
+    for ( size_t i = 0; i < RANDOM_NAME_LENGTH; i++ ) {
+        double chi2 = 0;
+
+        for ( size_t c = 0; c < bins; c++ ) {
+            double delta = counts[i][c] - expected;
+            chi2 += delta * delta / expected;
+        }
+        if ( chi2 > chi2_max )
+            chi2_max = chi2;
+    }
+
+    bool ok = duplicates == 0 && chi2_max < RANDOM_CHI2_LIMIT;
+    fprintf(bopts->out,
+            "{\"bench\":\"random\",\"fs\":\"%s\",\"case\":\"pool\",\"op\":\"check\",\"names\":%d,"
+            "\"duplicates\":%zu,\"chi2_max\":%.3f,\"chi2_limit\":%.1f,\"ok\":%s}\n",
+            bopts->filesystem, RANDOM_CHECK_NAMES, duplicates, chi2_max, RANDOM_CHI2_LIMIT,
+            ok ? "true" : "false");
+    fflush(bopts->out);
+
+    if ( !ok )
+        fprintf(stderr, "Random names failed the uniqueness or bias check.\n");
+
+    return ok ? 0 : -1;
+}
+
+int random_benchmark(struct bench_options *bopts)
+{
+    struct random_pool_stats stats;
+
+    srandom(randombytes_random());
+    if ( run_generator_case(bopts, "libc", libc_name) < 0 )
+        return -1;
+    if ( run_generator_case(bopts, "direct", direct_name) < 0 )
+        return -1;
+
+    if ( random_pool_start() < 0 )
+        return -1;
+    if ( run_generator_case(bopts, "pool", generate_random_name) < 0 )
+        return -1;
+    if ( check_names(bopts) < 0 )
+        return -1;
+
+    random_pool_get_stats(&stats);
+    fprintf(bopts->out,
+            "{\"bench\":\"random\",\"fs\":\"%s\",\"case\":\"pool\",\"op\":\"stats\","
+            "\"served\":%llu,\"refilled\":%llu,\"fallbacks\":%llu,\"fallback_rate\":%.6f}\n",
+            bopts->filesystem, (unsigned long long) stats.blocks_served,
+            (unsigned long long) stats.blocks_refilled, (unsigned long long) stats.fallbacks,
+            (double) stats.fallbacks / (stats.blocks_served + stats.fallbacks + !(stats.blocks_served + stats.fallbacks)));
+    fflush(bopts->out);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# Copyright (C) 2017 The LineageOS Project
+#
+# The code contained herein is licensed under the GNU General Public
+# License. You may obtain a copy of the GNU General Public License
+# Version 2 or later at the following locations:
+#
+# http://www.opensource.org/licenses/gpl-license.html
+# http://www.gnu.org/copyleft/gpl.html
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Runs one stache_bench benchmark on ext4 and on f2fs loopback images of the
+# same size, backed by the same storage, then prints the results side by side.
+# Needs root, a kernel with encryption for both filesystems, mkfs.ext4 and
+# mkfs.f2fs.
+#
+# Usage: compare_filesystems.sh [-w <workdir>] [-s <image MB>] [benchmark [stache_bench options]]
+#
+
+set -e
+
+workdir=${TMPDIR:-/tmp}/stache-fs-compare
+image_mb=2048
+bench=${STACHE_BENCH:-stache_bench}
+
+while getopts "w:s:h" opt; do
+    case $opt in
+        w) workdir=$OPTARG ;;
+        s) image_mb=$OPTARG ;;
+        *) sed -n '/^# Usage/s/^# //p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+benchmark=${1:-io}
+[ $# -gt 0 ] && shift
+
+mkdir -p "$workdir"
+mnt="$workdir/mnt"
+img="$workdir/image"
+
+cleanup() {
+    umount "$mnt" 2>/dev/null || true
+    rm -f "$img"
+}
+trap cleanup EXIT INT TERM
+
+format() {
+    case $1 in
+        ext4) mkfs.ext4 -q -F -O encrypt "$img" ;;
+        f2fs) mkfs.f2fs -q -f -O encrypt "$img" >/dev/null ;;
+    esac
+}
+
+for fs in ext4 f2fs; do
+    rm -f "$img"
+    truncate -s "${image_mb}M" "$img"
+    format $fs
+    mkdir -p "$mnt"
+    mount -o loop "$img" "$mnt"
+
+    echo "Running $benchmark on $fs..." >&2
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    "$bench" -d "$mnt" -o "$workdir/$fs.json" "$@" "$benchmark"
+
+    umount "$mnt"
+done
+
+# Joins both result files on (bench, case, op), comparing the main metric of each line.
+awk '
+function field(line, name,    m) {
+    if ( match(line, "\"" name "\":(\"[^\"]*\"|[0-9.]+)") ) {
+        m = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+        gsub("\"", "", m)
+        return m
+    }
+    return ""
+}
+function metric(line) {
+    if ( field(line, "p50_us") != "" ) { unit = "p50_us"; return field(line, "p50_us") }
+    if ( match(line, "\"[a-z]+_per_s\"") ) {
+        unit = substr(line, RSTART + 1, RLENGTH - 2)
+        return field(line, unit)
+    }
+    unit = "-"
+    return ""
+}
+{
+    key = field($0, "bench") " " field($0, "case") " " field($0, "op")
+    value = metric($0)
+    if ( FILENAME ~ /ext4\.json$/ ) { ext4[key] = value; order[n++] = key }
+    else f2fs[key] = value
+    units[key] = unit
+}
+END {
+    printf "%-10s %-28s %-14s %-14s %14s %14s %8s\n", "bench", "case", "op", "metric", "ext4", "f2fs", "f2fs/ext4"
+    for ( i = 0; i < n; i++ ) {
+        key = order[i]
+        split(key, parts, " ")
+        ratio = (ext4[key] > 0 && f2fs[key] != "") ? sprintf("%.2f", f2fs[key] / ext4[key]) : "-"
+        printf "%-10s %-28s %-14s %-14s %14s %14s %8s\n", parts[1], parts[2], parts[3], units[key], ext4[key], f2fs[key], ratio
+    }
+}' "$workdir/ext4.json" "$workdir/f2fs.json"
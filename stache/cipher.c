@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "stache.h"
+
+struct cipher_preset {
+    const char *contents_cipher;
+    const char *filename_cipher;
+};
+
+// Filenames cipher going with each contents cipher.
+static const struct cipher_preset cipher_presets[] = {
+    { "aes-256-xts",        "aes-256-cts" },
+    { "aes-128-cbc-essiv",  "aes-128-cts" },
+    { "adiantum",           "adiantum" },
+};
+
+#define NR_CIPHER_PRESETS (sizeof(cipher_presets) / sizeof(cipher_presets[0]))
+
+//
+// Checks whether the CPU has AES instructions, as reported in /proc/cpuinfo
+// ("flags" on x86, "Features" on ARM).
+//
+bool cipher_has_aes_acceleration()
+{
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    char line[4096];
+    bool found = false;
+
+    if ( cpuinfo == NULL )
+        return false;
+
+    while ( !found && fgets(line, sizeof(line), cpuinfo) ) {
+        if ( strncmp(line, "flags", 5) != 0 && strncmp(line, "Features", 8) != 0 )
+            continue;
+
+        char *saveptr;
+        char *features = strchr(line, ':');
+        if ( features == NULL )
+            continue;
+
+        for ( char *feature = strtok_r(features + 1, " \t\n", &saveptr); feature != NULL;
+              feature = strtok_r(NULL, " \t\n", &saveptr) ) {
+            if ( strcmp(feature, "aes") == 0 ) {
+                found = true;
+                break;
+            }
+        }
+    }
+
+    fclose(cpuinfo);
+    return found;
+}
+
+//
+// Returns the filenames cipher to use along with a contents cipher.
+//
+const char *cipher_preset_filenames(const char *contents_cipher)
+{
+    for ( size_t i = 0; i < NR_CIPHER_PRESETS; i++ ) {
+        if ( strcmp(contents_cipher, cipher_presets[i].contents_cipher) == 0 )
+            return cipher_presets[i].filename_cipher;
+    }
+
+    return NULL;
+}
+
+//
+// Resolves the "auto" cipher selection into the fastest cipher for this machine:
+// AES-256-XTS when the CPU accelerates AES, Adiantum otherwise if the feature
+// probe could set it up (XChaCha12 is much faster than AES in software), AES-128
+// last. Whether the xchacha12 module happens to be loaded says nothing: a cold
+// kernel loads it on first use. Modes the probe found unusable in _matrix_, the
+// one of the container's filesystem, are skipped.
+//
+void resolve_cipher_options(struct ext4_crypt_options *opts, int policy_version,
+                            const struct feature_matrix *matrix)
+{
+    const char *candidates[NR_CIPHER_PRESETS];
+    size_t nr_candidates = 0;
+
+    if ( strcmp(opts->contents_cipher, CIPHER_AUTO) != 0 )
+        return;
+
+    if ( cipher_has_aes_acceleration() )
+        candidates[nr_candidates++] = "aes-256-xts";
+    if ( matrix != NULL && features_supported(matrix, policy_version, FSCRYPT_MODE_ADIANTUM,
+                                              padding_length_to_flags(opts->filename_padding)) )
+        candidates[nr_candidates++] = "adiantum";
+    candidates[nr_candidates++] = "aes-128-cbc-essiv";
+
+    opts->contents_cipher = "aes-256-xts";
+    for ( size_t i = 0; i < nr_candidates; i++ ) {
+        if ( features_mode_supported(matrix, policy_version, cipher_string_to_mode(candidates[i])) ) {
+            opts->contents_cipher = (char *) candidates[i];
+            break;
+        }
+    }
+
+    opts->filename_cipher = (char *) cipher_preset_filenames(opts->contents_cipher);
+}
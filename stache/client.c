@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "stache.h"
+#include "client.h"
+
+int client_connect()
+{
+    struct sockaddr_un addr;
+
+    int fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if ( fd == -1 ) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", STACHE_SOCKET);
+
+    if ( connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", STACHE_SOCKET, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void client_init_request(struct stache_request *req, enum stache_op op, const char *path)
+{
+    memset(req, 0, sizeof(*req));
+    req->version = STACHE_PROTOCOL_VERSION;
+    req->op = op;
+    if ( path != NULL )
+        snprintf(req->path, sizeof(req->path), "%s", path);
+}
+
+void client_set_timeout(struct stache_request *req, unsigned timeout_ms)
+{
+    req->deadline_ns = timeout_ms ? stats_now() + timeout_ms * 1000000ULL : 0;
+}
+
+int client_transact(int fd, const struct stache_request *req, const void *secret, int passed_fd,
+                    struct stache_response *resp)
+{
+    size_t secret_size = (req->flags & STACHE_REQ_SECRET_INLINE) ? req->secret_size : 0;
+    struct iovec iov[2] = {
+        { .iov_base = (void *) req, .iov_len = sizeof(*req) },
+        { .iov_base = (void *) secret, .iov_len = secret_size },
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = secret_size ? 2 : 1,
+    };
+
+    if ( passed_fd != -1 ) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+    }
+
+    if ( sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) (sizeof(*req) + secret_size) ) {
+        fprintf(stderr, "Cannot send request: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(fd, resp, sizeof(*resp), 0);
+    } while ( n < 0 && errno == EINTR );
+
+    if ( n < (ssize_t) STACHE_RESPONSE_HEADER_SZ ||
+         resp->message_size > sizeof(resp->message) ||
+         (size_t) n != STACHE_RESPONSE_HEADER_SZ + resp->message_size ) {
+        fprintf(stderr, "Invalid response from the daemon.\n");
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include "protocol.h"
+
+/*
+ * Client side of the stached control socket.
+ */
+
+// Connects to the daemon. Returns the socket, or -1.
+int client_connect();
+// Sends one request and waits for its response. With STACHE_REQ_SECRET_INLINE,
+// _secret_ holds _req->secret_size_ bytes. _passed_fd_, unless -1, is passed
+// along with the request.
+int client_transact(int fd, const struct stache_request *req, const void *secret, int passed_fd,
+                    struct stache_response *resp);
+void client_init_request(struct stache_request *req, enum stache_op op, const char *path);
+// Lets the daemon drop the request if it cannot complete within _timeout_ms_ from now.
+void client_set_timeout(struct stache_request *req, unsigned timeout_ms);
+
+#endif /* _CLIENT_H */
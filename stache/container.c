@@ -28,45 +28,29 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <linux/magic.h>
-#include <sys/vfs.h>
-#include <sys/ioctl.h>
-#include <asm-generic/ioctl.h>
 #include <assert.h>
 #include <errno.h>
 
 #include "stache.h"
 
 //
-// Checks the given file path is mounted on a ext4 filesystem.
-//
-static
-bool is_ext4_filesystem(const char *path)
-{
-    struct statfs fs;
-
-    if ( statfs(path, &fs) != 0 ) {
-        fprintf(stderr, "Cannot get filesystem information for %s: %s\n", path, strerror(errno));
-        return false;
-    }
-
-    return (fs.f_type == EXT4_SUPER_MAGIC);
-}
-
-//
-// Opens an existing file on an ext4 filesystem.
+// Opens an existing file on a filesystem supporting encryption.
 // Returns a read-only file descriptor.
 //
 static
-int open_ext4_path(const char *path, int flags)
+int open_crypt_path(const char *path, int flags)
 {
-    if ( !is_ext4_filesystem(path) ) {
-        fprintf(stderr, "Error: %s does not belong to an ext4 filesystem.\n", path);
+    uint64_t started_ns = stats_now();
+
+    if ( !backend_filesystem_supported(path) ) {
+        fprintf(stderr, "Error: %s does not belong to an ext4 or f2fs filesystem.\n", path);
         return -1;
     }
 
     int open_flags = O_RDONLY | O_NONBLOCK | flags;
     int fd = open(path, open_flags);
+    trace_phase(STATS_OPEN, started_ns, trace_hash_string(path), fd == -1 ? errno : 0);
+
     if ( fd == -1 ) {
         if ( errno == ENOTDIR )
             fprintf(stderr, "Invalid argument: %s is not a directory\n", path);
@@ -80,141 +64,171 @@ int open_ext4_path(const char *path, int flags)
 }
 
 //
-// Opens an existing directory on an ext4 filesystem.
+// Opens an existing directory on a filesystem supporting encryption.
 // Returns a file descriptor of the directory.
 //
 static
-int open_ext4_directory(const char *dir_path)
+int open_crypt_directory(const char *dir_path)
 {
-    return open_ext4_path(dir_path, O_DIRECTORY);
+    return open_crypt_path(dir_path, O_DIRECTORY);
 }
 
 //
-// Queries the kernel for inode encryption policy.
+// Builds the policy described by the options for the given backend.
 //
 static
-int get_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy, bool *has_policy)
+void setup_encryption_policy(struct ext4_crypt_options opts, const struct crypt_backend *backend,
+                             struct stache_policy *policy)
 {
-    if ( ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY, policy) < 0 ) {
-        switch ( errno ) {
-            case ENOENT:
-                *has_policy = false;
-                return 0;
-
-            case ENOTSUP:
-                fprintf(stderr, "This filesystem does not support encryption.\n");
-                fprintf(stderr, "Please ensure your kernel has support for CONFIG_EXT4_ENCRYPTION.\n");
-                return -1;
-
-            default:
-                fprintf(stderr, "Cannot get ext4 encryption policy: %s\n", strerror(errno));
-                return -1;
-        }
+    memset(policy, 0, sizeof(*policy));
+    policy->version = backend->policy_version;
+    policy->contents_mode = cipher_string_to_mode(opts.contents_cipher);
+    policy->filenames_mode = cipher_string_to_mode(opts.filename_cipher);
+    policy->flags = padding_length_to_flags(opts.filename_padding);
+
+    // Adiantum is meant to be used with the master key directly, avoiding per-file key setup.
+    if ( policy->contents_mode == FSCRYPT_MODE_ADIANTUM )
+        policy->flags |= FSCRYPT_POLICY_FLAG_DIRECT_KEY;
+
+    // v2 identifiers are computed by the kernel when the key is added.
+    if ( policy->version == 1 ) {
+        if ( opts.requires_descriptor )
+            generate_random_name(opts.key_descriptor, sizeof(opts.key_descriptor));
+
+        memcpy(policy->key_id, opts.key_descriptor, sizeof(opts.key_descriptor));
     }
-
-    *has_policy = true;
-    return 0;
 }
 
 //
-// Applies ext4 specified encryption policy to directory.
+// Stores the verifier of _key_ in a container whose policy is set.
 //
 static
-int set_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy)
+void store_key_verifier(struct ext4_crypt_options opts, int dirfd, const struct crypt_backend *backend,
+                        const struct stache_policy *policy, const struct ext4_encryption_key *key)
 {
-    if ( ioctl(dirfd, EXT4_IOC_SET_ENCRYPTION_POLICY, policy) < 0 ) {
-        switch ( errno ) {
-            case ENOTSUP:
-                fprintf(stderr, "This filesystem does not support encryption.\n");
-                fprintf(stderr, "Please ensure your kernel has support for CONFIG_EXT4_ENCRYPTION.\n");
-                return -1;
-
-            case EINVAL:
-                fprintf(stderr, "Encryption parameters do not match with already previous ones.\n");
-                return -1;
-
-            case ENOTEMPTY:
-                fprintf(stderr, "Cannot create encrypted container: directory must be empty.\n");
-                return -1;
-
-            default:
-                fprintf(stderr, "Cannot set ext4 encryption policy: %s\n", strerror(errno));
-                return -1;
-        }
-    }
+    struct key_verifier verifier;
 
-    return 0;
+    key_verifier_compute(key, policy->key_id, backend->key_id_size, &verifier);
+    if ( metadata_set_verifier(dirfd, &verifier) < 0 )
+        VERBOSE_PRINT(opts, "Cannot store the key verifier (%s), wrong passphrases will be detected late.", strerror(errno));
 }
 
 //
-// Setups a new encryption policy for the specified directory.
+// Checks _key_ against the verifier of the container, if it has one.
+// _has_verifier_ tells whether it did.
 //
 static
-int setup_ext4_encryption(int dirfd, struct ext4_crypt_options opts)
+int check_key_verifier(int dirfd, const struct crypt_backend *backend, const struct stache_policy *policy,
+                       const struct ext4_encryption_key *key, bool *has_verifier)
 {
-    struct ext4_encryption_policy policy;
-
-    // Current policy version.
-    policy.version = 0;
-
-    policy.contents_encryption_mode = cipher_string_to_mode(opts.contents_cipher);
-    policy.filenames_encryption_mode = cipher_string_to_mode(opts.filename_cipher);
-    policy.flags = padding_length_to_flags(opts.filename_padding);
+    struct key_verifier verifier;
+    uint64_t started_ns = stats_now();
+
+    *has_verifier = false;
+    if ( metadata_get_verifier(dirfd, &verifier) < 0 ) {
+        if ( errno == ENODATA )
+            return 0;
+        fprintf(stderr, "Cannot read the key verifier: %s\n", strerror(errno));
+        return -1;
+    }
 
-    if ( opts.requires_descriptor )
-        generate_random_name(opts.key_descriptor, sizeof(opts.key_descriptor));
+    *has_verifier = true;
+    bool matches = key_verifier_matches(key, policy->key_id, backend->key_id_size, &verifier);
+    trace_phase(STATS_KEY_VERIFY, started_ns, 0, matches ? 0 : EKEYREJECTED);
 
-    memcpy(policy.master_key_descriptor, opts.key_descriptor, sizeof(policy.master_key_descriptor));
+    if ( !matches ) {
+        fprintf(stderr, "Wrong passphrase: key does not match the container.\n");
+        errno = EKEYREJECTED;
+        return -1;
+    }
 
-    VERBOSE_PRINT(opts, "Configuring ext4 encryption policy:");
-    VERBOSE_PRINT(opts, "  version:          %d", policy.version);
-    VERBOSE_PRINT(opts, "  contents cipher:  %s", opts.contents_cipher);
-    VERBOSE_PRINT(opts, "  filename cipher:  %s", opts.filename_cipher);
-    VERBOSE_PRINT(opts, "  filename padding: %d", opts.filename_padding);
-    VERBOSE_PRINT(opts, "  key descriptor:   %s", opts.key_descriptor);
+    return 0;
+}
 
-    return set_ext4_encryption_policy(dirfd, &policy);
+static
+void print_key_id(FILE *out, const struct crypt_backend *backend, const struct stache_policy *policy)
+{
+    fprintf(out, "0x");
+    for (size_t i=0; i<backend->key_id_size; ++i) {
+            fprintf(out, "%02X", policy->key_id[i] & 0xff);
+    }
+    fprintf(out, "\n");
 }
 
 //
 // Prints information about directory container.
 //
-int container_status(const char *dir_path)
+int container_status(const char *dir_path, FILE *out)
 {
-    int dirfd = open_ext4_directory(dir_path);
+    int ret = -1;
+    int dirfd = open_crypt_directory(dir_path);
     if ( dirfd == -1 )
         return -1;
 
-    struct ext4_encryption_policy policy;
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
     bool has_policy;
 
-    if ( get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0 )
-        return -1;
+    if ( backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 )
+        goto out;
 
     if ( !has_policy )
-        printf("%s: Regular directory\n", dir_path);
+        fprintf(out, "%s: Regular directory\n", dir_path);
     else {
 
-        printf("%s: Encrypted directory\n", dir_path);
-        printf("Policy version:   %d\n", policy.version);
-        printf("Filename cipher:  %s\n", cipher_mode_to_string(policy.filenames_encryption_mode));
-        printf("Contents cipher:  %s\n", cipher_mode_to_string(policy.contents_encryption_mode));
-        printf("Filename padding: %d\n", flags_to_padding_length(policy.flags));
-
-        printf("Key descriptor:   0x");
-        for (int i=0; i<EXT4_KEY_DESCRIPTOR_SIZE; ++i) {
-                printf("%02X", policy.master_key_descriptor[i] & 0xff);
+        fprintf(out, "%s: Encrypted directory\n", dir_path);
+        fprintf(out, "Filesystem:       %s\n", backend_filesystem_name(dirfd));
+        fprintf(out, "Policy version:   %d\n", policy.version);
+        fprintf(out, "Filename cipher:  %s\n", cipher_mode_to_string(policy.filenames_mode));
+        fprintf(out, "Contents cipher:  %s\n", cipher_mode_to_string(policy.contents_mode));
+        fprintf(out, "Filename padding: %d\n", flags_to_padding_length(policy.flags));
+        if ( policy.flags & FSCRYPT_POLICY_FLAG_DIRECT_KEY )
+            fprintf(out, "Direct key:       yes\n");
+
+        struct kdf_params kdf;
+        if ( metadata_get_kdf(dirfd, &kdf) == 0 )
+            fprintf(out, "Key derivation:   scrypt N=2^%d r=%d p=%d, %d-byte salt\n",
+                    kdf.log_n, kdf.r, kdf.p, kdf.salt_size);
+
+        if ( policy.version == 1 ) {
+            fprintf(out, "Key descriptor:   ");
+            print_key_id(out, backend, &policy);
+        }
+        else {
+            fprintf(out, "Key identifier:   ");
+            print_key_id(out, backend, &policy);
         }
-        printf("\n");
 
+        enum stache_key_status key_status;
         key_serial_t key_serial;
-        if ( find_key_by_descriptor(&policy.master_key_descriptor, &key_serial) == -1 )
-            printf("Key serial:       not found\n");
-        else
-            printf("Key serial:       %d\n", key_serial);
+        if ( backend->key_status(dirfd, &policy, &key_status, &key_serial) < 0 )
+            goto out;
+
+        if ( policy.version == 1 ) {
+            if ( key_status != KEY_STATUS_PRESENT )
+                fprintf(out, "Key serial:       not found\n");
+            else
+                fprintf(out, "Key serial:       %d\n", key_serial);
+        }
+        else {
+            fprintf(out, "Key status:       %s\n",
+                    key_status == KEY_STATUS_PRESENT ? "present" :
+                    key_status == KEY_STATUS_INCOMPLETELY_REMOVED ? "incompletely removed" : "absent");
+        }
+
+        warm_print_status(dir_path, out);
+
+        struct usage_record usage;
+        bool live;
+        if ( usage_get(dirfd, &usage, &live) == 0 )
+            usage_print(&usage, live, out);
     }
 
-    return 0;
+    ret = 0;
+
+out:
+    close(dirfd);
+    return ret;
 }
 
 //
@@ -237,6 +251,7 @@ int create_dummy_inode(int dirfd)
 
     if ( unlinkat(dirfd, dummy_name, 0) != 0 ) {
         fprintf(stderr, "Cannot unlink inode in directory: %s\n", strerror(errno));
+        close(fd);
         return -1;
     }
 
@@ -252,47 +267,116 @@ int container_create(const char *dir_path, struct ext4_crypt_options opts)
     if ( crypto_init() == -1 )
         return -1;
 
-    int dirfd = open_ext4_directory(dir_path);
+    int ret = -1;
+    int dirfd = open_crypt_directory(dir_path);
     if ( dirfd == -1 )
         return -1;
 
-    struct ext4_encryption_policy policy;
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
     bool has_policy;
+    bool key_added = false;
+    struct ext4_encryption_key *master_key = NULL;
 
     // We first check the directory is not already encrypted.
-    if ( get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0 )
-        return -1;
+    if ( backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 )
+        goto out;
 
     if ( has_policy ) {
         fprintf(stderr, "Cannot create encrypted container at %s: directory is already encrypted.\n", dir_path);
-        return -1;
+        goto out;
     }
 
+    backend = backend_select(dirfd, opts.policy_version);
+    if ( backend == NULL )
+        goto out;
+
+    // "auto" picks from what this filesystem was found to support, probed next
+    // to the container rather than in it.
+    struct feature_matrix matrix;
+    bool have_matrix = features_lookup(dirfd, &matrix);
+    if ( strcmp(opts.contents_cipher, CIPHER_AUTO) == 0 && !have_matrix ) {
+        char parent[PATH_MAX];
+
+        snprintf(parent, sizeof(parent), "%s", dir_path);
+        // A parent on another filesystem says nothing about this one.
+        if ( features_probe(dirname(parent), &matrix) == 0 )
+            have_matrix = features_cover(dirfd);
+        if ( !have_matrix )
+            VERBOSE_PRINT(opts, "Cannot probe encryption features, choosing the cipher blind.");
+    }
+
+    // Fail before asking for a passphrase if the kernel cannot use these parameters.
+    resolve_cipher_options(&opts, backend->policy_version, have_matrix ? &matrix : NULL);
+    if ( !is_valid_cipher_pair(cipher_string_to_mode(opts.contents_cipher), cipher_string_to_mode(opts.filename_cipher)) ) {
+        fprintf(stderr, "Cannot use %s for contents with %s for filenames.\n", opts.contents_cipher, opts.filename_cipher);
+        goto out;
+    }
+
+    if ( features_check(dirfd, backend->policy_version, opts) < 0 )
+        goto out;
+
+    setup_encryption_policy(opts, backend, &policy);
+
+    // New containers get their own salt, as long as it can be stored with them.
+    struct kdf_params kdf;
+    kdf_params_generate(&kdf);
+    if ( metadata_set_kdf(dirfd, &kdf) < 0 ) {
+        VERBOSE_PRINT(opts, "Cannot store key derivation parameters (%s), using the legacy ones.", strerror(errno));
+        kdf_params_legacy(&kdf);
+    }
+
+    // The key is added first: v2 policies embed the identifier the kernel computes for it.
+    master_key = secmem_alloc();
+    if ( master_key == NULL )
+        goto out;
+
+    if ( request_master_key(opts, true, &kdf, backend->key_size(&policy), master_key) < 0 )
+        goto out;
+
+    if ( backend->add_key(dirfd, &policy, master_key, false) < 0 )
+        goto out;
+    key_added = true;
+
+    VERBOSE_PRINT(opts, "Configuring encryption policy:");
+    VERBOSE_PRINT(opts, "  backend:          %s", backend->name);
+    VERBOSE_PRINT(opts, "  version:          %d", policy.version);
+    VERBOSE_PRINT(opts, "  contents cipher:  %s", opts.contents_cipher);
+    VERBOSE_PRINT(opts, "  filename cipher:  %s", opts.filename_cipher);
+    VERBOSE_PRINT(opts, "  filename padding: %d", opts.filename_padding);
+    if ( policy.version == 1 )
+        VERBOSE_PRINT(opts, "  key descriptor:   %.*s", (int) sizeof(opts.key_descriptor), (char *) policy.key_id);
+
     // Creates the encryption policy.
-    if ( setup_ext4_encryption(dirfd, opts) < 0 )
-        return -1;
+    if ( backend->set_policy(dirfd, &policy) < 0 )
+        goto out;
 
     // Checks the encryption policy was successfully created.
-    if ( get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0 )
-        return -1;
+    if ( backend->get_policy(dirfd, &policy, &has_policy) < 0 )
+        goto out;
 
     if ( !has_policy ) {
         fprintf(stderr, "Encryption policy creation failed for %s.\n", dir_path);
-        return -1;
+        goto out;
     }
 
-    // Attaches a key to the directory.
-    if ( request_key_for_descriptor(&policy.master_key_descriptor, opts, true) < 0 )
-        return -1;
-
     // XXX: must write a file to the directory...
     // The directory is left in an inconsistent state if the superblock is unmounted before any inode is created.
     if ( create_dummy_inode(dirfd) < 0 )
-        return -1;
+        goto out;
+
+    store_key_verifier(opts, dirfd, backend, &policy, master_key);
 
     printf("%s: Encryption policy is now set.\n", dir_path);
+    ret = 0;
+
+out:
+    if ( ret != 0 && key_added )
+        backend->remove_key(dirfd, &policy);
+
+    secmem_free(master_key);
     close(dirfd);
-    return 0;
+    return ret;
 }
 
 //
@@ -303,54 +387,117 @@ int container_attach(const char *dir_path, struct ext4_crypt_options opts)
     if ( crypto_init() == -1 )
         return -1;
 
-    int dirfd = open_ext4_directory(dir_path);
+    int ret = -1;
+    int dirfd = open_crypt_directory(dir_path);
     if ( dirfd == -1 )
         return -1;
 
-    struct ext4_encryption_policy policy;
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
     bool has_policy;
+    struct ext4_encryption_key *master_key = NULL;
 
     // We check that an encryption policy has already been defined for this directory.
-    if ( get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0 )
-        return -1;
+    if ( backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 )
+        goto out;
 
     if ( !has_policy ) {
         fprintf(stderr, "Cannot attach key to directory %s: not an encrypted directory.\n", dir_path);
-        return -1;
+        goto out;
     }
 
-    if ( request_key_for_descriptor(&policy.master_key_descriptor, opts, false) < 0 )
-        return -1;
+    struct kdf_params kdf;
+    if ( metadata_get_kdf(dirfd, &kdf) < 0 )
+        goto out;
+
+    master_key = secmem_alloc();
+    if ( master_key == NULL )
+        goto out;
+
+    if ( request_master_key(opts, false, &kdf, backend->key_size(&policy), master_key) < 0 )
+        goto out;
+
+    // Rejects a wrong passphrase before its key reaches the kernel.
+    bool has_verifier;
+    if ( check_key_verifier(dirfd, backend, &policy, master_key, &has_verifier) < 0 )
+        goto out;
+
+    if ( backend->add_key(dirfd, &policy, master_key, true) < 0 )
+        goto out;
 
+    // Containers from before verifiers get one, once the kernel has vouched for the key:
+    // only v2 identifiers prove it right, v1 keys are taken as given.
+    if ( !has_verifier && backend->policy_version == 2 )
+        store_key_verifier(opts, dirfd, backend, &policy, master_key);
+
+    if ( opts.warm )
+        warm_start(dir_path);
+
+    ret = 0;
+
+out:
+    secmem_free(master_key);
     close(dirfd);
-    return 0;
+    return ret;
 }
 
 //
-// Detaches the key from an encrypted directory.
+// Detaches the key from an encrypted directory, reporting to _out_.
 //
-int container_detach(const char *dir_path, struct ext4_crypt_options UNUSED opts)
+int container_detach(const char *dir_path, struct ext4_crypt_options opts, FILE *out)
 {
-    int dirfd = open_ext4_directory(dir_path);
+    int ret = -1;
+    int dirfd = open_crypt_directory(dir_path);
     if ( dirfd == -1 )
         return -1;
 
-    struct ext4_encryption_policy policy;
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
     bool has_policy;
 
     // We check that an encryption policy has already been defined for this directory.
-    if ( get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0 )
-        return -1;
+    if ( backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 )
+        goto out;
 
     if ( !has_policy ) {
         fprintf(stderr, "%s has no active encryption policy.\n", dir_path);
-        return -1;
+        goto out;
     }
 
-    if ( remove_key_for_descriptor(&policy.master_key_descriptor) < 0 )
-        return -1;
+    // The warm-up walk must not outlive the key.
+    warm_cancel(dir_path);
+
+    // Removing a v2 key evicts the container inodes along with their pages,
+    // a legacy key leaves the page cache alone and the walk has to drop it.
+    // Eviction is best effort: the key goes either way.
+    struct evict_result evicted;
+    bool evicting = opts.evict;
+
+    if ( evicting && evict_container(dir_path, policy.version != 2, &evicted) < 0 ) {
+        fprintf(stderr, "Warning: cannot evict %s from the page cache, detaching anyway.\n", dir_path);
+        evicting = false;
+    }
+
+    if ( backend->remove_key(dirfd, &policy) < 0 )
+        goto out;
+
+    fprintf(out, "Encryption key detached from %s.\n", dir_path);
 
-    printf("Encryption key detached from %s.\n", dir_path);
+    // Encrypted files cannot be opened to count their pages once the key is
+    // gone, but the kernel tells whether files still in use kept it.
+    if ( evicting && policy.version == 2 ) {
+        enum stache_key_status key_status;
+        key_serial_t key_serial;
+
+        evicted.files_busy = backend->key_status(dirfd, &policy, &key_status, &key_serial) < 0 ||
+                             key_status == KEY_STATUS_INCOMPLETELY_REMOVED;
+        evicted.pages_after = 0;
+    }
+    if ( evicting )
+        evict_print(&evicted, out);
+    ret = 0;
+
+out:
     close(dirfd);
-    return 0;
+    return ret;
 }
@@ -0,0 +1,670 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+#include "stache.h"
+
+#define XATTR_BUFFER_SZ 4096
+
+enum copy_method {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+struct copy_walk {
+    struct copy_job *job;
+    int target_fd;
+    atomic_int method;              // downgraded for the job when the kernel turns one down
+    pthread_mutex_t throttle_lock;
+    uint64_t throttle_next_ns;      // when the bandwidth is next available
+    atomic_ullong total_files;
+    atomic_ullong total_bytes;
+};
+
+static
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static
+bool method_unsupported(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP;
+}
+
+//
+// Waits until _len_ bytes may be copied under the rate limit. Each caller
+// reserves its share of the bandwidth ahead, so threads are spaced evenly.
+//
+static
+void throttle(struct copy_walk *cw, size_t len)
+{
+    unsigned long long rate = cw->job->rate_limit;
+    if ( rate == 0 )
+        return;
+
+    uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&cw->throttle_lock);
+    if ( cw->throttle_next_ns < now )
+        cw->throttle_next_ns = now;
+    uint64_t start = cw->throttle_next_ns;
+    cw->throttle_next_ns += (uint64_t) len * 1000000000ULL / rate;
+    pthread_mutex_unlock(&cw->throttle_lock);
+
+    if ( start > now ) {
+        struct timespec delay = {
+            .tv_sec = (start - now) / 1000000000ULL,
+            .tv_nsec = (start - now) % 1000000000ULL,
+        };
+        while ( nanosleep(&delay, &delay) < 0 && errno == EINTR )
+            ;
+    }
+}
+
+//
+// Copies _size_ bytes from _in_ to _out_ with the best method available.
+//
+static
+int copy_data(struct copy_walk *cw, int in, int out, off_t size)
+{
+    struct copy_job *job = cw->job;
+    char *buffer = NULL;
+    off_t offset = 0;
+    int ret = 0;
+
+    while ( offset < size ) {
+        size_t len = (size - offset) < (off_t) COPY_CHUNK_SZ ? (size_t)(size - offset) : COPY_CHUNK_SZ;
+        int method = atomic_load(&cw->method);
+        ssize_t n;
+
+        if ( job->cancel && atomic_load(job->cancel) ) {
+            errno = ECANCELED;
+            ret = -1;
+            break;
+        }
+
+        if ( method == COPY_READ_WRITE && len > COPY_BUFFER_SZ )
+            len = COPY_BUFFER_SZ;
+        throttle(cw, len);
+
+        if ( method == COPY_FILE_RANGE ) {
+            off_t out_offset = offset;
+            n = sys_copy_file_range(in, &offset, out, &out_offset, len);
+            if ( n < 0 && method_unsupported(errno) ) {
+                atomic_store(&cw->method, COPY_SENDFILE);
+                continue;
+            }
+        }
+        else if ( method == COPY_SENDFILE ) {
+            lseek(out, offset, SEEK_SET);
+            n = sendfile(out, in, &offset, len);
+            if ( n < 0 && method_unsupported(errno) ) {
+                atomic_store(&cw->method, COPY_READ_WRITE);
+                continue;
+            }
+        }
+        else {
+            if ( buffer == NULL && (buffer = malloc(COPY_BUFFER_SZ)) == NULL ) {
+                ret = -1;
+                break;
+            }
+            n = pread(in, buffer, len, offset);
+            if ( n > 0 && pwrite(out, buffer, n, offset) != n )
+                n = -1;
+            if ( n > 0 )
+                offset += n;
+        }
+
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            ret = -1;
+            break;
+        }
+
+        // The source shrank under us.
+        if ( n == 0 )
+            break;
+
+        atomic_fetch_add(&job->nr_bytes, n);
+    }
+
+    free(buffer);
+    return ret;
+}
+
+static
+void copy_xattrs(int in, int out)
+{
+    char names[XATTR_BUFFER_SZ];
+    char value[XATTR_BUFFER_SZ];
+
+    ssize_t len = flistxattr(in, names, sizeof(names));
+    for ( ssize_t i = 0; i < len; i += strlen(names + i) + 1 ) {
+        // Container metadata belongs to the container, not to its contents.
+        if ( strncmp(names + i, STACHE_XATTR_PREFIX, strlen(STACHE_XATTR_PREFIX)) == 0 )
+            continue;
+
+        ssize_t size = fgetxattr(in, names + i, value, sizeof(value));
+        if ( size >= 0 )
+            fsetxattr(out, names + i, value, size, 0);
+    }
+}
+
+//
+// Applies owner, mode and extended attributes; ownership fails silently when not privileged.
+//
+static
+void copy_attributes(int in, int out, const struct stat *st)
+{
+    if ( fchown(out, st->st_uid, st->st_gid) < 0 && errno != EPERM )
+        fprintf(stderr, "Warning: cannot change owner: %s\n", strerror(errno));
+    fchmod(out, st->st_mode & 07777);
+    copy_xattrs(in, out);
+}
+
+static
+bool is_up_to_date(int target_fd, const char *path, const struct stat *st)
+{
+    struct stat target;
+
+    if ( fstatat(target_fd, path, &target, AT_SYMLINK_NOFOLLOW) < 0 )
+        return false;
+
+    return S_ISREG(target.st_mode) && target.st_size == st->st_size &&
+           target.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+           target.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static
+int copy_file(struct copy_walk *cw, int dirfd, const char *name, const char *path, const struct stat *st)
+{
+    struct copy_job *job = cw->job;
+    int ret = -1;
+
+    if ( is_up_to_date(cw->target_fd, path, st) ) {
+        atomic_fetch_add(&job->nr_skipped, 1);
+        atomic_fetch_add(&job->nr_files, 1);
+        atomic_fetch_add(&job->nr_bytes, st->st_size);
+        return 0;
+    }
+
+    int in = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if ( in == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int out = openat(cw->target_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if ( out == -1 ) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    if ( copy_data(cw, in, out, st->st_size) < 0 ) {
+        fprintf(stderr, "Cannot copy %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    copy_attributes(in, out, st);
+
+    // Last, as it marks the file as complete.
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if ( futimens(out, times) < 0 ) {
+        fprintf(stderr, "Cannot set times of %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    atomic_fetch_add(&job->nr_files, 1);
+    ret = 0;
+
+out:
+    if ( out != -1 )
+        close(out);
+    close(in);
+    return ret;
+}
+
+static
+int copy_special(struct copy_walk *cw, int dirfd, const char *name, const char *path, const struct stat *st)
+{
+    if ( S_ISLNK(st->st_mode) ) {
+        char link[PATH_MAX];
+        ssize_t len = readlinkat(dirfd, name, link, sizeof(link) - 1);
+        if ( len < 0 )
+            return -1;
+        link[len] = '\0';
+
+        if ( symlinkat(link, cw->target_fd, path) < 0 && errno != EEXIST )
+            return -1;
+    }
+    else if ( mknodat(cw->target_fd, path, st->st_mode, st->st_rdev) < 0 && errno != EEXIST )
+        return -1;
+
+    fchownat(cw->target_fd, path, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    utimensat(cw->target_fd, path, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+//
+// Directories are created before the walk descends into them. Their mode and
+// times are only applied by copy_directory_times(), once they are filled.
+//
+static
+int copy_directory(struct copy_walk *cw, int dirfd, const char *name, const char *path, const struct stat *st)
+{
+    if ( mkdirat(cw->target_fd, path, S_IRWXU) < 0 && errno != EEXIST )
+        return -1;
+
+    int in = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int out = openat(cw->target_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ( in != -1 && out != -1 ) {
+        if ( fchown(out, st->st_uid, st->st_gid) < 0 && errno != EPERM )
+            fprintf(stderr, "Warning: cannot change owner of %s: %s\n", path, strerror(errno));
+        copy_xattrs(in, out);
+    }
+
+    if ( in != -1 )
+        close(in);
+    if ( out != -1 )
+        close(out);
+    return 0;
+}
+
+static
+int copy_entry(struct tree_walk *walk, int dirfd, const char *name,
+               const char *path, unsigned char UNUSED d_type)
+{
+    struct copy_walk *cw = walk->arg;
+    struct stat st;
+    int ret;
+
+    if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if ( S_ISREG(st.st_mode) )
+        return copy_file(cw, dirfd, name, path, &st);
+
+    if ( S_ISDIR(st.st_mode) )
+        ret = copy_directory(cw, dirfd, name, path, &st);
+    else
+        ret = copy_special(cw, dirfd, name, path, &st);
+
+    if ( ret < 0 )
+        fprintf(stderr, "Cannot copy %s: %s\n", path, strerror(errno));
+    return ret;
+}
+
+static
+void copy_thread_start(struct tree_walk *walk)
+{
+    struct copy_walk *cw = walk->arg;
+
+    if ( cw->job->background )
+        walk_set_io_priority(IOPRIO_CLASS_BE, 7);
+}
+
+static
+int scan_entry(struct tree_walk *walk, int dirfd, const char *name,
+               const char UNUSED *path, unsigned char d_type)
+{
+    struct copy_walk *cw = walk->arg;
+    struct stat st;
+
+    if ( d_type != DT_REG && d_type != DT_UNKNOWN )
+        return 0;
+
+    if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) ) {
+        atomic_fetch_add(&cw->total_files, 1);
+        atomic_fetch_add(&cw->total_bytes, st.st_size);
+    }
+    return 0;
+}
+
+static
+int directory_times_entry(struct tree_walk *walk, int dirfd, const char *name,
+                          const char *path, unsigned char d_type)
+{
+    struct copy_walk *cw = walk->arg;
+    struct stat st;
+
+    if ( d_type != DT_DIR && d_type != DT_UNKNOWN )
+        return 0;
+
+    if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) ) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        fchmodat(cw->target_fd, path, st.st_mode & 07777, 0);
+        utimensat(cw->target_fd, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+    return 0;
+}
+
+//
+// Applies the mode and times of the source directories, the root included,
+// now that the copy no longer modifies them.
+//
+static
+int copy_directory_times(struct copy_walk *cw)
+{
+    struct copy_job *job = cw->job;
+    struct tree_walk walk = {
+        .nr_threads = job->nr_threads,
+        .on_entry = directory_times_entry,
+        .arg = cw,
+    };
+    struct stat st;
+
+    if ( tree_walk(job->source, &walk) < 0 )
+        return -1;
+
+    int in = open(job->source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( in == -1 )
+        return -1;
+
+    if ( fstat(in, &st) < 0 ) {
+        close(in);
+        return -1;
+    }
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    copy_attributes(in, cw->target_fd, &st);
+    futimens(cw->target_fd, times);
+    close(in);
+    return 0;
+}
+
+static
+void print_progress(struct copy_job *job, uint64_t started_ns)
+{
+    uint64_t elapsed_ns = monotonic_ns() - started_ns;
+    unsigned long long bytes = atomic_load(&job->nr_bytes);
+    double rate = elapsed_ns ? (bytes / 1048576.0) / (elapsed_ns / 1e9) : 0;
+    double remaining = (bytes < job->total_bytes && rate > 0) ?
+                       ((job->total_bytes - bytes) / 1048576.0) / rate : 0;
+
+    fprintf(job->progress, "Copied %llu/%llu files, %llu/%llu MiB (%.1f MiB/s, %.0f s left)\n",
+            atomic_load(&job->nr_files), job->total_files,
+            bytes >> 20, job->total_bytes >> 20, rate, remaining);
+    fflush(job->progress);
+}
+
+struct progress_reporter {
+    struct copy_job *job;
+    uint64_t started_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+};
+
+static
+void *progress_worker(void *arg)
+{
+    struct progress_reporter *reporter = arg;
+
+    pthread_mutex_lock(&reporter->lock);
+    while ( !reporter->done ) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        if ( pthread_cond_timedwait(&reporter->cond, &reporter->lock, &deadline) == ETIMEDOUT )
+            print_progress(reporter->job, reporter->started_ns);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    return NULL;
+}
+
+int copy_tree(struct copy_job *job)
+{
+    struct copy_walk cw = {
+        .job = job,
+        .method = COPY_FILE_RANGE,
+        .throttle_lock = PTHREAD_MUTEX_INITIALIZER,
+        .throttle_next_ns = 0,
+    };
+    struct tree_walk walk = {
+        .nr_threads = job->nr_threads,
+        .on_thread_start = copy_thread_start,
+        .arg = &cw,
+        .cancel = job->cancel,
+    };
+    struct progress_reporter reporter = {
+        .job = job,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .done = false,
+    };
+    pthread_t progress_thread;
+    bool reporting = false;
+    int ret = -1;
+
+    atomic_init(&cw.total_files, 0);
+    atomic_init(&cw.total_bytes, 0);
+    atomic_store(&job->nr_files, 0);
+    atomic_store(&job->nr_bytes, 0);
+    atomic_store(&job->nr_skipped, 0);
+
+    cw.target_fd = open(job->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( cw.target_fd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", job->target, strerror(errno));
+        return -1;
+    }
+
+    uint64_t started_ns = monotonic_ns();
+
+    // A quick first pass so that progress can be reported against totals.
+    walk.on_entry = scan_entry;
+    if ( tree_walk(job->source, &walk) < 0 )
+        goto out;
+    job->total_files = atomic_load(&cw.total_files);
+    job->total_bytes = atomic_load(&cw.total_bytes);
+
+    if ( job->progress ) {
+        reporter.started_ns = started_ns;
+        reporting = (pthread_create(&progress_thread, NULL, progress_worker, &reporter) == 0);
+    }
+
+    walk.on_entry = copy_entry;
+    if ( tree_walk(job->source, &walk) < 0 )
+        goto out;
+
+    if ( copy_directory_times(&cw) < 0 ) {
+        fprintf(stderr, "Cannot copy directory attributes: %s\n", strerror(errno));
+        goto out;
+    }
+
+    if ( syncfs(cw.target_fd) < 0 ) {
+        fprintf(stderr, "Cannot sync %s: %s\n", job->target, strerror(errno));
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if ( reporting ) {
+        pthread_mutex_lock(&reporter.lock);
+        reporter.done = true;
+        pthread_cond_signal(&reporter.cond);
+        pthread_mutex_unlock(&reporter.lock);
+        pthread_join(progress_thread, NULL);
+        print_progress(job, started_ns);
+    }
+
+    job->elapsed_ns = monotonic_ns() - started_ns;
+    close(cw.target_fd);
+    return ret;
+}
+
+//
+// Compares two regular files by contents.
+//
+static
+bool same_contents(int a, int b, off_t size, char *buf_a, char *buf_b)
+{
+    for ( off_t offset = 0; offset < size; ) {
+        ssize_t n = pread(a, buf_a, COPY_BUFFER_SZ, offset);
+        if ( n <= 0 || pread(b, buf_b, n, offset) != n || memcmp(buf_a, buf_b, n) != 0 )
+            return false;
+        offset += n;
+    }
+    return true;
+}
+
+static
+int verify_entry(struct tree_walk *walk, int dirfd, const char *name,
+                 const char *path, unsigned char UNUSED d_type)
+{
+    struct copy_walk *cw = walk->arg;
+    struct copy_job *job = cw->job;
+    struct stat st, target;
+    bool same = false;
+
+    if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 )
+        return -1;
+
+    if ( fstatat(cw->target_fd, path, &target, AT_SYMLINK_NOFOLLOW) == 0 &&
+         (st.st_mode & S_IFMT) == (target.st_mode & S_IFMT) ) {
+        same = true;
+    }
+
+    if ( same && S_ISREG(st.st_mode) ) {
+        char *buf_a = malloc(COPY_BUFFER_SZ);
+        char *buf_b = malloc(COPY_BUFFER_SZ);
+        int a = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int b = openat(cw->target_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+        same = buf_a && buf_b && a != -1 && b != -1 && st.st_size == target.st_size &&
+               same_contents(a, b, st.st_size, buf_a, buf_b);
+
+        if ( a != -1 )
+            close(a);
+        if ( b != -1 )
+            close(b);
+        free(buf_a);
+        free(buf_b);
+
+        if ( !same )
+            unlinkat(cw->target_fd, path, 0);
+        else
+            atomic_fetch_add(&job->nr_bytes, st.st_size);
+    }
+
+    if ( !same ) {
+        fprintf(stderr, "Verification failed: %s differs\n", path);
+        atomic_fetch_add(&job->nr_mismatches, 1);
+    }
+    else if ( S_ISREG(st.st_mode) )
+        atomic_fetch_add(&job->nr_files, 1);
+    return 0;
+}
+
+int copy_verify(struct copy_job *job)
+{
+    struct copy_walk cw = { .job = job };
+    struct tree_walk walk = {
+        .nr_threads = job->nr_threads,
+        .on_entry = verify_entry,
+        .arg = &cw,
+        .cancel = job->cancel,
+    };
+
+    atomic_store(&job->nr_files, 0);
+    atomic_store(&job->nr_bytes, 0);
+    atomic_store(&job->nr_mismatches, 0);
+
+    cw.target_fd = open(job->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( cw.target_fd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", job->target, strerror(errno));
+        return -1;
+    }
+
+    int ret = tree_walk(job->source, &walk);
+    close(cw.target_fd);
+
+    if ( ret == 0 && atomic_load(&job->nr_mismatches) > 0 ) {
+        fprintf(stderr, "%llu entries differ between %s and %s.\n",
+                atomic_load(&job->nr_mismatches), job->source, job->target);
+        errno = EIO;
+        ret = -1;
+    }
+
+    return ret;
+}
+
+void copy_print_summary(const struct copy_job *job, const char *what, FILE *out)
+{
+    unsigned long long bytes = atomic_load(&job->nr_bytes);
+    double seconds = job->elapsed_ns / 1e9;
+
+    fprintf(out, "%s %llu files, %llu MiB in %.1f s (%.1f MiB/s), %llu already up to date.\n",
+            what, atomic_load(&job->nr_files), bytes >> 20, seconds,
+            seconds > 0 ? (bytes / 1048576.0) / seconds : 0,
+            atomic_load(&job->nr_skipped));
+}
+
+static
+int remove_entry(const char *path, const struct stat UNUSED *st, int type, struct FTW UNUSED *ftw)
+{
+    int ret = (type == FTW_DP) ? rmdir(path) : unlink(path);
+    if ( ret < 0 )
+        fprintf(stderr, "Cannot remove %s: %s\n", path, strerror(errno));
+    return ret;
+}
+
+//
+// Removes a directory tree, without crossing mount points or following links.
+//
+int remove_tree(const char *path)
+{
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COPY_H
+#define _COPY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define COPY_THREADS 4
+#define COPY_CHUNK_SZ (8UL << 20)       // unit of work of copy_file_range/sendfile
+#define COPY_BUFFER_SZ (1UL << 20)      // bounce buffer of the read/write fallback
+
+/*
+ * Parallel tree copy.
+ *
+ * Files are copied as the walk discovers them, by COPY_THREADS threads, with
+ * copy_file_range() and falling back to sendfile() then read()/write() when the
+ * kernel or the filesystems cannot do better. Owner, mode, timestamps and
+ * extended attributes are preserved; hard links are copied as separate files.
+ *
+ * Memory use is bounded by one COPY_BUFFER_SZ buffer per thread, whatever the
+ * size of the tree. Background copies can be rate limited and run at a low I/O
+ * priority so that foreground I/O is not starved.
+ *
+ * The modification time of a file is set last, once its data is written: a file
+ * of the same size and mtime on the target is up to date, which makes an
+ * interrupted copy resumable by simply running it again.
+ */
+
+struct copy_job {
+    const char *source;
+    const char *target;
+    unsigned nr_threads;
+    FILE *progress;                 // periodic progress reports, or NULL
+    atomic_bool *cancel;            // optional, the copy stops early when set
+    unsigned long long rate_limit;  // bytes per second across all threads, 0 for unlimited
+    bool background;                // copy at the lowest best-effort I/O priority
+
+    // Totals of the source, from the initial scan
+    unsigned long long total_files;
+    unsigned long long total_bytes;
+
+    // Progress
+    atomic_ullong nr_files;
+    atomic_ullong nr_bytes;
+    atomic_ullong nr_skipped;       // files already up to date on the target
+    atomic_ullong nr_mismatches;    // files found different by copy_verify()
+    uint64_t elapsed_ns;
+};
+
+// Copies _job->source_ into the existing directory _job->target_.
+int copy_tree(struct copy_job *);
+// Compares the target with the source; mismatching files are removed from
+// the target so that the next copy_tree() copies them again.
+int copy_verify(struct copy_job *);
+void copy_print_summary(const struct copy_job *, const char *what, FILE *out);
+
+int remove_tree(const char *path);
+
+#endif /* _COPY_H */
@@ -0,0 +1,189 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stache.h"
+
+// Files are mapped this much at a time to count their resident pages.
+#define EVICT_WINDOW_SZ (64UL << 20)
+
+struct evict_walk {
+    bool drop;
+    long page_size;
+    atomic_ullong nr_files;
+    atomic_ullong pages_before;
+    atomic_ullong pages_after;
+};
+
+static
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Counts the pages of a file currently in the page cache.
+//
+static
+unsigned long long resident_pages(int fd, off_t size, long page_size)
+{
+    unsigned long long count = 0;
+    size_t vec_size = EVICT_WINDOW_SZ / page_size;
+    unsigned char *vec = malloc(vec_size);
+    if ( vec == NULL )
+        return 0;
+
+    for ( off_t offset = 0; offset < size; offset += EVICT_WINDOW_SZ ) {
+        size_t length = (size - offset) < (off_t) EVICT_WINDOW_SZ ? (size_t)(size - offset) : EVICT_WINDOW_SZ;
+        void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, offset);
+        if ( map == MAP_FAILED )
+            break;
+
+        size_t nr_pages = (length + page_size - 1) / page_size;
+        if ( mincore(map, length, vec) == 0 ) {
+            for ( size_t i = 0; i < nr_pages; i++ )
+                count += vec[i] & 1;
+        }
+        munmap(map, length);
+    }
+
+    free(vec);
+    return count;
+}
+
+static
+int evict_entry(struct tree_walk *walk, int dirfd, const char *name,
+                const char UNUSED *path, unsigned char d_type)
+{
+    struct evict_walk *ew = walk->arg;
+    struct stat st;
+
+    if ( d_type != DT_REG && d_type != DT_UNKNOWN )
+        return 0;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if ( fd == -1 )
+        return 0;
+
+    if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ) {
+        unsigned long long before = resident_pages(fd, st.st_size, ew->page_size);
+        unsigned long long after = before;
+
+        if ( ew->drop && before > 0 ) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            after = resident_pages(fd, st.st_size, ew->page_size);
+        }
+
+        atomic_fetch_add(&ew->nr_files, 1);
+        atomic_fetch_add(&ew->pages_before, before);
+        atomic_fetch_add(&ew->pages_after, after);
+    }
+
+    close(fd);
+    return 0;
+}
+
+//
+// Walks the container with the eviction callback, into _result_.
+//
+static
+int evict_walk_tree(const char *dir_path, bool drop, struct evict_result *result)
+{
+    struct evict_walk ew = {
+        .drop = drop,
+        .page_size = sysconf(_SC_PAGESIZE),
+    };
+    struct tree_walk walk = {
+        .nr_threads = EVICT_THREADS,
+        .on_entry = evict_entry,
+        .arg = &ew,
+    };
+
+    atomic_init(&ew.nr_files, 0);
+    atomic_init(&ew.pages_before, 0);
+    atomic_init(&ew.pages_after, 0);
+
+    if ( tree_walk(dir_path, &walk) < 0 ) {
+        fprintf(stderr, "Cannot walk %s: %s\n", dir_path, strerror(walk.error));
+        return -1;
+    }
+
+    result->nr_files = atomic_load(&ew.nr_files);
+    result->pages_before = atomic_load(&ew.pages_before);
+    result->pages_after = atomic_load(&ew.pages_after);
+    return 0;
+}
+
+//
+// Pages written back by syncfs() are clean and can be dropped by the walk;
+// dirty pages would survive POSIX_FADV_DONTNEED.
+//
+int evict_container(const char *dir_path, bool drop, struct evict_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->started_ns = monotonic_ns();
+
+    int dirfd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    if ( syncfs(dirfd) < 0 )
+        fprintf(stderr, "Warning: cannot sync the filesystem of %s: %s\n", dir_path, strerror(errno));
+    close(dirfd);
+
+    return evict_walk_tree(dir_path, drop, result);
+}
+
+void evict_print(const struct evict_result *result, FILE *out)
+{
+    uint64_t elapsed_ns = monotonic_ns() - result->started_ns;
+    unsigned long long evicted = result->pages_before - result->pages_after;
+
+    if ( result->files_busy ) {
+        fprintf(out, "Evicted the files not in use, of %llu cached pages (%llu KiB) in %llu files, "
+                "in %llu.%03llu ms. Files still in use keep their pages until closed.\n",
+                result->pages_before,
+                result->pages_before * (sysconf(_SC_PAGESIZE) / 1024),
+                result->nr_files,
+                (unsigned long long) elapsed_ns / 1000000,
+                (unsigned long long) (elapsed_ns / 1000) % 1000);
+        return;
+    }
+
+    fprintf(out, "Evicted %llu of %llu cached pages (%llu KiB) from %llu files in %llu.%03llu ms.\n",
+            evicted, result->pages_before,
+            evicted * (sysconf(_SC_PAGESIZE) / 1024),
+            result->nr_files,
+            (unsigned long long) elapsed_ns / 1000000,
+            (unsigned long long) (elapsed_ns / 1000) % 1000);
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EVICT_H
+#define _EVICT_H
+
+#include <stdint.h>
+
+#define EVICT_THREADS 4
+
+/*
+ * Page cache eviction of a container, so that detach releases the decrypted
+ * data right away instead of leaving it to memory reclaim.
+ */
+
+struct evict_result {
+    unsigned long long nr_files;
+    unsigned long long pages_before;    // resident pages found by the walk
+    unsigned long long pages_after;     // resident pages left once dropped
+    bool files_busy;                    // v2 key removal left files in use, pages_after unknown
+    uint64_t started_ns;
+};
+
+// Syncs the filesystem and walks the container counting its cached pages.
+// When _drop_ is set the pages are also dropped with POSIX_FADV_DONTNEED,
+// otherwise the caller is expected to release them (e.g. by removing a v2 key).
+int evict_container(const char *dir_path, bool drop, struct evict_result *);
+void evict_print(const struct evict_result *, FILE *out);
+
+#endif /* _EVICT_H */
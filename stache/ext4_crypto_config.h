@@ -10,6 +10,14 @@
 #define EXT4_ENCRYPTION_KEY_TYPE "logon"
 #define EXT4_FULL_KEY_DESCRIPTOR_SIZE (EXT4_KEY_DESCRIPTOR_SIZE * 2 + EXT4_KEY_DESC_PREFIX_SIZE)
 
+/* Key sizes of the modes added by later fscrypt versions */
+#define FSCRYPT_AES_128_CBC_KEY_SIZE 16
+#define FSCRYPT_AES_128_CTS_KEY_SIZE 16
+#define FSCRYPT_ADIANTUM_KEY_SIZE 32
+
+/* Contents cipher value selecting the fastest cipher supported by the machine */
+#define CIPHER_AUTO "auto"
+
 struct ext4_crypt_options {
     bool verbose;
     char *contents_cipher;
@@ -17,6 +25,15 @@ struct ext4_crypt_options {
     unsigned filename_padding;
     char key_descriptor[EXT4_KEY_DESCRIPTOR_SIZE];
     bool requires_descriptor;
+    int secret_fd;          // read the secret from this descriptor instead of prompting (-1 if unset)
+    const char *secret;     // secret supplied by the caller (NULL if unset)
+    size_t secret_size;
+    bool secret_is_key;     // secret is derived key material rather than a passphrase
+    int policy_version;     // 1 (legacy ext4), 2 (fscrypt v2) or 0 for the best supported
+    bool warm;              // warm up the container caches in the background after attach
+    bool evict;             // drop the container from the page cache on detach
+    unsigned long long rate_limit;  // bytes per second of rekey copies, 0 for unlimited
+    const struct cancel_token *cancel;  // abandons queued or finished work when it fires (NULL if unset)
 };
 
 static inline
@@ -55,6 +72,9 @@ struct cipher cipher_modes[] = {
     [EXT4_ENCRYPTION_MODE_AES_256_GCM] = { "aes-256-gcm", EXT4_AES_256_GCM_KEY_SIZE },
     [EXT4_ENCRYPTION_MODE_AES_256_CBC] = { "aes-256-cbc", EXT4_AES_256_CBC_KEY_SIZE },
     [EXT4_ENCRYPTION_MODE_AES_256_CTS] = { "aes-256-cts", EXT4_AES_256_CTS_KEY_SIZE },
+    [FSCRYPT_MODE_AES_128_CBC] = { "aes-128-cbc-essiv", FSCRYPT_AES_128_CBC_KEY_SIZE },
+    [FSCRYPT_MODE_AES_128_CTS] = { "aes-128-cts", FSCRYPT_AES_128_CTS_KEY_SIZE },
+    [FSCRYPT_MODE_ADIANTUM] = { "adiantum", FSCRYPT_ADIANTUM_KEY_SIZE },
 };
 
 #define NR_EXT4_ENCRYPTION_MODES (sizeof(cipher_modes) / sizeof(cipher_modes[0]))
@@ -62,17 +82,49 @@ struct cipher cipher_modes[] = {
 static inline
 const char *cipher_mode_to_string(unsigned char mode)
 {
-    if ( mode >= NR_EXT4_ENCRYPTION_MODES )
+    if ( mode >= NR_EXT4_ENCRYPTION_MODES || cipher_modes[mode].cipher_name == NULL )
         return "invalid";
 
     return cipher_modes[mode].cipher_name;
 }
 
+static inline
+bool is_valid_cipher(const char *cipher)
+{
+    for ( size_t i = 1; i < NR_EXT4_ENCRYPTION_MODES; i++ ) {
+        if ( cipher_modes[i].cipher_name && strcmp(cipher, cipher_modes[i].cipher_name) == 0 )
+            return true;
+    }
+
+    return false;
+}
+
+//
+// Contents and filenames modes the kernel accepts together.
+//
+static inline
+bool is_valid_cipher_pair(unsigned char contents_mode, unsigned char filenames_mode)
+{
+    switch ( contents_mode ) {
+        case EXT4_ENCRYPTION_MODE_AES_256_XTS:
+            return filenames_mode == EXT4_ENCRYPTION_MODE_AES_256_CTS;
+
+        case FSCRYPT_MODE_AES_128_CBC:
+            return filenames_mode == FSCRYPT_MODE_AES_128_CTS;
+
+        case FSCRYPT_MODE_ADIANTUM:
+            return filenames_mode == FSCRYPT_MODE_ADIANTUM;
+
+        default:
+            return false;
+    }
+}
+
 static inline
 char cipher_string_to_mode(const char *cipher)
 {
     for ( size_t i = 0; i < NR_EXT4_ENCRYPTION_MODES; i++ ) {
-        if ( strcmp(cipher, cipher_modes[i].cipher_name) == 0 )
+        if ( cipher_modes[i].cipher_name && strcmp(cipher, cipher_modes[i].cipher_name) == 0 )
             return i;
     }
 
@@ -84,7 +136,7 @@ static inline
 size_t cipher_key_size(const char *cipher)
 {
     for ( size_t i = 0; i < NR_EXT4_ENCRYPTION_MODES; i++ ) {
-        if ( strcmp(cipher, cipher_modes[i].cipher_name) == 0 )
+        if ( cipher_modes[i].cipher_name && strcmp(cipher, cipher_modes[i].cipher_name) == 0 )
             return cipher_modes[i].cipher_key_size;
     }
 
@@ -95,14 +147,22 @@ size_t cipher_key_size(const char *cipher)
 typedef char key_desc_t[EXT4_KEY_DESCRIPTOR_SIZE];
 typedef char full_key_desc_t[EXT4_FULL_KEY_DESCRIPTOR_SIZE];
 
+struct feature_matrix;
+
 int crypto_init();
-int container_status(const char *dir_path);
+bool cipher_has_aes_acceleration();
+const char *cipher_preset_filenames(const char *contents_cipher);
+void resolve_cipher_options(struct ext4_crypt_options *, int policy_version, const struct feature_matrix *);
+int container_status(const char *dir_path, FILE *out);
 int container_create(const char *dir_path, struct ext4_crypt_options);
 int container_attach(const char *dir_path, struct ext4_crypt_options);
-int container_detach(const char *dir_path, struct ext4_crypt_options);
+int container_detach(const char *dir_path, struct ext4_crypt_options, FILE *out);
+int container_migrate(const char *dir_path, struct ext4_crypt_options);
+int container_rekey(const char *dir_path, struct ext4_crypt_options);
 void generate_random_name(char *, size_t);
-int find_key_by_descriptor(key_desc_t *, key_serial_t *);
-int request_key_for_descriptor(key_desc_t *, struct ext4_crypt_options, bool);
-int remove_key_for_descriptor(key_desc_t *);
+int find_key_by_descriptor(const char *prefix, key_desc_t *, key_serial_t *);
+int add_key_for_descriptor(const char *prefix, key_desc_t *, const struct ext4_encryption_key *);
+int request_master_key(struct ext4_crypt_options, bool, const struct kdf_params *, size_t, struct ext4_encryption_key *);
+int remove_key_for_descriptor(const char *prefix, key_desc_t *);
 
 #endif /* _EXT4_CRYPTO_CONFIG_H */
@@ -0,0 +1,372 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+#include "stache.h"
+
+// One matrix per filesystem probed, replaced whole under the lock: readers
+// copy theirs out and never see a probe in progress.
+static pthread_mutex_t features_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct feature_matrix features[FEATURE_NR_DEVICES];
+static unsigned nr_features;
+static unsigned next_replaced;
+
+//
+// Tries one policy on a fresh subdirectory of the probe directory, then creates
+// a file in it so that the kernel actually instantiates the ciphers.
+//
+static
+bool probe_policy(int probe_fd, const struct crypt_backend *backend, const struct stache_policy *policy)
+{
+    const char *subdir = "policy";
+    bool supported = false;
+
+    if ( mkdirat(probe_fd, subdir, 0700) != 0 )
+        return false;
+
+    int dirfd = openat(probe_fd, subdir, O_RDONLY | O_DIRECTORY);
+    if ( dirfd == -1 )
+        goto out;
+
+    if ( backend->set_policy(dirfd, policy) == 0 ) {
+        int fd = openat(dirfd, "file", O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+        if ( fd != -1 ) {
+            supported = true;
+            close(fd);
+            unlinkat(dirfd, "file", 0);
+        }
+    }
+
+    close(dirfd);
+
+out:
+    unlinkat(probe_fd, subdir, AT_REMOVEDIR);
+    return supported;
+}
+
+//
+// Probes every cipher pair and padding for one policy version, with a throwaway key.
+//
+static
+void probe_version(int probe_fd, const struct crypt_backend *backend, struct feature_matrix *matrix)
+{
+    int version = backend->policy_version;
+    struct stache_policy policy = { .version = version };
+    struct ext4_encryption_key *key = secmem_alloc();
+    if ( key == NULL )
+        return;
+
+    // 64 bytes cover the key size of every mode, in both versions.
+    key->size = FSCRYPT_MAX_KEY_SIZE;
+    randombytes_buf(key->raw, key->size);
+    if ( version == 1 )
+        generate_random_name((char *) policy.key_id, EXT4_KEY_DESCRIPTOR_SIZE);
+
+    if ( backend->add_key(probe_fd, &policy, key, false) < 0 )
+        goto out;
+
+    for ( size_t mode = 1; mode < NR_EXT4_ENCRYPTION_MODES; mode++ ) {
+        if ( cipher_modes[mode].cipher_name == NULL )
+            continue;
+
+        for ( unsigned char filenames_mode = 1; filenames_mode < NR_EXT4_ENCRYPTION_MODES; filenames_mode++ ) {
+            if ( !is_valid_cipher_pair(mode, filenames_mode) )
+                continue;
+
+            for ( unsigned padding = 0; padding < FEATURE_NR_PADDINGS; padding++ ) {
+                policy.contents_mode = mode;
+                policy.filenames_mode = filenames_mode;
+                policy.flags = padding;
+                if ( mode == FSCRYPT_MODE_ADIANTUM )
+                    policy.flags |= FSCRYPT_POLICY_FLAG_DIRECT_KEY;
+
+                if ( probe_policy(probe_fd, backend, &policy) ) {
+                    matrix->supported[version - 1][mode][padding] = true;
+                    matrix->policy_version[version - 1] = true;
+                }
+            }
+        }
+    }
+
+    backend->remove_key(probe_fd, &policy);
+
+out:
+    secmem_free(key);
+}
+
+//
+// Finds the matrix of device _dev_. Caller holds features_lock.
+//
+static
+struct feature_matrix *find_features(dev_t dev)
+{
+    for ( unsigned i = 0; i < nr_features; i++ ) {
+        if ( features[i].probe_dev == dev )
+            return &features[i];
+    }
+
+    return NULL;
+}
+
+//
+// Makes _matrix_ the one of its filesystem, replacing the oldest when full.
+//
+static
+void publish_features(const struct feature_matrix *matrix)
+{
+    pthread_mutex_lock(&features_lock);
+    struct feature_matrix *slot = find_features(matrix->probe_dev);
+    if ( slot == NULL && nr_features < FEATURE_NR_DEVICES )
+        slot = &features[nr_features++];
+    if ( slot == NULL ) {
+        slot = &features[next_replaced];
+        next_replaced = (next_replaced + 1) % FEATURE_NR_DEVICES;
+    }
+    *slot = *matrix;
+    pthread_mutex_unlock(&features_lock);
+}
+
+//
+// Probes which policy versions, cipher modes and padding flags are accepted for
+// new containers under _dir_path_, using a scratch directory next to them.
+// The matrix of that filesystem is only replaced once the probe succeeded.
+//
+int features_probe(const char *dir_path, struct feature_matrix *result)
+{
+    char probe_path[PATH_MAX];
+    struct feature_matrix matrix;
+    struct stat st;
+
+    memset(&matrix, 0, sizeof(matrix));
+
+    if ( (size_t) snprintf(probe_path, sizeof(probe_path), "%s/.stache-probe-XXXXXX", dir_path) >= sizeof(probe_path) ) {
+        fprintf(stderr, "Probe path is too long.\n");
+        return -1;
+    }
+
+    if ( mkdtemp(probe_path) == NULL ) {
+        fprintf(stderr, "Cannot create probe directory in %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    int probe_fd = open(probe_path, O_RDONLY | O_DIRECTORY);
+    if ( probe_fd == -1 || fstat(probe_fd, &st) < 0 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", probe_path, strerror(errno));
+        if ( probe_fd != -1 )
+            close(probe_fd);
+        rmdir(probe_path);
+        return -1;
+    }
+
+    const char *filesystem = backend_filesystem_name(probe_fd);
+    matrix.probe_dev = st.st_dev;
+    snprintf(matrix.filesystem, sizeof(matrix.filesystem), "%s", filesystem ? filesystem : "unknown");
+
+    probe_version(probe_fd, backend_for_version(1), &matrix);
+    if ( fscrypt_v2_supported(probe_fd) )
+        probe_version(probe_fd, backend_for_version(2), &matrix);
+
+    close(probe_fd);
+    rmdir(probe_path);
+
+    strncpy(matrix.probe_path, dir_path, sizeof(matrix.probe_path) - 1);
+    matrix.probed = true;
+    publish_features(&matrix);
+    if ( result != NULL )
+        *result = matrix;
+    return 0;
+}
+
+bool features_probed()
+{
+    pthread_mutex_lock(&features_lock);
+    bool probed = (nr_features > 0);
+    pthread_mutex_unlock(&features_lock);
+
+    return probed;
+}
+
+bool features_lookup(int dirfd, struct feature_matrix *matrix)
+{
+    struct stat st;
+
+    if ( fstat(dirfd, &st) < 0 )
+        return false;
+
+    pthread_mutex_lock(&features_lock);
+    const struct feature_matrix *found = find_features(st.st_dev);
+    if ( found != NULL && matrix != NULL )
+        *matrix = *found;
+    pthread_mutex_unlock(&features_lock);
+
+    return found != NULL;
+}
+
+bool features_cover(int dirfd)
+{
+    return features_lookup(dirfd, NULL);
+}
+
+//
+// Checks whether a contents mode works with some padding. Unprobed means unknown: allowed.
+//
+bool features_mode_supported(const struct feature_matrix *matrix, int policy_version, unsigned char contents_mode)
+{
+    if ( matrix == NULL )
+        return true;
+
+    if ( policy_version < 1 || policy_version > FEATURE_NR_VERSIONS || contents_mode >= NR_EXT4_ENCRYPTION_MODES )
+        return false;
+
+    for ( unsigned padding = 0; padding < FEATURE_NR_PADDINGS; padding++ ) {
+        if ( matrix->supported[policy_version - 1][contents_mode][padding] )
+            return true;
+    }
+
+    return false;
+}
+
+//
+// Checks one cell of the matrix. Unprobed means unknown: allowed.
+//
+bool features_supported(const struct feature_matrix *matrix, int policy_version,
+                        unsigned char contents_mode, unsigned padding_flags)
+{
+    if ( matrix == NULL )
+        return true;
+
+    if ( policy_version < 1 || policy_version > FEATURE_NR_VERSIONS ||
+         contents_mode >= NR_EXT4_ENCRYPTION_MODES || padding_flags >= FEATURE_NR_PADDINGS )
+        return false;
+
+    return matrix->supported[policy_version - 1][contents_mode][padding_flags];
+}
+
+//
+// Validates the options of a new container in _dirfd_ against the cached matrix,
+// when it was probed on the same filesystem.
+//
+int features_check(int dirfd, int policy_version, struct ext4_crypt_options opts)
+{
+    struct feature_matrix matrix;
+
+    if ( !features_lookup(dirfd, &matrix) )
+        return 0;
+
+    unsigned char mode = cipher_string_to_mode(opts.contents_cipher);
+    unsigned padding = padding_length_to_flags(opts.filename_padding);
+
+    if ( policy_version < 1 || policy_version > FEATURE_NR_VERSIONS || !matrix.policy_version[policy_version - 1] ) {
+        fprintf(stderr, "Policy version %d is not supported on this system.\n", policy_version);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ( !features_supported(&matrix, policy_version, mode, padding) ) {
+        fprintf(stderr, "Cipher %s with filename padding %u is not supported by v%d policies on this system.\n",
+                opts.contents_cipher, opts.filename_padding, policy_version);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Prints one feature matrix.
+//
+static
+void print_matrix(const struct feature_matrix *matrix, FILE *out)
+{
+    fprintf(out, "Encryption features for %s (%s):\n", matrix->probe_path, matrix->filesystem);
+    for ( int version = 1; version <= FEATURE_NR_VERSIONS; version++ ) {
+        fprintf(out, "Policy v%d:         %s\n", version,
+                matrix->policy_version[version - 1] ? "supported" : "not supported");
+
+        if ( !matrix->policy_version[version - 1] )
+            continue;
+
+        for ( size_t mode = 1; mode < NR_EXT4_ENCRYPTION_MODES; mode++ ) {
+            if ( cipher_modes[mode].cipher_name == NULL || cipher_preset_filenames(cipher_modes[mode].cipher_name) == NULL )
+                continue;
+
+            fprintf(out, "  %-18s", cipher_modes[mode].cipher_name);
+            for ( unsigned padding = 0; padding < FEATURE_NR_PADDINGS; padding++ ) {
+                fprintf(out, " pad%-2u %s", flags_to_padding_length(padding),
+                        matrix->supported[version - 1][mode][padding] ? "yes" : "no ");
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+//
+// Prints the feature matrix of every filesystem probed.
+//
+void features_print(FILE *out)
+{
+    pthread_mutex_lock(&features_lock);
+    if ( nr_features == 0 )
+        fprintf(out, "Encryption features: not probed\n");
+    for ( unsigned i = 0; i < nr_features; i++ )
+        print_matrix(&features[i], out);
+    pthread_mutex_unlock(&features_lock);
+}
+
+int features_save(FILE *out)
+{
+    pthread_mutex_lock(&features_lock);
+    int ret = (nr_features == 0) ? 0 :
+        handover_write_section(out, HANDOVER_SECTION_FEATURES, features, nr_features * sizeof(features[0]));
+    pthread_mutex_unlock(&features_lock);
+
+    return ret;
+}
+
+//
+// The section holds one matrix per filesystem, a single one from older daemons.
+//
+int features_restore(struct handover_reader *section)
+{
+    struct feature_matrix restored;
+
+    if ( section->size % sizeof(restored) != 0 || section->size / sizeof(restored) > FEATURE_NR_DEVICES ) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    for ( size_t i = 0; i < section->size / sizeof(restored); i++ ) {
+        if ( handover_read(section, &restored, sizeof(restored)) < 0 ) {
+            errno = EBADMSG;
+            return -1;
+        }
+        publish_features(&restored);
+    }
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FEATURE_MATRIX_H
+#define _FEATURE_MATRIX_H
+
+/*
+ * Encryption features accepted by the kernel and filesystem, probed once per
+ * filesystem and cached so that requests can be validated before any
+ * passphrase is read. Callers look up a copy of the matrix of their
+ * filesystem; a NULL matrix means unprobed, and every feature is allowed.
+ */
+
+#define FEATURE_NR_VERSIONS 2
+#define FEATURE_NR_PADDINGS 4
+#define FEATURE_NR_DEVICES 8
+
+struct feature_matrix {
+    bool probed;
+    char probe_path[PATH_MAX];
+    char filesystem[16];
+    dev_t probe_dev;                // the matrix only holds for this filesystem
+    bool policy_version[FEATURE_NR_VERSIONS];
+    // Indexed by policy version - 1, contents mode (with its filenames mode), padding flags.
+    bool supported[FEATURE_NR_VERSIONS][NR_EXT4_ENCRYPTION_MODES][FEATURE_NR_PADDINGS];
+};
+
+// Probes the filesystem of _dir_path_, and copies the new matrix into _matrix_
+// unless it is NULL.
+int features_probe(const char *dir_path, struct feature_matrix *matrix);
+// Whether any filesystem was probed.
+bool features_probed();
+// Copies the matrix probed on the filesystem of _dirfd_, unless _matrix_ is NULL.
+// Returns false if that filesystem was not probed.
+bool features_lookup(int dirfd, struct feature_matrix *matrix);
+bool features_cover(int dirfd);
+bool features_mode_supported(const struct feature_matrix *, int policy_version, unsigned char contents_mode);
+bool features_supported(const struct feature_matrix *, int policy_version,
+                        unsigned char contents_mode, unsigned padding_flags);
+int features_check(int dirfd, int policy_version, struct ext4_crypt_options);
+void features_print(FILE *out);
+// Hands the probed matrix over to a successor daemon, which then skips probing.
+int features_save(FILE *out);
+int features_restore(struct handover_reader *section);
+
+#endif /* _FEATURE_MATRIX_H */
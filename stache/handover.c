@@ -0,0 +1,218 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "stache.h"
+#include "protocol.h"
+
+struct section_header {
+    uint32_t type;
+    uint32_t size;
+} __attribute__((__packed__));
+
+int handover_send(int channel, enum handover_type type, const int *fds, unsigned nr_fds)
+{
+    struct handover_message message = {
+        .type = type,
+        .version = HANDOVER_STATE_VERSION,
+        .nr_fds = nr_fds,
+    };
+    struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+    if ( nr_fds > HANDOVER_MAX_FDS ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(message.magic, HANDOVER_MAGIC, sizeof(message.magic));
+    if ( nr_fds > 0 ) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while ( n < 0 && errno == EINTR );
+
+    return (n == sizeof(message)) ? 0 : -1;
+}
+
+int handover_receive(int channel, struct handover_message *message, int *fds, unsigned *nr_fds)
+{
+    // Large enough for an error response, which is not a handover message.
+    char buf[sizeof(struct stache_response)];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *nr_fds = 0;
+
+    ssize_t n;
+    do {
+        n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while ( n < 0 && errno == EINTR );
+
+    if ( n <= 0 ) {
+        if ( n == 0 )
+            errno = ECONNRESET;
+        return -1;
+    }
+
+    for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+        if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+            continue;
+
+        unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for ( unsigned i = 0; i < count; i++ ) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if ( *nr_fds < HANDOVER_MAX_FDS )
+                fds[(*nr_fds)++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    if ( (size_t) n != sizeof(*message) || memcmp(buf, HANDOVER_MAGIC, sizeof(message->magic)) != 0 ) {
+        for ( unsigned i = 0; i < *nr_fds; i++ )
+            close(fds[i]);
+        *nr_fds = 0;
+
+        // Hands the error of a daemon refusing the handover back to the caller.
+        const struct stache_response *resp = (const struct stache_response *) buf;
+        if ( (size_t) n >= STACHE_RESPONSE_HEADER_SZ && resp->status != 0 ) {
+            errno = resp->error;
+            return -1;
+        }
+        return 0;
+    }
+
+    memcpy(message, buf, sizeof(*message));
+    return message->type;
+}
+
+int handover_write_section(FILE *out, enum handover_section type, const void *data, size_t size)
+{
+    struct section_header header = {
+        .type = type,
+        .size = size,
+    };
+
+    if ( size > UINT32_MAX ) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if ( fwrite(&header, sizeof(header), 1, out) != 1 || (size && fwrite(data, size, 1, out) != 1) )
+        return -1;
+
+    return 0;
+}
+
+int handover_load_state(int fd, struct handover_reader *state)
+{
+    struct stat st;
+    uint8_t *data = NULL;
+
+    memset(state, 0, sizeof(*state));
+    if ( fstat(fd, &st) != 0 )
+        return -1;
+
+    if ( st.st_size > 0 ) {
+        data = malloc(st.st_size);
+        if ( data == NULL )
+            return -1;
+
+        if ( pread(fd, data, st.st_size, 0) != st.st_size ) {
+            free(data);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    state->data = data;
+    state->size = st.st_size;
+    return 0;
+}
+
+void handover_release_state(struct handover_reader *state)
+{
+    free((void *) state->data);
+    memset(state, 0, sizeof(*state));
+}
+
+int handover_next_section(struct handover_reader *state, uint32_t *type, struct handover_reader *section)
+{
+    struct section_header header;
+
+    if ( state->offset == state->size )
+        return 0;
+
+    if ( handover_read(state, &header, sizeof(header)) < 0 || header.size > state->size - state->offset )
+        return -1;
+
+    *type = header.type;
+    section->data = state->data + state->offset;
+    section->size = header.size;
+    section->offset = 0;
+    state->offset += header.size;
+    return 1;
+}
+
+int handover_read(struct handover_reader *reader, void *data, size_t size)
+{
+    if ( size > reader->size - reader->offset ) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    memcpy(data, reader->data + reader->offset, size);
+    reader->offset += size;
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HANDOVER_H
+#define _HANDOVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Handover of a running daemon to its successor, for upgrades.
+ *
+ * The successor connects to the control socket like any client and asks for
+ * the handover. The predecessor stops accepting, and answers on that
+ * connection with messages carrying descriptors: its listening socket along
+ * with a state file of non-secret caches, then each client connection as
+ * soon as it is idle, then the end of the handover, after which it exits.
+ * Clients keep their connection and whatever requests they queued on it.
+ *
+ * The state file is a sequence of sections, each the private format of one
+ * module. A successor with another state version ignores the file and warms
+ * up from scratch, but still takes the sockets over.
+ */
+
+#define HANDOVER_MAGIC "STHAND01"
+#define HANDOVER_STATE_VERSION 1
+#define HANDOVER_MAX_FDS 3
+
+enum handover_type {
+    HANDOVER_STATE = 1,             // fds: listening socket, state file, usage inotify (optional)
+    HANDOVER_CLIENT,                // fd: a client connection, between two requests
+    HANDOVER_DONE,
+};
+
+enum handover_section {
+    HANDOVER_SECTION_FEATURES = 1,
+    HANDOVER_SECTION_FILESYSTEMS,
+    HANDOVER_SECTION_USAGE,
+};
+
+struct handover_message {
+    char magic[8];
+    uint32_t type;
+    uint32_t version;               // HANDOVER_STATE_VERSION of the sender
+    uint32_t nr_fds;
+} __attribute__((__packed__));
+
+// Bounds-checked cursor over a state file or one of its sections.
+struct handover_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+};
+
+int handover_send(int channel, enum handover_type, const int *fds, unsigned nr_fds);
+// Receives one message and up to HANDOVER_MAX_FDS descriptors. Returns its type,
+// 0 for a message of another kind (such as an error response), -1 on failure.
+int handover_receive(int channel, struct handover_message *, int *fds, unsigned *nr_fds);
+
+int handover_write_section(FILE *out, enum handover_section, const void *data, size_t size);
+// Reads the whole state file into _state_, to be freed with handover_release_state().
+int handover_load_state(int fd, struct handover_reader *state);
+void handover_release_state(struct handover_reader *state);
+// Moves to the next section of _state_. Returns 1, 0 at the end, -1 if truncated.
+int handover_next_section(struct handover_reader *state, uint32_t *type, struct handover_reader *section);
+// Copies the next _size_ bytes of _reader_ into _data_, or fails if there are fewer.
+int handover_read(struct handover_reader *reader, void *data, size_t size);
+
+#endif /* _HANDOVER_H */
@@ -43,14 +43,15 @@
 // Derives passphrase into an ext4 encryption key.
 //
 static
-int derive_passphrase_to_key(char *pass, size_t pass_sz, struct ext4_encryption_key *key)
+int derive_passphrase_to_key(char *pass, size_t pass_sz, const struct kdf_params *kdf,
+                             struct ext4_encryption_key *key)
 {
-    const unsigned char salt[] = "ext4";
-
+    uint64_t started_ns = stats_now();
     int ret = crypto_pwhash_scryptsalsa208sha256_ll((uint8_t *) pass, pass_sz,
-                                                    salt, sizeof(salt) - 1,
-                                                    (1 << 14), 8, 16, // N, r, p
+                                                    kdf->salt, kdf->salt_size,
+                                                    (1ULL << kdf->log_n), kdf->r, kdf->p,
                                                     key->raw, key->size);
+    trace_phase(STATS_KDF, started_ns, 0, ret != 0 ? ENOMEM : 0);
 
     if ( ret != 0 ) {
         fprintf(stderr, "scrypt failed: cannot derive passphrase\n");
@@ -61,13 +62,13 @@ int derive_passphrase_to_key(char *pass, size_t pass_sz, struct ext4_encryption_
 }
 
 //
-// Converts an ext4 key descriptor to a keyring descriptor.
+// Converts an ext4 key descriptor to a keyring descriptor under _prefix_.
 //
 static
-void build_full_key_descriptor(key_desc_t *key_desc, full_key_desc_t *full_key_desc)
+void build_full_key_descriptor(const char *prefix, key_desc_t *key_desc, full_key_desc_t *full_key_desc)
 {
     char tmp[sizeof(*full_key_desc) + 1]; // one extra space for terminating zero
-    strcpy(tmp, EXT4_KEY_DESC_PREFIX);
+    snprintf(tmp, EXT4_KEY_DESC_PREFIX_SIZE + 1, "%s", prefix);
 
     for ( size_t i = 0; i < sizeof(*key_desc); i++ ) {
         snprintf(tmp + EXT4_KEY_DESC_PREFIX_SIZE + i * 2, 3, "%02x", (*key_desc)[i] & 0xff);
@@ -76,13 +77,6 @@ void build_full_key_descriptor(key_desc_t *key_desc, full_key_desc_t *full_key_d
     memcpy(*full_key_desc, tmp, sizeof(*full_key_desc));
 }
 
-// Fill key buffer with zeros.
-static
-void zero_key(void *key, size_t key_sz)
-{
-    sodium_memzero(key, key_sz);
-}
-
 //
 // Reads passphrase from standard input.
 //
@@ -131,14 +125,113 @@ ssize_t read_passphrase(const char *prompt, char *key, size_t n)
 }
 
 //
-// Initializes the state of the libc PRNG.
+// Reads a secret from a file descriptor supplied by the caller (pipe, socket, file).
+// No prompt and no terminal handling: reads until EOF or until the buffer is full.
+// A single trailing newline is stripped from passphrases.
+//
+static
+ssize_t read_secret_from_fd(int fd, char *secret, size_t n, bool is_key)
+{
+    size_t secret_sz = 0;
+
+    while ( secret_sz < n ) {
+        ssize_t count = read(fd, secret + secret_sz, n - secret_sz);
+        if ( count == -1 && errno == EINTR )
+            continue;
+
+        if ( count == -1 ) {
+            fprintf(stderr, "Cannot read secret from descriptor %d: %s\n", fd, strerror(errno));
+            return -1;
+        }
+
+        if ( count == 0 )
+            break;
+
+        secret_sz += count;
+    }
+
+    if ( !is_key ) {
+        if ( secret_sz == n ) {
+            fprintf(stderr, "Passphrase is too long (maximum is %zu bytes).\n", n - 1);
+            return -1;
+        }
+
+        if ( secret_sz > 0 && secret[secret_sz - 1] == '\n' )
+            secret_sz--;
+
+        secret[secret_sz] = '\0';
+    }
+
+    return secret_sz;
+}
+
+//
+// Prompts for a passphrase on standard input, with confirmation if requested.
 //
 static
-void random_init()
+ssize_t prompt_passphrase(char *passphrase, char *confirm_passphrase, bool confirm)
 {
-    unsigned int seed = randombytes_random();
+    int retries = 5;
+    ssize_t pass_sz;
+
+    while ( --retries >= 0 ) {
+        pass_sz = read_passphrase("Enter passphrase: ", passphrase, EXT4_MAX_PASSPHRASE_SZ);
+        if ( pass_sz < 0 )
+            return -1;
+
+        if ( pass_sz == 0 ) {
+            fprintf(stderr, "Passphrase cannot be empty.\n");
+            continue;
+        }
+
+        if ( !confirm )
+            return pass_sz;
+
+        read_passphrase("Confirm passphrase: ", confirm_passphrase, EXT4_MAX_PASSPHRASE_SZ);
+        if ( strcmp(passphrase, confirm_passphrase) == 0 )
+            return pass_sz;
 
-    srandom(seed);
+        fprintf(stderr, "Password mismatch.\n");
+    }
+
+    fprintf(stderr, "Cannot read passphrase.\n");
+    return -1;
+}
+
+//
+// Obtains the secret for a key request, from the first available source:
+// the options themselves, a descriptor, or an interactive prompt.
+//
+static
+ssize_t obtain_secret(struct ext4_crypt_options opts, bool confirm, char *secret, char *scratch)
+{
+    ssize_t secret_sz;
+
+    if ( opts.secret != NULL ) {
+        if ( opts.secret_size > EXT4_MAX_PASSPHRASE_SZ - 1 ) {
+            fprintf(stderr, "Secret is too long (maximum is %d bytes).\n", EXT4_MAX_PASSPHRASE_SZ - 1);
+            return -1;
+        }
+
+        memcpy(secret, opts.secret, opts.secret_size);
+        secret[opts.secret_size] = '\0';
+        secret_sz = opts.secret_size;
+    }
+    else if ( opts.secret_fd >= 0 )
+        secret_sz = read_secret_from_fd(opts.secret_fd, secret, EXT4_MAX_PASSPHRASE_SZ, opts.secret_is_key);
+    else if ( opts.secret_is_key ) {
+        fprintf(stderr, "Raw key material cannot be entered interactively.\n");
+        return -1;
+    }
+    else
+        return prompt_passphrase(secret, scratch, confirm);
+
+    if ( secret_sz == 0 ) {
+        fprintf(stderr, "Passphrase cannot be empty.\n");
+        return -1;
+    }
+
+    return secret_sz;
 }
 
 //
@@ -157,7 +250,9 @@ int crypto_init()
         return -1;
     }
 
-    random_init();
+    if ( secmem_init() == -1 )
+        return -1;
+
     return 0;
 }
 
@@ -174,8 +269,11 @@ void generate_random_name(char *name, size_t length)
         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'
     };
 
+    unsigned char indexes[length];
+
+    random_pool_uniform(indexes, length, sizeof(key_charset));
     for ( size_t i = 0; i < length; i++ ) {
-        name[i] = key_charset[ random() % sizeof(key_charset) ];
+        name[i] = key_charset[ indexes[i] ];
     }
 }
 
@@ -183,15 +281,17 @@ void generate_random_name(char *name, size_t length)
 // Lookups a key in the user session keyring from an ext4 key descriptor.
 // Returns the key serial number in _serial_.
 //
-int find_key_by_descriptor(key_desc_t *key_desc, key_serial_t *serial)
+int find_key_by_descriptor(const char *prefix, key_desc_t *key_desc, key_serial_t *serial)
 {
     full_key_desc_t full_key_descriptor;
-    build_full_key_descriptor(key_desc, &full_key_descriptor);
+    build_full_key_descriptor(prefix, key_desc, &full_key_descriptor);
 
+    uint64_t started_ns = stats_now();
     long key_serial = keyctl_search(KEY_SPEC_USER_SESSION_KEYRING,
                                     EXT4_ENCRYPTION_KEY_TYPE,
                                     full_key_descriptor,
                                     0);
+    trace_phase(STATS_KEY_SEARCH, started_ns, trace_hash(key_desc, sizeof(*key_desc)), key_serial == -1 ? errno : 0);
     if ( key_serial != -1 ) {
         *serial = key_serial;
         return 0;
@@ -203,13 +303,17 @@ int find_key_by_descriptor(key_desc_t *key_desc, key_serial_t *serial)
 //
 // Removes a key given its serial and the keyring it belongs to.
 //
-int remove_key_for_descriptor(key_desc_t *key_desc)
+int remove_key_for_descriptor(const char *prefix, key_desc_t *key_desc)
 {
     key_serial_t key_serial;
-    if ( find_key_by_descriptor(key_desc, &key_serial) < 0 )
+    if ( find_key_by_descriptor(prefix, key_desc, &key_serial) < 0 )
         return -1;
 
-    if ( keyctl_unlink(key_serial, KEY_SPEC_USER_SESSION_KEYRING) == -1 ) {
+    uint64_t started_ns = stats_now();
+    long rc = keyctl_unlink(key_serial, KEY_SPEC_USER_SESSION_KEYRING);
+    trace_phase(STATS_KEY_REMOVE, started_ns, trace_hash(key_desc, sizeof(*key_desc)), rc == -1 ? errno : 0);
+
+    if ( rc == -1 ) {
         fprintf(stderr, "Cannot remove encryption key: %s\n", strerror(errno));
         return -1;
     }
@@ -218,64 +322,88 @@ int remove_key_for_descriptor(key_desc_t *key_desc)
 }
 
 //
-// Requests a key to be attached to the specified descriptor.
+// Adds a key to the user session keyring under the specified ext4 descriptor.
 //
-int request_key_for_descriptor(key_desc_t *key_desc, struct ext4_crypt_options opts, bool confirm)
+int add_key_for_descriptor(const char *prefix, key_desc_t *key_desc, const struct ext4_encryption_key *master_key)
 {
-    int retries = 5;
-    char passphrase[EXT4_MAX_PASSPHRASE_SZ];
-    char confirm_passphrase[sizeof(passphrase)];
-    ssize_t pass_sz;
     full_key_desc_t full_key_descriptor;
-    build_full_key_descriptor(key_desc, &full_key_descriptor);
-
-    while ( --retries >= 0 ) {
-        pass_sz = read_passphrase("Enter passphrase: ", passphrase, sizeof(passphrase));
-        if ( pass_sz < 0 )
-            return -1;
-
-        if ( pass_sz == 0 ) {
-            fprintf(stderr, "Passphrase cannot be empty.\n");
-            continue;
-        }
-
-        if ( !confirm )
-            break;
-
-        read_passphrase("Confirm passphrase: ", confirm_passphrase, sizeof(confirm_passphrase));
-        if ( strcmp(passphrase, confirm_passphrase) == 0 )
-            break;
-
-        fprintf(stderr, "Password mismatch.\n");
-    }
-
-    if ( retries < 0 ) {
-        fprintf(stderr, "Cannot read passphrase.\n");
-        return -1;
-    }
-
-    struct ext4_encryption_key master_key = {
-        .mode = 0,
-        .raw = { 0 },
-        .size = cipher_key_size(opts.contents_cipher),
-    };
-    if ( derive_passphrase_to_key(passphrase, pass_sz, &master_key) < 0 )
-        return -1;
+    build_full_key_descriptor(prefix, key_desc, &full_key_descriptor);
 
+    uint64_t started_ns = stats_now();
     key_serial_t serial = add_key(EXT4_ENCRYPTION_KEY_TYPE,
                                   full_key_descriptor,
-                                  &master_key,
-                                  sizeof(master_key),
+                                  master_key,
+                                  sizeof(*master_key),
                                   KEY_SPEC_USER_SESSION_KEYRING
                                  );
+    trace_phase(STATS_KEY_ADD, started_ns, trace_hash(key_desc, sizeof(*key_desc)), serial == -1 ? errno : 0);
 
     if ( serial == -1 ) {
         fprintf(stderr, "Cannot add key to keyring: %s\n", strerror(errno));
         return -1;
     }
 
-    zero_key(passphrase, sizeof(passphrase));
-    zero_key(confirm_passphrase, sizeof(confirm_passphrase));
-    zero_key(&master_key, sizeof(master_key));
     return 0;
 }
+
+//
+// Obtains the master key of _key_size_ bytes for a container, either by deriving
+// it from a passphrase or from key material supplied by the caller.
+// Passphrases are derived with the _kdf_ parameters of the container.
+// _master_key_ should come from secmem_alloc().
+//
+int request_master_key(struct ext4_crypt_options opts, bool confirm, const struct kdf_params *kdf,
+                       size_t key_size, struct ext4_encryption_key *master_key)
+{
+    int ret = -1;
+    ssize_t secret_sz;
+
+    if ( key_size == 0 || key_size > sizeof(master_key->raw) ) {
+        fprintf(stderr, "Invalid key size: %zu\n", key_size);
+        return -1;
+    }
+
+    // Secrets live in the locked arena and are wiped when released.
+    char *passphrase = secmem_alloc();
+    char *confirm_passphrase = secmem_alloc();
+    if ( passphrase == NULL || confirm_passphrase == NULL )
+        goto out;
+
+    secret_sz = obtain_secret(opts, confirm, passphrase, confirm_passphrase);
+    if ( secret_sz < 0 )
+        goto out;
+
+    master_key->mode = 0;
+    master_key->size = key_size;
+
+    if ( opts.secret_is_key ) {
+        // Key material was derived by a trusted caller, use it as is.
+        if ( (size_t) secret_sz != key_size ) {
+            fprintf(stderr, "Invalid key size: expected %zu bytes, got %zd.\n", key_size, secret_sz);
+            goto out;
+        }
+
+        memcpy(master_key->raw, passphrase, key_size);
+    }
+    else {
+        // Derivations are queued behind one another, and dropped once nobody waits for them.
+        struct placement_token placement;
+        uint64_t entered_ns;
+        if ( lane_enter(LANE_KDF, opts.cancel, &entered_ns) < 0 )
+            goto out;
+
+        placement_enter(WORK_KDF, &placement);
+        int derived = derive_passphrase_to_key(passphrase, secret_sz, kdf, master_key);
+        placement_leave(WORK_KDF, &placement);
+        lane_leave(LANE_KDF, entered_ns);
+        if ( derived < 0 || lane_boundary(LANE_KDF, opts.cancel) < 0 )
+            goto out;
+    }
+
+    ret = 0;
+
+out:
+    secmem_free(passphrase);
+    secmem_free(confirm_passphrase);
+    return ret;
+}
@@ -0,0 +1,231 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include "stache.h"
+
+struct lane {
+    const char *name;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    unsigned width;                 // 0 until first used, UINT_MAX for unbounded
+    unsigned busy;
+    uint64_t cost_ns;               // moving average of the time spent in the lane
+
+    atomic_ullong admitted;
+    atomic_ullong dropped[NR_CANCEL_REASONS];
+    atomic_ullong abandoned[NR_CANCEL_REASONS];
+    atomic_ullong saved_ns;
+};
+
+static struct lane lanes[NR_WORK_LANES] = {
+    [LANE_REQUEST] = {
+        .name = "request",
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .available = PTHREAD_COND_INITIALIZER,
+        .width = UINT_MAX,
+    },
+    [LANE_KDF] = {
+        .name = "kdf",              // one derivation per CPU of its work class
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .available = PTHREAD_COND_INITIALIZER,
+    },
+};
+
+static
+int cancel_errno(enum cancel_reason reason)
+{
+    return (reason == CANCEL_EXPIRED) ? ETIMEDOUT : ECANCELED;
+}
+
+enum cancel_reason cancel_check(const struct cancel_token *token)
+{
+    if ( token == NULL )
+        return CANCEL_NONE;
+
+    if ( token->deadline_ns != 0 && stats_now() >= token->deadline_ns )
+        return CANCEL_EXPIRED;
+
+    if ( token->client_fd != -1 ) {
+        struct pollfd pfd = { .fd = token->client_fd, .events = POLLRDHUP };
+
+        if ( poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) )
+            return CANCEL_ORPHANED;
+    }
+
+    return CANCEL_NONE;
+}
+
+//
+// Sleeps on the lane until a slot frees up, the next poll of the client, or
+// the deadline, whichever comes first. Called with the lane locked.
+//
+static
+void wait_for_slot(struct lane *lane, const struct cancel_token *token)
+{
+    uint64_t wait_ns = LANE_POLL_MS * 1000000ULL;
+    struct timespec ts;
+
+    if ( token != NULL && token->deadline_ns != 0 ) {
+        uint64_t now = stats_now();
+        if ( token->deadline_ns > now && token->deadline_ns - now < wait_ns )
+            wait_ns = token->deadline_ns - now;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait_ns / 1000000000ULL;
+    ts.tv_nsec += wait_ns % 1000000000ULL;
+    if ( ts.tv_nsec >= 1000000000L ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_cond_timedwait(&lane->available, &lane->lock, &ts);
+}
+
+//
+// Width of the lane, settled on first use. Called with the lane locked.
+//
+static
+unsigned lane_width(struct lane *lane)
+{
+    // Only the KDF lane is bounded.
+    if ( lane->width == 0 )
+        lane->width = placement_width(WORK_KDF);
+
+    return lane->width;
+}
+
+const char *lane_name(enum work_lane id)
+{
+    return (id < NR_WORK_LANES) ? lanes[id].name : "unknown";
+}
+
+int lane_enter(enum work_lane id, const struct cancel_token *token, uint64_t *entered_ns)
+{
+    struct lane *lane = &lanes[id];
+    enum cancel_reason reason;
+    uint64_t queued_ns = stats_now();
+
+    pthread_mutex_lock(&lane->lock);
+    while ( (reason = cancel_check(token)) == CANCEL_NONE && lane->busy >= lane_width(lane) )
+        wait_for_slot(lane, token);
+
+    if ( reason == CANCEL_NONE )
+        lane->busy++;
+    uint64_t cost_ns = lane->cost_ns;
+    pthread_mutex_unlock(&lane->lock);
+
+    if ( reason != CANCEL_NONE ) {
+        atomic_fetch_add(&lane->dropped[reason], 1);
+        atomic_fetch_add(&lane->saved_ns, cost_ns);
+        trace_record(TRACE_CANCEL, id, 0, cancel_errno(reason), stats_now() - queued_ns);
+        fprintf(stderr, "Dropping %s work: %s.\n", lane->name,
+                reason == CANCEL_EXPIRED ? "deadline passed" : "client went away");
+        errno = cancel_errno(reason);
+        return -1;
+    }
+
+    atomic_fetch_add(&lane->admitted, 1);
+    *entered_ns = stats_now();
+    return 0;
+}
+
+void lane_leave(enum work_lane id, uint64_t entered_ns)
+{
+    struct lane *lane = &lanes[id];
+    uint64_t elapsed_ns = stats_now() - entered_ns;
+
+    pthread_mutex_lock(&lane->lock);
+    lane->busy--;
+    // Weight of 1/8: follows a change of load within a few dozen requests.
+    if ( lane->cost_ns == 0 )
+        lane->cost_ns = elapsed_ns;
+    else
+        lane->cost_ns += ((int64_t) elapsed_ns - (int64_t) lane->cost_ns) / 8;
+    pthread_cond_signal(&lane->available);
+    pthread_mutex_unlock(&lane->lock);
+}
+
+int lane_boundary(enum work_lane id, const struct cancel_token *token)
+{
+    struct lane *lane = &lanes[id];
+    enum cancel_reason reason = cancel_check(token);
+
+    if ( reason == CANCEL_NONE )
+        return 0;
+
+    atomic_fetch_add(&lane->abandoned[reason], 1);
+    trace_record(TRACE_CANCEL, id, 0, cancel_errno(reason), 0);
+    fprintf(stderr, "Abandoning work after %s: %s.\n", lane->name,
+            reason == CANCEL_EXPIRED ? "deadline passed" : "client went away");
+    errno = cancel_errno(reason);
+    return -1;
+}
+
+void lane_get_stats(enum work_lane id, struct lane_stats *stats)
+{
+    struct lane *lane = &lanes[id];
+
+    pthread_mutex_lock(&lane->lock);
+    stats->width = lane_width(lane);
+    stats->busy = lane->busy;
+    pthread_mutex_unlock(&lane->lock);
+
+    stats->admitted = atomic_load(&lane->admitted);
+    for ( int reason = 0; reason < NR_CANCEL_REASONS; reason++ ) {
+        stats->dropped[reason] = atomic_load(&lane->dropped[reason]);
+        stats->abandoned[reason] = atomic_load(&lane->abandoned[reason]);
+    }
+    stats->saved_ns = atomic_load(&lane->saved_ns);
+}
+
+void lane_print(FILE *out)
+{
+    fprintf(out, "%-12s %6s %6s %10s %10s %10s %10s %10s %10s\n",
+            "lane", "width", "busy", "admitted", "expired", "orphaned",
+            "late-exp", "late-orph", "saved(ms)");
+
+    for ( int id = 0; id < NR_WORK_LANES; id++ ) {
+        struct lane_stats stats;
+        char width[12];
+
+        lane_get_stats(id, &stats);
+        if ( stats.width == UINT_MAX )
+            snprintf(width, sizeof(width), "-");
+        else
+            snprintf(width, sizeof(width), "%u", stats.width);
+
+        fprintf(out, "%-12s %6s %6u %10llu %10llu %10llu %10llu %10llu %10.1f\n",
+                lanes[id].name, width, stats.busy,
+                (unsigned long long) stats.admitted,
+                (unsigned long long) stats.dropped[CANCEL_EXPIRED],
+                (unsigned long long) stats.dropped[CANCEL_ORPHANED],
+                (unsigned long long) stats.abandoned[CANCEL_EXPIRED],
+                (unsigned long long) stats.abandoned[CANCEL_ORPHANED],
+                stats.saved_ns / 1e6);
+    }
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LANE_H
+#define _LANE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Admission of daemon work, with deadlines and cancellation.
+ *
+ * Expensive work runs in lanes of bounded width: a request waits for a free
+ * slot before starting, and gives up waiting as soon as its cancellation
+ * token fires, either because its deadline passed or because its client hung
+ * up. Work already admitted is not interrupted, but is abandoned at the next
+ * boundary between lanes. Dropped and abandoned work is counted per lane,
+ * along with an estimate of the time it would have taken.
+ */
+
+#define LANE_POLL_MS 50             // how often queued work looks for its client going away
+
+enum work_lane {
+    LANE_REQUEST,                   // container operations, unbounded
+    LANE_KDF,                       // passphrase derivations, one per CPU of their work class
+    NR_WORK_LANES,
+};
+
+enum cancel_reason {
+    CANCEL_NONE,
+    CANCEL_EXPIRED,                 // the deadline passed
+    CANCEL_ORPHANED,                // the client hung up
+    NR_CANCEL_REASONS,
+};
+
+struct cancel_token {
+    uint64_t deadline_ns;           // CLOCK_MONOTONIC, 0 for none
+    int client_fd;                  // its hang-up cancels the work, -1 for none
+};
+
+struct lane_stats {
+    unsigned width;
+    unsigned busy;
+    uint64_t admitted;
+    uint64_t dropped[NR_CANCEL_REASONS];    // before starting
+    uint64_t abandoned[NR_CANCEL_REASONS];  // at a boundary, after starting
+    uint64_t saved_ns;                      // estimated lane time of the dropped work
+};
+
+enum cancel_reason cancel_check(const struct cancel_token *);
+const char *lane_name(enum work_lane);
+
+// Waits for a slot of _lane_. Returns -1 with errno ETIMEDOUT or ECANCELED if
+// _token_ fires first. _entered_ns_ is to be passed back to lane_leave().
+int lane_enter(enum work_lane, const struct cancel_token *, uint64_t *entered_ns);
+void lane_leave(enum work_lane, uint64_t entered_ns);
+// Returns -1 with errno set if work which went through _lane_ should be abandoned.
+int lane_boundary(enum work_lane, const struct cancel_token *);
+
+void lane_get_stats(enum work_lane, struct lane_stats *);
+void lane_print(FILE *out);
+
+#endif /* _LANE_H */
@@ -0,0 +1,149 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sodium.h>
+#include <sys/xattr.h>
+
+#include "stache.h"
+
+void kdf_params_legacy(struct kdf_params *kdf)
+{
+    const char salt[] = "ext4";
+
+    memset(kdf, 0, sizeof(*kdf));
+    kdf->version = KDF_PARAMS_VERSION;
+    kdf->log_n = 14;
+    kdf->r = 8;
+    kdf->p = 16;
+    kdf->salt_size = sizeof(salt) - 1;
+    memcpy(kdf->salt, salt, kdf->salt_size);
+}
+
+void kdf_params_generate(struct kdf_params *kdf)
+{
+    memset(kdf, 0, sizeof(*kdf));
+    kdf->version = KDF_PARAMS_VERSION;
+    kdf->log_n = KDF_DEFAULT_LOG_N;
+    kdf->r = KDF_DEFAULT_R;
+    kdf->p = KDF_DEFAULT_P;
+    kdf->salt_size = KDF_SALT_SIZE;
+    random_pool_bytes(kdf->salt, KDF_SALT_SIZE);
+}
+
+int metadata_get_kdf(int dirfd, struct kdf_params *kdf)
+{
+    ssize_t size = fgetxattr(dirfd, STACHE_XATTR_KDF, kdf, sizeof(*kdf));
+
+    if ( size < 0 ) {
+        if ( errno == ENODATA || errno == ENOTSUP ) {
+            kdf_params_legacy(kdf);
+            return 0;
+        }
+        fprintf(stderr, "Cannot read the key derivation parameters: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ( size != sizeof(*kdf) || kdf->version != KDF_PARAMS_VERSION ||
+         kdf->salt_size == 0 || kdf->salt_size > KDF_SALT_SIZE || kdf->log_n == 0 || kdf->log_n > 30 ) {
+        fprintf(stderr, "Invalid key derivation parameters.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int metadata_set_kdf(int dirfd, const struct kdf_params *kdf)
+{
+    return fsetxattr(dirfd, STACHE_XATTR_KDF, kdf, sizeof(*kdf), 0);
+}
+
+int metadata_get_usage(int dirfd, struct usage_record *usage)
+{
+    ssize_t size = fgetxattr(dirfd, STACHE_XATTR_USAGE, usage, sizeof(*usage));
+
+    if ( size < 0 )
+        return -1;
+
+    if ( size != sizeof(*usage) || usage->version != USAGE_RECORD_VERSION ) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+int metadata_set_usage(int dirfd, const struct usage_record *usage)
+{
+    return fsetxattr(dirfd, STACHE_XATTR_USAGE, usage, sizeof(*usage), 0);
+}
+
+int metadata_get_verifier(int dirfd, struct key_verifier *verifier)
+{
+    ssize_t size = fgetxattr(dirfd, STACHE_XATTR_VERIFIER, verifier, sizeof(*verifier));
+
+    if ( size < 0 ) {
+        if ( errno == ENOTSUP )
+            errno = ENODATA;
+        return -1;
+    }
+
+    if ( size != sizeof(*verifier) || verifier->version != KEY_VERIFIER_VERSION ) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+int metadata_set_verifier(int dirfd, const struct key_verifier *verifier)
+{
+    return fsetxattr(dirfd, STACHE_XATTR_VERIFIER, verifier, sizeof(*verifier), 0);
+}
+
+//
+// The subkey is a keyed BLAKE2b of a fixed context, so that the master key
+// itself is never used for anything but the filesystem.
+//
+void key_verifier_compute(const struct ext4_encryption_key *key, const uint8_t *key_id, size_t key_id_size,
+                          struct key_verifier *verifier)
+{
+    static const char context[] = "stache key verifier v1";
+    unsigned char subkey[crypto_auth_hmacsha256_KEYBYTES];
+
+    crypto_generichash(subkey, sizeof(subkey), (const unsigned char *) context, sizeof(context) - 1,
+                       (const unsigned char *) key->raw, key->size);
+
+    memset(verifier, 0, sizeof(*verifier));
+    verifier->version = KEY_VERIFIER_VERSION;
+    crypto_auth_hmacsha256(verifier->mac, key_id, key_id_size, subkey);
+    sodium_memzero(subkey, sizeof(subkey));
+}
+
+bool key_verifier_matches(const struct ext4_encryption_key *key, const uint8_t *key_id, size_t key_id_size,
+                          const struct key_verifier *stored)
+{
+    struct key_verifier computed;
+
+    key_verifier_compute(key, key_id, key_id_size, &computed);
+    return crypto_verify_32(computed.mac, stored->mac) == 0;
+}
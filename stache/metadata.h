@@ -0,0 +1,93 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METADATA_H
+#define _METADATA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Container metadata, kept in trusted extended attributes of the container
+ * root. Those are readable without the key, and only by privileged processes.
+ */
+
+#define STACHE_XATTR_PREFIX "trusted.stache."
+#define STACHE_XATTR_KDF STACHE_XATTR_PREFIX "kdf"
+#define STACHE_XATTR_USAGE STACHE_XATTR_PREFIX "usage"
+#define STACHE_XATTR_VERIFIER STACHE_XATTR_PREFIX "verifier"
+
+#define KDF_PARAMS_VERSION 1
+#define KDF_SALT_SIZE 16
+
+// scrypt parameters of new containers.
+#define KDF_DEFAULT_LOG_N 14
+#define KDF_DEFAULT_R 8
+#define KDF_DEFAULT_P 16
+
+struct kdf_params {
+    uint8_t version;
+    uint8_t log_n;
+    uint8_t r;
+    uint8_t p;
+    uint8_t salt_size;
+    uint8_t salt[KDF_SALT_SIZE];
+} __attribute__((__packed__));
+
+#define USAGE_RECORD_VERSION 1
+
+// Disk usage of everything below the container root, maintained by stached.
+struct usage_record {
+    uint8_t version;
+    uint64_t bytes;                 // allocated on disk
+    uint64_t inodes;
+    uint64_t updated_at;            // wall clock seconds
+    uint64_t reconciled_at;         // of the last full walk, 0 if never
+} __attribute__((__packed__));
+
+#define KEY_VERIFIER_VERSION 1
+#define KEY_VERIFIER_SIZE 32
+
+// Lets attach reject a wrong passphrase before its key reaches the kernel.
+// Checking a guess against it costs a derivation, as against the key identifier.
+struct key_verifier {
+    uint8_t version;
+    uint8_t mac[KEY_VERIFIER_SIZE];     // HMAC-SHA256 of the key identifier under a subkey
+} __attribute__((__packed__));
+
+// The fixed parameters of containers created without metadata.
+void kdf_params_legacy(struct kdf_params *);
+// Default parameters with a random salt.
+void kdf_params_generate(struct kdf_params *);
+
+// Falls back to the legacy parameters when the container has none.
+int metadata_get_kdf(int dirfd, struct kdf_params *);
+int metadata_set_kdf(int dirfd, const struct kdf_params *);
+// Fails with ENODATA when the container has no usage yet.
+int metadata_get_usage(int dirfd, struct usage_record *);
+int metadata_set_usage(int dirfd, const struct usage_record *);
+// Fails with ENODATA when the container has no verifier.
+int metadata_get_verifier(int dirfd, struct key_verifier *);
+int metadata_set_verifier(int dirfd, const struct key_verifier *);
+
+void key_verifier_compute(const struct ext4_encryption_key *, const uint8_t *key_id, size_t key_id_size,
+                          struct key_verifier *);
+bool key_verifier_matches(const struct ext4_encryption_key *, const uint8_t *key_id, size_t key_id_size,
+                          const struct key_verifier *);
+
+#endif /* _METADATA_H */
@@ -0,0 +1,400 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "stache.h"
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+//
+// Migration and rekey both fill a new sibling container with a copy of a
+// directory, then swap the two and remove the original.
+//
+struct replacement {
+    const char *suffix;         // of the sibling container
+    bool source_encrypted;      // rekey replaces a container, migrate a plain directory
+    bool background;            // copy at a low I/O priority
+};
+
+static const struct replacement migration = {
+    .suffix = ".stache-migrate",
+    .source_encrypted = false,
+    .background = false,
+};
+
+static const struct replacement rekey = {
+    .suffix = ".stache-rekey",
+    .source_encrypted = true,
+    .background = true,
+};
+
+//
+// The state file records how far a replacement went, so that it can resume.
+//
+enum replace_phase {
+    REPLACE_NONE,
+    REPLACE_COPY,       // the container is being filled
+    REPLACE_SWAP,       // the copy was verified, the directories are being swapped
+};
+
+struct replace_state {
+    enum replace_phase phase;
+    unsigned long long target_ino;      // identifies the new container once swapped
+};
+
+static
+void read_state(const char *state_path, struct replace_state *state)
+{
+    char phase[16] = "";
+
+    state->phase = REPLACE_NONE;
+    state->target_ino = 0;
+
+    FILE *file = fopen(state_path, "re");
+    if ( file == NULL )
+        return;
+
+    if ( fscanf(file, "phase=%15s target=%llu", phase, &state->target_ino) < 1 )
+        phase[0] = '\0';
+    fclose(file);
+
+    state->phase = (strcmp(phase, "swap") == 0) ? REPLACE_SWAP : REPLACE_COPY;
+}
+
+static
+int write_state(const char *state_path, const struct replace_state *state)
+{
+    int fd = open(state_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if ( fd == -1 ) {
+        fprintf(stderr, "Cannot write %s: %s\n", state_path, strerror(errno));
+        return -1;
+    }
+
+    dprintf(fd, "phase=%s target=%llu\n", state->phase == REPLACE_SWAP ? "swap" : "copy", state->target_ino);
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+//
+// Returns 1 if _path_ is an encrypted directory, 0 if not, -1 on error.
+//
+static
+int is_encrypted_directory(const char *path)
+{
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
+    bool has_policy;
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = backend_get_policy(dirfd, &policy, &has_policy, &backend);
+    close(dirfd);
+    if ( ret < 0 )
+        return -1;
+
+    return has_policy ? 1 : 0;
+}
+
+//
+// The contents of a container can only be copied while its key is present.
+//
+static
+int check_key_present(const char *path)
+{
+    struct stache_policy policy;
+    const struct crypt_backend *backend;
+    enum stache_key_status status;
+    key_serial_t serial;
+    bool has_policy;
+    int ret = -1;
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 ) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if ( backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 ||
+         backend->key_status(dirfd, &policy, &status, &serial) < 0 )
+        goto out;
+
+    if ( status != KEY_STATUS_PRESENT ) {
+        fprintf(stderr, "The key of %s is not attached, attach it first.\n", path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    close(dirfd);
+    return ret;
+}
+
+//
+// Atomically swaps two directories. Kernels without renameat2() get two
+// renames through a temporary name instead.
+//
+static
+int exchange_directories(const char *a, const char *b)
+{
+#ifdef SYS_renameat2
+    if ( syscall(SYS_renameat2, AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0 )
+        return 0;
+    if ( errno != ENOSYS && errno != EINVAL ) {
+        fprintf(stderr, "Cannot exchange %s and %s: %s\n", a, b, strerror(errno));
+        return -1;
+    }
+#endif
+
+    char temp[PATH_MAX];
+    if ( (size_t) snprintf(temp, sizeof(temp), "%s.stache-swap", a) >= sizeof(temp) ) {
+        fprintf(stderr, "Cannot swap %s and %s: path is too long.\n", a, b);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fprintf(stderr, "Warning: atomic exchange unsupported, renaming %s in place.\n", a);
+    if ( rename(a, temp) < 0 || rename(b, a) < 0 || rename(temp, b) < 0 ) {
+        fprintf(stderr, "Cannot swap %s and %s: %s\n", a, b, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Sets up the sibling container, or reattaches it when resuming.
+//
+static
+int prepare_target(const char *target, enum replace_phase phase, struct ext4_crypt_options opts)
+{
+    struct stat st;
+
+    if ( stat(target, &st) < 0 ) {
+        if ( errno != ENOENT ) {
+            fprintf(stderr, "Cannot stat %s: %s\n", target, strerror(errno));
+            return -1;
+        }
+    }
+    else if ( phase == REPLACE_NONE ) {
+        fprintf(stderr, "%s already exists and is not part of a migration.\n", target);
+        return -1;
+    }
+    else {
+        int encrypted = is_encrypted_directory(target);
+        if ( encrypted < 0 )
+            return -1;
+        if ( encrypted )
+            return container_attach(target, opts);
+
+        // Interrupted before the policy was set.
+        if ( rmdir(target) < 0 ) {
+            fprintf(stderr, "Cannot remove %s: %s\n", target, strerror(errno));
+            return -1;
+        }
+    }
+
+    if ( mkdir(target, S_IRWXU) < 0 ) {
+        fprintf(stderr, "Cannot create %s: %s\n", target, strerror(errno));
+        return -1;
+    }
+
+    return container_create(target, opts);
+}
+
+//
+// Removes what is left of the original directory once swapped. A replaced
+// container also loses its key, which is only reachable before the removal.
+//
+static
+int remove_original(const char *path, const struct replacement *mode)
+{
+    struct stache_policy policy;
+    const struct crypt_backend *backend = NULL;
+    bool has_policy = false;
+    int dirfd = -1;
+
+    if ( access(path, F_OK) < 0 )
+        return 0;
+
+    if ( mode->source_encrypted ) {
+        dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ( dirfd == -1 || backend_get_policy(dirfd, &policy, &has_policy, &backend) < 0 )
+            has_policy = false;
+    }
+
+    int ret = remove_tree(path);
+    if ( ret < 0 )
+        fprintf(stderr, "Cannot remove the original copy at %s.\n", path);
+    else if ( has_policy )
+        backend->remove_key(dirfd, &policy);
+
+    if ( dirfd != -1 )
+        close(dirfd);
+    return ret;
+}
+
+//
+// Replaces the directory at _dir_path_ with a new container holding a verified
+// copy of it. Runs again from where it stopped when interrupted, as long as the
+// directory is not modified in between.
+//
+static
+int replace_directory(const char *dir_path, const struct replacement *mode, struct ext4_crypt_options opts)
+{
+    char source[PATH_MAX];
+    char target[PATH_MAX];
+    char state_path[PATH_MAX];
+    struct replace_state state;
+    struct stat st;
+    struct copy_job job = {
+        .nr_threads = COPY_THREADS,
+        .progress = stdout,
+        .rate_limit = opts.rate_limit,
+        .background = mode->background,
+    };
+
+    if ( crypto_init() == -1 )
+        return -1;
+
+    if ( realpath(dir_path, source) == NULL ) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    if ( (size_t) snprintf(target, sizeof(target), "%s%s", source, mode->suffix) >= sizeof(target) ||
+         (size_t) snprintf(state_path, sizeof(state_path), "%s%s.state", source, mode->suffix) >= sizeof(state_path) ) {
+        fprintf(stderr, "Cannot replace %s: path is too long.\n", source);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    read_state(state_path, &state);
+    if ( stat(source, &st) < 0 ) {
+        fprintf(stderr, "Cannot stat %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+
+    // Interrupted after the swap: only the original is left to remove.
+    bool swapped = (state.phase == REPLACE_SWAP && st.st_ino == state.target_ino);
+
+    if ( !swapped ) {
+        int encrypted = is_encrypted_directory(source);
+        if ( encrypted < 0 )
+            return -1;
+
+        if ( encrypted != mode->source_encrypted ) {
+            fprintf(stderr, "%s is %s.\n", source, encrypted ? "already encrypted" : "not an encrypted container");
+            return -1;
+        }
+
+        if ( mode->source_encrypted && check_key_present(source) < 0 )
+            return -1;
+    }
+
+    if ( !swapped && state.phase != REPLACE_SWAP ) {
+        if ( state.phase == REPLACE_NONE ) {
+            struct replace_state copying = { .phase = REPLACE_COPY };
+            if ( write_state(state_path, &copying) < 0 )
+                return -1;
+        }
+
+        if ( prepare_target(target, state.phase, opts) < 0 )
+            return -1;
+
+        job.source = source;
+        job.target = target;
+
+        printf("Copying %s into %s...\n", source, target);
+        if ( copy_tree(&job) < 0 ) {
+            fprintf(stderr, "Copy of %s stopped, run it again to resume.\n", source);
+            return -1;
+        }
+        copy_print_summary(&job, "Copied", stdout);
+
+        printf("Verifying...\n");
+        if ( copy_verify(&job) < 0 ) {
+            fprintf(stderr, "Copy of %s stopped, run it again to resume.\n", source);
+            return -1;
+        }
+
+        if ( stat(target, &st) < 0 )
+            return -1;
+
+        state.phase = REPLACE_SWAP;
+        state.target_ino = st.st_ino;
+        if ( write_state(state_path, &state) < 0 )
+            return -1;
+    }
+
+    if ( !swapped && exchange_directories(source, target) < 0 )
+        return -1;
+
+    // The original now lives at the sibling path.
+    if ( remove_original(target, mode) < 0 )
+        return -1;
+
+    unlink(state_path);
+    return 0;
+}
+
+//
+// Encrypts the existing directory _dir_path_. Its contents are copied into a
+// new sibling container, which takes its place once verified; the plaintext
+// is then removed. The directory must not be modified during the migration.
+//
+int container_migrate(const char *dir_path, struct ext4_crypt_options opts)
+{
+    if ( replace_directory(dir_path, &migration, opts) < 0 )
+        return -1;
+
+    printf("%s is now encrypted.\n", dir_path);
+    return 0;
+}
+
+//
+// Rotates the key of the container at _dir_path_, whose key must be attached.
+// Its contents are copied at a low I/O priority, optionally rate limited, into
+// a new container with a fresh key, descriptor and key derivation parameters,
+// which then takes its place. The old key is removed along with the old copy.
+//
+int container_rekey(const char *dir_path, struct ext4_crypt_options opts)
+{
+    // Never reuse the descriptor of the key being replaced.
+    opts.requires_descriptor = true;
+
+    if ( replace_directory(dir_path, &rekey, opts) < 0 )
+        return -1;
+
+    printf("%s is now encrypted with the new key.\n", dir_path);
+    return 0;
+}
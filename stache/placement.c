@@ -0,0 +1,372 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "stache.h"
+
+struct cpu_timing {
+    atomic_ullong count;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+    atomic_ullong migrated;
+};
+
+struct work_placement {
+    const char *name;
+    bool placed;
+    cpu_set_t cpus;
+    char cgroup[PATH_MAX];          // empty for none
+
+    struct cpu_timing per_cpu[PLACEMENT_MAX_CPUS];
+};
+
+static struct work_placement classes[NR_WORK_CLASSES] = {
+    [WORK_KDF] = { .name = "kdf" },
+    [WORK_SCAN] = { .name = "scan" },
+    [WORK_WARM] = { .name = "warm" },
+};
+
+//
+// Parses a hexadecimal mask, lowest CPU in the last digit.
+//
+static
+int parse_cpu_mask(const char *mask, size_t length, cpu_set_t *cpus)
+{
+    if ( length == 0 )
+        return -1;
+
+    for ( size_t i = 0; i < length; i++ ) {
+        char c = mask[length - 1 - i];
+        if ( !isxdigit((unsigned char) c) )
+            return -1;
+
+        unsigned value = isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+        for ( unsigned bit = 0; bit < 4; bit++ ) {
+            if ( (value & (1U << bit)) == 0 )
+                continue;
+            if ( i * 4 + bit >= PLACEMENT_MAX_CPUS )
+                return -1;
+            CPU_SET(i * 4 + bit, cpus);
+        }
+    }
+
+    return 0;
+}
+
+//
+// Parses a list of CPUs and ranges of CPUs, as in /sys/devices/system/cpu/online.
+//
+static
+int parse_cpu_list(const char *list, size_t length, cpu_set_t *cpus)
+{
+    const char *p = list, *end = list + length;
+
+    while ( p < end ) {
+        char *next;
+        unsigned long first = strtoul(p, &next, 10), last = first;
+
+        if ( next == p || !isdigit((unsigned char) *p) )
+            return -1;
+        if ( next < end && *next == '-' ) {
+            p = next + 1;
+            last = strtoul(p, &next, 10);
+            if ( next == p || !isdigit((unsigned char) *p) || last < first )
+                return -1;
+        }
+        if ( last >= PLACEMENT_MAX_CPUS || next > end )
+            return -1;
+
+        for ( unsigned long cpu = first; cpu <= last; cpu++ )
+            CPU_SET(cpu, cpus);
+
+        if ( next == end )
+            break;
+        if ( *next != ',' )
+            return -1;
+        p = next + 1;
+    }
+
+    return 0;
+}
+
+static
+int parse_cpus(const char *spec, size_t length, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    if ( length > 2 && spec[0] == '0' && (spec[1] == 'x' || spec[1] == 'X') )
+        return parse_cpu_mask(spec + 2, length - 2, cpus);
+
+    return parse_cpu_list(spec, length, cpus);
+}
+
+static
+void format_cpus(const cpu_set_t *cpus, char *buf, size_t size)
+{
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for ( int cpu = 0; cpu < PLACEMENT_MAX_CPUS && used < size; cpu++ ) {
+        if ( !CPU_ISSET(cpu, cpus) || (cpu > 0 && CPU_ISSET(cpu - 1, cpus)) )
+            continue;
+
+        int last = cpu;
+        while ( last + 1 < PLACEMENT_MAX_CPUS && CPU_ISSET(last + 1, cpus) )
+            last++;
+
+        if ( last == cpu )
+            used += snprintf(buf + used, size - used, "%s%d", used ? "," : "", cpu);
+        else
+            used += snprintf(buf + used, size - used, "%s%d-%d", used ? "," : "", cpu, last);
+    }
+}
+
+static
+int parse_entry(const char *entry, size_t length)
+{
+    const char *equal = memchr(entry, '=', length);
+    if ( equal == NULL )
+        return -1;
+
+    struct work_placement *class = NULL;
+    for ( int id = 0; id < NR_WORK_CLASSES; id++ ) {
+        if ( strlen(classes[id].name) == (size_t) (equal - entry) &&
+             strncmp(classes[id].name, entry, equal - entry) == 0 )
+            class = &classes[id];
+    }
+    if ( class == NULL ) {
+        fprintf(stderr, "Unknown work class in %.*s: must be kdf, scan or warm\n", (int) length, entry);
+        return -1;
+    }
+
+    const char *cpus = equal + 1;
+    const char *at = memchr(cpus, '@', entry + length - cpus);
+    size_t cpus_length = (at != NULL ? at : entry + length) - cpus;
+
+    if ( parse_cpus(cpus, cpus_length, &class->cpus) < 0 || CPU_COUNT(&class->cpus) == 0 ) {
+        fprintf(stderr, "Invalid CPUs for %s: %.*s\n", class->name, (int) cpus_length, cpus);
+        return -1;
+    }
+
+    // Checked now rather than failing on every thread later.
+    cpu_set_t allowed;
+    if ( sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ) {
+        CPU_AND(&allowed, &allowed, &class->cpus);
+        if ( CPU_COUNT(&allowed) == 0 ) {
+            fprintf(stderr, "None of the CPUs for %s is available: %.*s\n", class->name, (int) cpus_length, cpus);
+            return -1;
+        }
+    }
+
+    if ( at != NULL ) {
+        size_t cgroup_length = entry + length - (at + 1);
+
+        // Request threads would need to find their way back out of it.
+        if ( class == &classes[WORK_KDF] ) {
+            fprintf(stderr, "Work of class kdf runs on request threads: it takes no cgroup\n");
+            return -1;
+        }
+        if ( cgroup_length == 0 || cgroup_length >= sizeof(class->cgroup) ) {
+            fprintf(stderr, "Invalid cgroup for %s\n", class->name);
+            return -1;
+        }
+        memcpy(class->cgroup, at + 1, cgroup_length);
+        class->cgroup[cgroup_length] = '\0';
+    }
+
+    class->placed = true;
+    return 0;
+}
+
+int placement_configure(const char *spec)
+{
+    const char *p = spec;
+
+    while ( *p != '\0' ) {
+        size_t length = strcspn(p, ";");
+
+        if ( length > 0 && parse_entry(p, length) < 0 ) {
+            fprintf(stderr, "Invalid CPU placement: %s\n", spec);
+            return -1;
+        }
+
+        p += length;
+        if ( *p == ';' )
+            p++;
+    }
+
+    return 0;
+}
+
+const char *work_class_name(enum work_class id)
+{
+    return (id < NR_WORK_CLASSES) ? classes[id].name : "unknown";
+}
+
+unsigned placement_width(enum work_class id)
+{
+    cpu_set_t allowed;
+
+    if ( sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return (cpus > 0) ? cpus : 1;
+    }
+
+    if ( classes[id].placed )
+        CPU_AND(&allowed, &allowed, &classes[id].cpus);
+
+    return (CPU_COUNT(&allowed) > 0) ? CPU_COUNT(&allowed) : 1;
+}
+
+//
+// Moves the calling thread into _cgroup_: cgroup v2 takes threads in
+// cgroup.threads, v1 hierarchies such as the Android cpusets in tasks.
+//
+static
+int join_cgroup(const char *cgroup)
+{
+    char path[PATH_MAX];
+    char tid[16];
+
+    snprintf(path, sizeof(path), "%s/cgroup.threads", cgroup);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        snprintf(path, sizeof(path), "%s/tasks", cgroup);
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+    }
+    if ( fd == -1 )
+        return -1;
+
+    int length = snprintf(tid, sizeof(tid), "%ld", (long) syscall(SYS_gettid));
+    int ret = (write(fd, tid, length) == length) ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+int placement_apply(enum work_class id)
+{
+    struct work_placement *class = &classes[id];
+
+    if ( !class->placed )
+        return 0;
+
+    if ( class->cgroup[0] != '\0' && join_cgroup(class->cgroup) < 0 ) {
+        fprintf(stderr, "Cannot move %s work into %s: %s\n", class->name, class->cgroup, strerror(errno));
+        return -1;
+    }
+
+    // After the cgroup: a cpuset resets the affinity of the threads joining it.
+    if ( sched_setaffinity(0, sizeof(class->cpus), &class->cpus) < 0 ) {
+        fprintf(stderr, "Cannot place %s work: %s\n", class->name, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void placement_enter(enum work_class id, struct placement_token *token)
+{
+    struct work_placement *class = &classes[id];
+
+    token->placed = false;
+    if ( class->placed && sched_getaffinity(0, sizeof(token->saved), &token->saved) == 0 ) {
+        token->placed = (sched_setaffinity(0, sizeof(class->cpus), &class->cpus) == 0);
+        if ( !token->placed )
+            fprintf(stderr, "Cannot place %s work: %s\n", class->name, strerror(errno));
+    }
+
+    // Read once placed: the new affinity takes effect before the call returns.
+    token->cpu = sched_getcpu();
+    token->started_ns = stats_now();
+}
+
+void placement_leave(enum work_class id, struct placement_token *token)
+{
+    struct work_placement *class = &classes[id];
+    uint64_t elapsed_ns = stats_now() - token->started_ns;
+    int cpu = sched_getcpu();
+
+    if ( token->placed )
+        sched_setaffinity(0, sizeof(token->saved), &token->saved);
+
+    if ( token->cpu < 0 || token->cpu >= PLACEMENT_MAX_CPUS )
+        return;
+
+    struct cpu_timing *stats = &class->per_cpu[token->cpu];
+    atomic_fetch_add(&stats->count, 1);
+    atomic_fetch_add(&stats->total_ns, elapsed_ns);
+    if ( cpu != token->cpu )
+        atomic_fetch_add(&stats->migrated, 1);
+
+    unsigned long long max_ns = atomic_load(&stats->max_ns);
+    while ( elapsed_ns > max_ns && !atomic_compare_exchange_weak(&stats->max_ns, &max_ns, elapsed_ns) )
+        ;
+}
+
+void placement_get_cpu_stats(enum work_class id, unsigned cpu, struct placement_cpu_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if ( cpu >= PLACEMENT_MAX_CPUS )
+        return;
+
+    stats->count = atomic_load(&classes[id].per_cpu[cpu].count);
+    stats->total_ns = atomic_load(&classes[id].per_cpu[cpu].total_ns);
+    stats->max_ns = atomic_load(&classes[id].per_cpu[cpu].max_ns);
+    stats->migrated = atomic_load(&classes[id].per_cpu[cpu].migrated);
+}
+
+void placement_print(FILE *out)
+{
+    fprintf(out, "%-12s %-16s %s\n", "class", "cpus", "cgroup");
+    for ( int id = 0; id < NR_WORK_CLASSES; id++ ) {
+        char cpus[128] = "all";
+
+        if ( classes[id].placed )
+            format_cpus(&classes[id].cpus, cpus, sizeof(cpus));
+        fprintf(out, "%-12s %-16s %s\n", classes[id].name, cpus,
+                classes[id].cgroup[0] != '\0' ? classes[id].cgroup : "-");
+    }
+
+    bool header = false;
+    for ( int id = 0; id < NR_WORK_CLASSES; id++ ) {
+        for ( unsigned cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++ ) {
+            struct placement_cpu_stats stats;
+
+            placement_get_cpu_stats(id, cpu, &stats);
+            if ( stats.count == 0 )
+                continue;
+
+            if ( !header ) {
+                fprintf(out, "\n%-12s %6s %10s %10s %10s %10s\n",
+                        "class", "cpu", "count", "mean(ms)", "max(ms)", "migrated");
+                header = true;
+            }
+            fprintf(out, "%-12s %6u %10llu %10.1f %10.1f %10llu\n", classes[id].name, cpu,
+                    (unsigned long long) stats.count, stats.total_ns / 1e6 / stats.count,
+                    stats.max_ns / 1e6, (unsigned long long) stats.migrated);
+        }
+    }
+}
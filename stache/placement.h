@@ -0,0 +1,78 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+
+/*
+ * CPU placement of daemon work by class.
+ *
+ * A class of work may be confined to a set of CPUs, given as a list ("4-7",
+ * "0,2-3") or as a hexadecimal mask ("0xf0"). This way, on heterogeneous CPUs,
+ * derivations go to the fast cores and background scans go to the efficient
+ * ones. Threads dedicated to a class may also join a cgroup, such as an
+ * Android cpuset. Derivations run on request threads, so they only borrow the
+ * CPUs of their class. Work is timed on the CPU it started on, whether or not
+ * its class is placed.
+ */
+
+#define PLACEMENT_MAX_CPUS 256
+
+enum work_class {
+    WORK_KDF,                       // passphrase derivations, on request threads
+    WORK_SCAN,                      // usage tracking and reconciliation
+    WORK_WARM,                      // cache warm-up after attach
+    NR_WORK_CLASSES,
+};
+
+// Saved placement of a thread borrowing the CPUs of a class.
+struct placement_token {
+    cpu_set_t saved;
+    bool placed;
+    int cpu;                        // where the work started, -1 if unknown
+    uint64_t started_ns;
+};
+
+struct placement_cpu_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t migrated;              // work which ended on another CPU
+};
+
+// Parses _spec_, made of "<class>=<cpus>[@<cgroup directory>]" entries
+// separated by ';', e.g. "kdf=4-7;scan=0-3@/dev/cpuset/background".
+int placement_configure(const char *spec);
+const char *work_class_name(enum work_class);
+// Number of CPUs work of _class_ may run on.
+unsigned placement_width(enum work_class);
+
+// Moves the calling thread, for the rest of its life, to the CPUs and cgroup of _class_.
+int placement_apply(enum work_class);
+// Runs the calling thread on the CPUs of _class_ until placement_leave(), and times it.
+void placement_enter(enum work_class, struct placement_token *);
+void placement_leave(enum work_class, struct placement_token *);
+
+void placement_get_cpu_stats(enum work_class, unsigned cpu, struct placement_cpu_stats *);
+void placement_print(FILE *out);
+
+#endif /* _PLACEMENT_H */
@@ -0,0 +1,106 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACHE_PROTOCOL_H
+#define _STACHE_PROTOCOL_H
+
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * Wire format of the stached control socket.
+ *
+ * A request is a single SOCK_SEQPACKET message made of a struct stache_request,
+ * optionally followed by _secret_size_ bytes of secret. A file descriptor may be
+ * passed alongside with SCM_RIGHTS. The daemon answers with one struct
+ * stache_response, truncated to the length of its message.
+ *
+ * Only root and system may change containers; other callers may query them.
+ * Either way, a path must resolve to a directory below STACHE_DATA_DIR. The
+ * daemon serves a bounded number of connections, closing new ones at the limit;
+ * a few are kept for root and system.
+ *
+ * Work for a request whose deadline has passed, or whose client has hung up,
+ * is dropped before it starts or abandoned between stages: the request then
+ * fails with ETIMEDOUT or ECANCELED.
+ *
+ * A new daemon takes over from the running one with STACHE_OP_HANDOVER: the
+ * connection then carries handover messages instead of a response. Clients
+ * keep their connection and only see a slower request.
+ */
+
+#define STACHE_SOCKET "/data/misc/stache/stache_socket"
+#define STACHE_PROTOCOL_VERSION 2
+
+enum stache_op {
+    STACHE_OP_STATUS = 1,
+    STACHE_OP_CREATE,
+    STACHE_OP_ATTACH,
+    STACHE_OP_DETACH,
+    STACHE_OP_MIGRATE,
+    STACHE_OP_REKEY,
+    STACHE_OP_STATS,        /* into the passed descriptor if any, else EMSGSIZE if it does not fit */
+    STACHE_OP_TRACE,
+    STACHE_OP_RECORD,       /* starts recording into the passed descriptor, or stops */
+    STACHE_OP_USAGE,
+    STACHE_OP_HANDOVER,     /* sent by a successor daemon, see handover.h */
+};
+
+/* Secret is appended to the request message */
+#define STACHE_REQ_SECRET_INLINE    0x01
+/* Secret is read from the file descriptor passed with the request */
+#define STACHE_REQ_SECRET_FD        0x02
+/* Secret is derived key material rather than a passphrase (trusted callers only) */
+#define STACHE_REQ_SECRET_RAW_KEY   0x04
+/* key_descriptor is set */
+#define STACHE_REQ_KEY_DESCRIPTOR   0x08
+/* Warm up the container caches in the background after attach */
+#define STACHE_REQ_WARM             0x10
+/* Drop the container from the page cache on detach */
+#define STACHE_REQ_EVICT            0x20
+/* The passed file descriptor receives the output of the request */
+#define STACHE_REQ_OUTPUT_FD        0x40
+
+#define STACHE_CIPHER_NAME_SZ 32
+#define STACHE_MAX_SECRET_SZ EXT4_MAX_PASSPHRASE_SZ
+#define STACHE_MAX_MESSAGE_SZ 4096
+
+struct stache_request {
+    uint32_t version;
+    uint32_t op;
+    uint32_t flags;
+    uint32_t filename_padding;
+    uint32_t policy_version;
+    char contents_cipher[STACHE_CIPHER_NAME_SZ];
+    char filename_cipher[STACHE_CIPHER_NAME_SZ];
+    char key_descriptor[EXT4_KEY_DESCRIPTOR_SIZE];
+    uint32_t secret_size;
+    uint32_t rate_limit;            /* MiB/s of rekey copies, 0 for unlimited */
+    uint64_t deadline_ns;           /* CLOCK_MONOTONIC time past which the result is useless, 0 for none */
+    char path[PATH_MAX];
+} __attribute__((__packed__));
+
+struct stache_response {
+    int32_t status;
+    int32_t error;
+    uint32_t message_size;
+    char message[STACHE_MAX_MESSAGE_SZ];
+} __attribute__((__packed__));
+
+#define STACHE_RESPONSE_HEADER_SZ (sizeof(struct stache_response) - STACHE_MAX_MESSAGE_SZ)
+
+#endif /* _STACHE_PROTOCOL_H */
@@ -0,0 +1,260 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sodium.h>
+#include "stache.h"
+
+//
+// One block of the ring. Its sequence number tells whose turn it is: equal to
+// the ring position when the block is free for the producer, to the position
+// plus one once it is filled and can be claimed by a consumer.
+//
+struct pool_slot {
+    atomic_size_t sequence;
+    unsigned char bytes[RANDOM_POOL_BLOCK];
+};
+
+static struct pool_slot slots[RANDOM_POOL_SLOTS];
+static atomic_size_t head;                  // next block to claim
+static atomic_size_t tail;                  // next block to fill
+static atomic_bool running;
+static atomic_bool refill_pending;
+static int wake_fd = -1;
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ullong blocks_served;
+static atomic_ullong blocks_refilled;
+static atomic_ullong fallbacks;
+
+//
+// Fills the run of free blocks at the tail, at most one batch of them, with a
+// single call into the generator. Returns the number of blocks filled.
+// The caller holds fill_lock, which keeps a single producer on the ring.
+//
+static
+size_t pool_fill_batch()
+{
+    static unsigned char batch[RANDOM_POOL_BATCH * RANDOM_POOL_BLOCK];
+    size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    size_t nr_free = 0;
+
+    // Blocks free up in ring order: the run of free blocks ends at the first busy one.
+    while ( nr_free < RANDOM_POOL_BATCH &&
+            atomic_load_explicit(&slots[(pos + nr_free) & (RANDOM_POOL_SLOTS - 1)].sequence,
+                                 memory_order_acquire) == pos + nr_free )
+        nr_free++;
+    if ( nr_free == 0 )
+        return 0;
+
+    randombytes_buf(batch, nr_free * RANDOM_POOL_BLOCK);
+    for ( size_t i = 0; i < nr_free; i++, pos++ ) {
+        struct pool_slot *slot = &slots[pos & (RANDOM_POOL_SLOTS - 1)];
+
+        memcpy(slot->bytes, batch + i * RANDOM_POOL_BLOCK, RANDOM_POOL_BLOCK);
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+        atomic_store_explicit(&tail, pos + 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&blocks_refilled, nr_free, memory_order_relaxed);
+    sodium_memzero(batch, nr_free * RANDOM_POOL_BLOCK);
+
+    return nr_free;
+}
+
+//
+// Fills every free block, a batch at a time so that a consumer helping out
+// never waits long for the lock.
+//
+static
+void pool_fill()
+{
+    size_t filled;
+
+    do {
+        pthread_mutex_lock(&fill_lock);
+        filled = pool_fill_batch();
+        pthread_mutex_unlock(&fill_lock);
+    } while ( filled > 0 );
+}
+
+//
+// Claims one block of the pool into _block_.
+// Returns false if the pool is empty.
+//
+static
+bool pool_pop(unsigned char *block)
+{
+    struct pool_slot *slot;
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+    for ( ;; ) {
+        slot = &slots[pos & (RANDOM_POOL_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+        if ( diff == 0 ) {
+            if ( atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                       memory_order_relaxed, memory_order_relaxed) )
+                break;
+        }
+        else if ( diff < 0 )
+            return false;
+        else
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+
+    memcpy(block, slot->bytes, RANDOM_POOL_BLOCK);
+    atomic_store_explicit(&slot->sequence, pos + RANDOM_POOL_SLOTS, memory_order_release);
+    atomic_fetch_add_explicit(&blocks_served, 1, memory_order_relaxed);
+
+    // Only the first consumer under the low water mark pays for the wakeup.
+    size_t level = atomic_load_explicit(&tail, memory_order_relaxed) - (pos + 1);
+    if ( level < RANDOM_POOL_LOW_WATER && !atomic_exchange(&refill_pending, true) ) {
+        uint64_t value = 1;
+        write(wake_fd, &value, sizeof(value));
+    }
+
+    return true;
+}
+
+//
+// Claims one block, filling a batch first if the pool ran dry under a burst
+// faster than the refill thread. If the refill thread is filling at that
+// moment, waits for its batch to land: at most one call into the generator,
+// no longer than falling back would take.
+//
+static
+bool pool_take(unsigned char *block)
+{
+    if ( pool_pop(block) )
+        return true;
+    pthread_mutex_lock(&fill_lock);
+    pool_fill_batch();
+    pthread_mutex_unlock(&fill_lock);
+
+    return pool_pop(block);
+}
+
+static
+void *refill_thread(void UNUSED *arg)
+{
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+    uint64_t value;
+
+    for ( ;; ) {
+        atomic_store(&refill_pending, false);
+        pool_fill();
+
+        if ( poll(&pfd, 1, RANDOM_POOL_REFILL_MS) > 0 )
+            read(wake_fd, &value, sizeof(value));
+    }
+
+    return NULL;
+}
+
+int random_pool_start()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if ( atomic_load(&running) )
+        return 0;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( wake_fd == -1 ) {
+        fprintf(stderr, "Cannot set up the random pool: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for ( size_t i = 0; i < RANDOM_POOL_SLOTS; i++ )
+        atomic_init(&slots[i].sequence, i);
+    pool_fill();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, refill_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if ( err != 0 ) {
+        fprintf(stderr, "Cannot start the random pool: %s\n", strerror(err));
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    atomic_store(&running, true);
+    return 0;
+}
+
+void random_pool_bytes(void *buf, size_t size)
+{
+    unsigned char block[RANDOM_POOL_BLOCK];
+    unsigned char *out = buf;
+
+    while ( size > 0 ) {
+        if ( !atomic_load_explicit(&running, memory_order_acquire) || !pool_take(block) ) {
+            atomic_fetch_add_explicit(&fallbacks, 1, memory_order_relaxed);
+            randombytes_buf(out, size);
+            break;
+        }
+
+        size_t chunk = size < RANDOM_POOL_BLOCK ? size : RANDOM_POOL_BLOCK;
+        memcpy(out, block, chunk);
+        out += chunk;
+        size -= chunk;
+    }
+
+    sodium_memzero(block, sizeof(block));
+}
+
+//
+// Rejection sampling: bytes from the incomplete last multiple of _bound_ are
+// dropped, since a plain modulo would favor the low values.
+//
+void random_pool_uniform(unsigned char *out, size_t count, unsigned bound)
+{
+    unsigned char block[RANDOM_POOL_BLOCK];
+    unsigned limit = 256 - 256 % bound;
+    size_t used = RANDOM_POOL_BLOCK;
+
+    for ( size_t i = 0; i < count; ) {
+        if ( used == RANDOM_POOL_BLOCK ) {
+            random_pool_bytes(block, sizeof(block));
+            used = 0;
+        }
+
+        unsigned char value = block[used++];
+        if ( value < limit )
+            out[i++] = value % bound;
+    }
+
+    sodium_memzero(block, sizeof(block));
+}
+
+void random_pool_get_stats(struct random_pool_stats *stats)
+{
+    stats->blocks_served = atomic_load(&blocks_served);
+    stats->blocks_refilled = atomic_load(&blocks_refilled);
+    stats->fallbacks = atomic_load(&fallbacks);
+}
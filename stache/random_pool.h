@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RANDOM_POOL_H
+#define _RANDOM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of CSPRNG output for key descriptors, salts and scratch names.
+ *
+ * A background thread keeps a ring of blocks filled from randombytes_buf(),
+ * so that taking randomness is a copy out of memory rather than a call into
+ * the generator. It refills in batches, so that one call into the generator
+ * (a system call with the default one) serves many blocks, and starts as soon
+ * as a quarter of the ring is used, well before it runs dry. Claiming a block
+ * takes one compare-and-swap; producers take a lock for each batch, so that a
+ * consumer finding the ring empty under a burst fills the next batch itself
+ * instead of each request going to the generator. When the pool is not
+ * running, requests are served by randombytes_buf() directly.
+ *
+ * The bytes sit in ordinary memory until used: never use the pool for key
+ * material, which must come from randombytes_buf() into secure memory.
+ */
+
+#define RANDOM_POOL_BLOCK 32
+#define RANDOM_POOL_SLOTS 4096              // power of two: 128 KiB, a burst of provisioning
+#define RANDOM_POOL_LOW_WATER (RANDOM_POOL_SLOTS * 3 / 4)
+#define RANDOM_POOL_BATCH 128               // blocks per call into the generator
+#define RANDOM_POOL_REFILL_MS 1000
+
+struct random_pool_stats {
+    uint64_t blocks_served;
+    uint64_t blocks_refilled;
+    uint64_t fallbacks;                     // requests the pool could not serve
+};
+
+// Fills the pool and starts the thread refilling it.
+int random_pool_start();
+// Fills _buf_ with _size_ random bytes.
+void random_pool_bytes(void *buf, size_t size);
+// Fills _out_ with _count_ values uniformly distributed in [0, _bound_), with 0 < _bound_ <= 256.
+void random_pool_uniform(unsigned char *out, size_t count, unsigned bound);
+void random_pool_get_stats(struct random_pool_stats *);
+
+#endif /* _RANDOM_POOL_H */
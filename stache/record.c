@@ -0,0 +1,143 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "stache.h"
+#include "record.h"
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int record_fd = -1;
+static uint64_t record_started_ns;
+
+int record_start(int fd)
+{
+    struct record_file_header header;
+    struct timespec realtime;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.realtime_ns = (uint64_t) realtime.tv_sec * 1000000000ULL + realtime.tv_nsec;
+
+    if ( write(fd, &header, sizeof(header)) != sizeof(header) ) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&record_lock);
+    if ( record_fd != -1 )
+        close(record_fd);
+    record_fd = fd;
+    record_started_ns = stats_now();
+    pthread_mutex_unlock(&record_lock);
+    return 0;
+}
+
+void record_stop()
+{
+    pthread_mutex_lock(&record_lock);
+    if ( record_fd != -1 ) {
+        close(record_fd);
+        record_fd = -1;
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+void record_request(uint32_t connection, const struct stache_request *req)
+{
+    struct record_entry entry;
+
+    // Unlocked peek: recording is off almost all the time.
+    if ( atomic_load_explicit(&record_fd, memory_order_relaxed) == -1 )
+        return;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.connection = connection;
+    entry.op = req->op;
+    entry.flags = req->flags;
+    entry.filename_padding = req->filename_padding;
+    entry.policy_version = req->policy_version;
+    entry.secret_size = (req->flags & STACHE_REQ_SECRET_INLINE) ? req->secret_size : 0;
+    entry.rate_limit = req->rate_limit;
+    if ( req->deadline_ns != 0 ) {
+        uint64_t now = stats_now();
+        // Already expired on arrival is kept apart from no deadline at all.
+        entry.timeout_ms = (req->deadline_ns > now) ? (req->deadline_ns - now + 999999) / 1000000 : 1;
+    }
+    memcpy(entry.key_descriptor, req->key_descriptor, sizeof(entry.key_descriptor));
+    entry.contents_cipher_size = strnlen(req->contents_cipher, sizeof(req->contents_cipher));
+    entry.filename_cipher_size = strnlen(req->filename_cipher, sizeof(req->filename_cipher));
+    entry.path_size = strnlen(req->path, sizeof(req->path));
+
+    struct iovec iov[4] = {
+        { .iov_base = &entry, .iov_len = sizeof(entry) },
+        { .iov_base = (void *) req->contents_cipher, .iov_len = entry.contents_cipher_size },
+        { .iov_base = (void *) req->filename_cipher, .iov_len = entry.filename_cipher_size },
+        { .iov_base = (void *) req->path, .iov_len = entry.path_size },
+    };
+
+    pthread_mutex_lock(&record_lock);
+    if ( record_fd != -1 ) {
+        entry.offset_ns = stats_now() - record_started_ns;
+        // A single writev keeps records whole.
+        if ( writev(record_fd, iov, 4) < 0 ) {
+            trace_record(TRACE_ERROR, TRACE_ERR_RECORD, 0, errno, 0);
+            close(record_fd);
+            record_fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+int record_read(FILE *file, struct record_entry *entry, struct stache_request *req)
+{
+    size_t n = fread(entry, 1, sizeof(*entry), file);
+    if ( n == 0 && feof(file) )
+        return 0;
+    if ( n != sizeof(*entry) )
+        return -1;
+
+    if ( entry->contents_cipher_size >= sizeof(req->contents_cipher) ||
+         entry->filename_cipher_size >= sizeof(req->filename_cipher) ||
+         entry->path_size >= sizeof(req->path) )
+        return -1;
+
+    memset(req, 0, sizeof(*req));
+    req->version = STACHE_PROTOCOL_VERSION;
+    req->op = entry->op;
+    req->flags = entry->flags;
+    req->filename_padding = entry->filename_padding;
+    req->policy_version = entry->policy_version;
+    req->secret_size = entry->secret_size;
+    req->rate_limit = entry->rate_limit;
+    memcpy(req->key_descriptor, entry->key_descriptor, sizeof(req->key_descriptor));
+
+    if ( fread(req->contents_cipher, 1, entry->contents_cipher_size, file) != entry->contents_cipher_size ||
+         fread(req->filename_cipher, 1, entry->filename_cipher_size, file) != entry->filename_cipher_size ||
+         fread(req->path, 1, entry->path_size, file) != entry->path_size )
+        return -1;
+
+    return 1;
+}
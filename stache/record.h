@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Request stream recording, for replay by stache_replay.
+ *
+ * A recording holds a header followed by one record per request: when it
+ * arrived, on which connection, and every field of the request except the
+ * secret, of which only the size is kept.
+ */
+
+#define RECORD_MAGIC "STREC002"
+
+struct record_file_header {
+    char magic[8];
+    uint64_t realtime_ns;           // wall clock when the recording started
+} __attribute__((__packed__));
+
+struct record_entry {
+    uint64_t offset_ns;             // since the start of the recording
+    uint32_t connection;
+    uint32_t op;
+    uint32_t flags;
+    uint32_t filename_padding;
+    uint32_t policy_version;
+    uint32_t secret_size;
+    uint32_t rate_limit;
+    uint32_t timeout_ms;            // from arrival to the deadline, 0 for none
+    char key_descriptor[EXT4_KEY_DESCRIPTOR_SIZE];
+    uint8_t contents_cipher_size;
+    uint8_t filename_cipher_size;
+    uint16_t path_size;
+    // followed by the contents cipher, filename cipher and path, unterminated
+} __attribute__((__packed__));
+
+// Starts recording into _fd_, which is then owned by the recorder.
+int record_start(int fd);
+void record_stop();
+void record_request(uint32_t connection, const struct stache_request *req);
+
+// Reads the next record of a recording into _req_, without secret nor deadline.
+// Returns 1 on success, 0 at the end, -1 on a malformed recording.
+int record_read(FILE *file, struct record_entry *entry, struct stache_request *req);
+
+#endif /* _RECORD_H */
@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sodium.h>
+
+#include "stache.h"
+
+_Static_assert(EXT4_MAX_PASSPHRASE_SZ <= SECMEM_SLOT_SIZE, "passphrase does not fit in a secure slot");
+_Static_assert(sizeof(struct ext4_encryption_key) <= SECMEM_SLOT_SIZE, "key does not fit in a secure slot");
+
+static pthread_mutex_t secmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *arena = NULL;
+static uint16_t free_slots[SECMEM_NR_SLOTS];
+static unsigned nr_free_slots = 0;
+static bool slot_in_use[SECMEM_NR_SLOTS];
+
+//
+// Allocates the secure arena.
+// sodium_malloc() places guard pages around the region and locks it in memory,
+// so the cost of mlock and page faults is paid once, not on every request.
+//
+int secmem_init()
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&secmem_lock);
+    if ( arena != NULL )
+        goto out;
+
+    arena = sodium_malloc(SECMEM_NR_SLOTS * SECMEM_SLOT_SIZE);
+    if ( arena == NULL ) {
+        fprintf(stderr, "Cannot allocate secure memory arena.\n");
+        ret = -1;
+        goto out;
+    }
+
+    sodium_memzero(arena, SECMEM_NR_SLOTS * SECMEM_SLOT_SIZE);
+    for ( unsigned i = 0; i < SECMEM_NR_SLOTS; i++ ) {
+        free_slots[i] = SECMEM_NR_SLOTS - 1 - i;
+        slot_in_use[i] = false;
+    }
+    nr_free_slots = SECMEM_NR_SLOTS;
+
+out:
+    pthread_mutex_unlock(&secmem_lock);
+    return ret;
+}
+
+//
+// Returns a zeroed slot of SECMEM_SLOT_SIZE bytes, or NULL if the arena is exhausted.
+//
+void *secmem_alloc()
+{
+    void *slot = NULL;
+
+    pthread_mutex_lock(&secmem_lock);
+    if ( arena != NULL && nr_free_slots > 0 ) {
+        uint16_t index = free_slots[--nr_free_slots];
+
+        slot_in_use[index] = true;
+        slot = arena + (size_t) index * SECMEM_SLOT_SIZE;
+    }
+    pthread_mutex_unlock(&secmem_lock);
+
+    if ( slot == NULL )
+        fprintf(stderr, "Cannot allocate secure memory: arena exhausted.\n");
+
+    return slot;
+}
+
+//
+// Wipes a slot and hands it back to the arena. NULL is ignored.
+//
+void secmem_free(void *slot)
+{
+    if ( slot == NULL )
+        return;
+
+    size_t offset = (unsigned char *) slot - arena;
+    size_t index = offset / SECMEM_SLOT_SIZE;
+
+    if ( arena == NULL || (unsigned char *) slot < arena ||
+         index >= SECMEM_NR_SLOTS || offset % SECMEM_SLOT_SIZE != 0 ) {
+        fprintf(stderr, "Invalid secure memory slot %p.\n", slot);
+        abort();
+    }
+
+    sodium_memzero(slot, SECMEM_SLOT_SIZE);
+
+    pthread_mutex_lock(&secmem_lock);
+    if ( !slot_in_use[index] ) {
+        pthread_mutex_unlock(&secmem_lock);
+        fprintf(stderr, "Double free of secure memory slot %zu.\n", index);
+        abort();
+    }
+
+    slot_in_use[index] = false;
+    free_slots[nr_free_slots++] = index;
+    pthread_mutex_unlock(&secmem_lock);
+}
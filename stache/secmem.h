@@ -0,0 +1,33 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SECMEM_H
+#define _SECMEM_H
+
+/*
+ * Fixed-size slots for secret material (passphrases, raw keys), carved out
+ * of a single guarded and locked libsodium allocation.
+ */
+
+#define SECMEM_SLOT_SIZE 256
+#define SECMEM_NR_SLOTS 160                 // 4 per stached connection, and spare
+
+int secmem_init();
+void *secmem_alloc();
+void secmem_free(void *);
+
+#endif /* _SECMEM_H */
@@ -37,28 +37,72 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-
 #include "stache.h"
+#include "protocol.h"
+#include "client.h"
+#include "record.h"
 #include <cutils/log.h>
 #include <private/android_filesystem_config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #define LOG_TAG "STACHE"
 
+// Connections served at once, each on its own thread. The last few are kept
+// for root and system, so that idle clients cannot lock them out.
+#define MAX_CONNECTIONS 32
+#define RESERVED_CONNECTIONS 8
+
+// Each connection may be unlocking a container at once: its secret, the
+// master key and the argument handed to the kernel each take a slot.
+_Static_assert(MAX_CONNECTIONS * 4 <= SECMEM_NR_SLOTS, "secure arena too small for the connection limit");
+
+// Where the handover state goes when memfd_create() is not available.
+#define HANDOVER_STATE_DIR "/data/misc/stache"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
 static int listen_fd = -1;
+static uint32_t next_connection_id;
 static struct sockaddr_un addr;
+static bool usage_resumed;
+
+// Handover to a successor daemon. The drain descriptor becomes readable for
+// good when it starts; the lock guards the rest and messages on the channel.
+static int drain_fd = -1;
+static int handover_channel = -1;
+static pthread_mutex_t handover_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handover_changed = PTHREAD_COND_INITIALIZER;
+static unsigned nr_connections;
+static bool accepting;
+static bool state_sent;
 
-#define STACHE_SOCKET "/data/misc/stache/stache_socket"
+struct client_connection {
+    int fd;
+    uint32_t id;
+    uint64_t accepted_ns;
+};
 
 static
 void usage(const char *program)
 {
     fprintf(stderr, "Usage: %s [options] <command> [args...]\n", program);
-    fprintf(stderr, "Helper tool to use ext4 encrypted directories.\n");
+    fprintf(stderr, "Helper tool to use ext4 and f2fs encrypted directories.\n");
+    fprintf(stderr, "Without arguments, runs as the stache daemon.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Getting container information\n");
     fprintf(stderr, "  %s status <directory>\n", program);
@@ -72,9 +116,48 @@ void usage(const char *program)
     fprintf(stderr, "Detaching from an encrypted container:\n");
     fprintf(stderr, "  %s detach <directory>\n", program);
     fprintf(stderr, "\n");
+    fprintf(stderr, "Encrypting an existing directory in place (resumes when interrupted):\n");
+    fprintf(stderr, "  %s migrate <directory>\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Rotating the key of an attached container (resumes when interrupted):\n");
+    fprintf(stderr, "  %s rekey <directory>\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Showing the disk usage of a container, as tracked by the running daemon:\n");
+    fprintf(stderr, "  %s usage <directory>\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Showing the latency statistics of the running daemon:\n");
+    fprintf(stderr, "  %s stats\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Dumping the event trace of the running daemon, to decode with stache_trace:\n");
+    fprintf(stderr, "  %s trace <file>\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Recording the requests sent to the running daemon, to replay with stache_replay:\n");
+    fprintf(stderr, "  %s record <file>\n", program);
+    fprintf(stderr, "  %s record-stop\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Probing encryption features of the filesystem holding a directory:\n");
+    fprintf(stderr, "  %s features <directory>\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Replacing the running daemon without dropping its clients, as the new daemon:\n");
+    fprintf(stderr, "  %s takeover\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Environment:\n");
+    fprintf(stderr, "  STACHE_BACKEND:  kernel (default), or memory[:<call>=<latency>[+<jitter>][/<failure %%>],...]\n");
+    fprintf(stderr, "                   to simulate the kernel, e.g. memory:all=50us,add_key=2ms+1ms/0.5.\n");
+    fprintf(stderr, "  STACHE_CPUS:     CPUs of each class of work (kdf, scan, warm), as a list or a mask,\n");
+    fprintf(stderr, "                   and a cgroup for scan and warm, e.g. kdf=4-7;scan=0xf@/dev/cpuset/background.\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -p <LENGTH>:     Filename padding length (default is 4).\n");
     fprintf(stderr, "  -d <DESC>:       Key descriptor (up to 8 characters).\n");
+    fprintf(stderr, "  -s <FD>:         Read the passphrase from file descriptor FD instead of prompting.\n");
+    fprintf(stderr, "  -k <FD>:         Read raw key material from file descriptor FD.\n");
+    fprintf(stderr, "  -c <CIPHER>:     Contents cipher: aes-256-xts (default), aes-128-cbc-essiv, adiantum,\n");
+    fprintf(stderr, "                   or auto for the fastest one on this machine.\n");
+    fprintf(stderr, "  -P <VERSION>:    Encryption policy version, 1 or 2 (default is the best supported).\n");
+    fprintf(stderr, "  -w:              Warm up the container caches after attach.\n");
+    fprintf(stderr, "  -e:              Evict the container from the page cache on detach.\n");
+    fprintf(stderr, "  -r <MB/S>:       Limit the copy bandwidth of rekey.\n");
     fprintf(stderr, "  -v:              Verbose output.\n");
 }
 
@@ -84,12 +167,818 @@ bool is_valid_padding(unsigned padding)
     return ( padding == 4 || padding == 8 || padding == 16 || padding == 32 );
 }
 
+static
+void init_crypt_options(struct ext4_crypt_options *opts)
+{
+    *opts = (struct ext4_crypt_options) {
+        .verbose = false,
+        .contents_cipher = "aes-256-xts",
+        .filename_cipher = "aes-256-cts",
+        .filename_padding = 4,
+        .key_descriptor = { 0 },
+        .requires_descriptor = true,
+        .secret_fd = -1,
+        .secret = NULL,
+        .secret_size = 0,
+        .secret_is_key = false,
+        .policy_version = 0,
+        .warm = false,
+        .evict = false,
+        .rate_limit = 0,
+        .cancel = NULL,
+    };
+}
+
+//
+// Only root and system may change containers or hand over pre-derived key material.
+//
+static
+bool is_trusted_peer(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return false;
+
+    return (cred.uid == AID_ROOT || cred.uid == AID_SYSTEM);
+}
+
+//
+// Receives one request message, its inline secret and an optional passed descriptor.
+// A secure slot for the secret is only taken when the request carries one; the
+// caller frees _*secret_ once the request is done. Fails with ENOMEM, the
+// message consumed, when no slot is left.
+//
+static
+int receive_request(int fd, struct stache_request *req, char **secret, int *passed_fd)
+{
+    struct iovec iov[2] = {
+        { .iov_base = req, .iov_len = sizeof(*req) },
+        { .iov_base = NULL, .iov_len = 0 },
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *passed_fd = -1;
+    *secret = NULL;
+
+    // Peek at the header to learn whether a secret follows.
+    ssize_t n;
+    do {
+        n = recv(fd, req, sizeof(*req), MSG_PEEK);
+    } while (n < 0 && errno == EINTR);
+
+    bool no_slot = false;
+    if (n == (ssize_t) sizeof(*req) && (req->flags & STACHE_REQ_SECRET_INLINE)) {
+        *secret = secmem_alloc();
+        no_slot = (*secret == NULL);
+        iov[1].iov_base = *secret;
+        iov[1].iov_len = no_slot ? 0 : STACHE_MAX_SECRET_SZ;
+    }
+
+    if (n > 0) {
+        do {
+            n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+    }
+
+    if (n < 0)
+        goto error;
+
+    // Orderly shutdown by the client.
+    if (n == 0) {
+        errno = 0;
+        goto error;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (no_slot) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    if (n < (ssize_t) sizeof(*req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        errno = EMSGSIZE;
+        goto error;
+    }
+
+    if (req->version != STACHE_PROTOCOL_VERSION) {
+        errno = EPROTO;
+        goto error;
+    }
+
+    if ((req->flags & STACHE_REQ_SECRET_INLINE) ?
+            ((size_t) n - sizeof(*req) != req->secret_size) : ((size_t) n != sizeof(*req))) {
+        errno = EBADMSG;
+        goto error;
+    }
+
+    if ((req->flags & (STACHE_REQ_SECRET_FD | STACHE_REQ_OUTPUT_FD)) && *passed_fd == -1) {
+        errno = EBADF;
+        goto error;
+    }
+
+    req->path[sizeof(req->path) - 1] = '\0';
+    req->contents_cipher[sizeof(req->contents_cipher) - 1] = '\0';
+    req->filename_cipher[sizeof(req->filename_cipher) - 1] = '\0';
+    return 0;
+
+error:
+    secmem_free(*secret);
+    *secret = NULL;
+    if (*passed_fd != -1) {
+        close(*passed_fd);
+        *passed_fd = -1;
+    }
+    return -1;
+}
+
+//
+// Translates a request into container options.
+//
+static
+int request_to_options(struct stache_request *req, const char *secret, int passed_fd,
+                       struct ext4_crypt_options *opts)
+{
+    init_crypt_options(opts);
+
+    if (req->contents_cipher[0] != '\0') {
+        opts->contents_cipher = req->contents_cipher;
+        opts->filename_cipher = (char *) cipher_preset_filenames(opts->contents_cipher);
+    }
+    if (req->filename_cipher[0] != '\0')
+        opts->filename_cipher = req->filename_cipher;
+    if (req->filename_padding != 0)
+        opts->filename_padding = req->filename_padding;
+    opts->policy_version = req->policy_version;
+
+    if (strcmp(opts->contents_cipher, CIPHER_AUTO) != 0 &&
+        (!is_valid_cipher(opts->contents_cipher) || opts->filename_cipher == NULL ||
+         !is_valid_cipher(opts->filename_cipher)))
+        return -1;
+
+    if (!is_valid_padding(opts->filename_padding) || opts->policy_version > 2)
+        return -1;
+
+    if (req->flags & STACHE_REQ_KEY_DESCRIPTOR) {
+        memcpy(opts->key_descriptor, req->key_descriptor, sizeof(opts->key_descriptor));
+        opts->requires_descriptor = false;
+    }
+
+    if (req->flags & STACHE_REQ_SECRET_INLINE) {
+        opts->secret = secret;
+        opts->secret_size = req->secret_size;
+    }
+    else if (req->flags & STACHE_REQ_SECRET_FD)
+        opts->secret_fd = passed_fd;
+
+    opts->secret_is_key = (req->flags & STACHE_REQ_SECRET_RAW_KEY) != 0;
+    opts->warm = (req->flags & STACHE_REQ_WARM) != 0;
+    opts->evict = (req->flags & STACHE_REQ_EVICT) != 0;
+    opts->rate_limit = (unsigned long long) req->rate_limit << 20;
+    return 0;
+}
+
+static
+void send_response(int fd, struct stache_response *resp)
+{
+    size_t len = STACHE_RESPONSE_HEADER_SZ + resp->message_size;
+
+    if (send(fd, resp, len, MSG_NOSIGNAL) != (ssize_t) len)
+        trace_record(TRACE_ERROR, TRACE_ERR_SEND, 0, errno, 0);
+}
+
+static
+enum stats_phase request_phase(uint32_t op)
+{
+    switch (op) {
+        case STACHE_OP_STATUS: return STATS_REQUEST_STATUS;
+        case STACHE_OP_CREATE: return STATS_REQUEST_CREATE;
+        case STACHE_OP_ATTACH: return STATS_REQUEST_ATTACH;
+        case STACHE_OP_DETACH: return STATS_REQUEST_DETACH;
+        default:               return STATS_REQUEST_OTHER;
+    }
+}
+
+//
+// Writes a snapshot of the daemon statistics into _output_fd_, or into the
+// response message when it is -1. The per-CPU rows of a large machine may not
+// fit in a message: that fails with EMSGSIZE rather than cutting them off.
+//
+static
+int report_stats(struct stache_response *resp, int output_fd)
+{
+    struct stats_snapshot *snapshot = malloc(sizeof(*snapshot));
+    FILE *out = NULL;
+    int ret = -1;
+
+    if (output_fd == -1)
+        out = fmemopen(resp->message, sizeof(resp->message), "w");
+    else {
+        // The stream closes its own copy, the request closes the passed descriptor.
+        int stream_fd = fcntl(output_fd, F_DUPFD_CLOEXEC, 0);
+        if (stream_fd != -1 && (out = fdopen(stream_fd, "w")) == NULL)
+            close(stream_fd);
+    }
+
+    if (snapshot == NULL || out == NULL)
+        goto out;
+
+    if (output_fd == -1)
+        setvbuf(out, NULL, _IONBF, 0);
+    stats_snapshot(snapshot);
+    stats_print(snapshot, out);
+    fprintf(out, "\n");
+    lane_print(out);
+    fprintf(out, "\n");
+    placement_print(out);
+    if (fflush(out) != 0 || ferror(out)) {
+        errno = (output_fd == -1) ? EMSGSIZE : EIO;
+        goto out;
+    }
+
+    if (output_fd == -1) {
+        // fmemopen() keeps the last byte for a terminating NUL.
+        long size = ftell(out);
+        if (size < 0 || (size_t) size >= sizeof(resp->message) - 1) {
+            errno = EMSGSIZE;
+            goto out;
+        }
+        resp->message_size = size;
+    }
+    ret = 0;
+
+out:
+    if (out != NULL)
+        fclose(out);
+    free(snapshot);
+    return ret;
+}
+
+//
+// Reports the tracked usage of a container, without walking it.
+//
+static
+int report_usage(const char *path, struct stache_response *resp)
+{
+    struct usage_record usage;
+    bool live;
+    int ret = -1;
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        return -1;
+
+    FILE *out = fmemopen(resp->message, sizeof(resp->message), "w");
+    if (out == NULL)
+        goto out;
+
+    if (usage_get(dirfd, &usage, &live) == 0) {
+        setvbuf(out, NULL, _IONBF, 0);
+        usage_print(&usage, live, out);
+        resp->message_size = ftell(out);
+        ret = 0;
+    }
+    fclose(out);
+
+out:
+    close(dirfd);
+    return ret;
+}
+
+//
+// Operations which change containers, as opposed to queries.
+//
+static
+bool changes_state(uint32_t op)
+{
+    switch (op) {
+        case STACHE_OP_CREATE:
+        case STACHE_OP_ATTACH:
+        case STACHE_OP_DETACH:
+        case STACHE_OP_MIGRATE:
+        case STACHE_OP_REKEY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//
+// Container operations go through the request lane, to be dropped when
+// nobody is waiting for them anymore. Queries are cheap enough to answer.
+//
+static
+bool is_cancellable(uint32_t op)
+{
+    return changes_state(op);
+}
+
+static
+bool names_container(const struct stache_request *req)
+{
+    // A status without a path is the status of the daemon.
+    return changes_state(req->op) || req->op == STACHE_OP_USAGE ||
+           (req->op == STACHE_OP_STATUS && req->path[0] != '\0');
+}
+
+//
+// Confines a request to the containers below the data directory, once symlinks
+// and dot-dot components are resolved. The resolved path replaces _path_.
+//
+static
+int confine_path(char *path, size_t size)
+{
+    char root[PATH_MAX], resolved[PATH_MAX];
+
+    if (realpath(STACHE_DATA_DIR, root) == NULL || realpath(path, resolved) == NULL)
+        return -1;
+
+    size_t root_len = strlen(root);
+    if (strncmp(resolved, root, root_len) != 0 || resolved[root_len] != '/' || resolved[root_len + 1] == '\0') {
+        errno = EACCES;
+        return -1;
+    }
+
+    if (strlen(resolved) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(path, resolved);
+    return 0;
+}
+
+//
+// Executes a single request.
+//
+static
+void dispatch_request(struct stache_request *req, struct ext4_crypt_options opts, int passed_fd,
+                      struct stache_response *resp)
+{
+    int status;
+    uint64_t entered_ns;
+    bool cancellable = is_cancellable(req->op);
+
+    if (cancellable && lane_enter(LANE_REQUEST, opts.cancel, &entered_ns) < 0) {
+        resp->status = -1;
+        resp->error = errno;
+        return;
+    }
+
+    switch (req->op) {
+        case STACHE_OP_STATUS: {
+            FILE *out = fmemopen(resp->message, sizeof(resp->message), "w");
+            if (out == NULL) {
+                status = -1;
+                break;
+            }
+            setvbuf(out, NULL, _IONBF, 0);
+            // Without a path, the status of the daemon itself: the probed feature matrix.
+            if (req->path[0] == '\0') {
+                features_print(out);
+                status = 0;
+            }
+            else
+                status = container_status(req->path, out);
+            resp->message_size = ftell(out);
+            fclose(out);
+            break;
+        }
+
+        case STACHE_OP_CREATE:
+            status = container_create(req->path, opts);
+            if (status == 0)
+                usage_track(req->path);
+            break;
+
+        case STACHE_OP_ATTACH:
+            status = container_attach(req->path, opts);
+            if (status == 0)
+                usage_track(req->path);
+            break;
+
+        case STACHE_OP_DETACH: {
+            FILE *out = fmemopen(resp->message, sizeof(resp->message), "w");
+            if (out == NULL) {
+                status = -1;
+                break;
+            }
+            setvbuf(out, NULL, _IONBF, 0);
+            status = container_detach(req->path, opts, out);
+            resp->message_size = ftell(out);
+            fclose(out);
+            break;
+        }
+
+        case STACHE_OP_MIGRATE:
+            status = container_migrate(req->path, opts);
+            if (status == 0)
+                usage_track(req->path);
+            break;
+
+        case STACHE_OP_REKEY:
+            status = container_rekey(req->path, opts);
+            if (status == 0)
+                usage_track(req->path);
+            break;
+
+        case STACHE_OP_USAGE:
+            status = report_usage(req->path, resp);
+            break;
+
+        case STACHE_OP_STATS:
+            status = report_stats(resp, (req->flags & STACHE_REQ_OUTPUT_FD) ? passed_fd : -1);
+            break;
+
+        case STACHE_OP_RECORD:
+            if (!(req->flags & STACHE_REQ_OUTPUT_FD)) {
+                record_stop();
+                status = 0;
+            }
+            else {
+                // The passed descriptor is closed with the request, the recording outlives it.
+                int record_fd = fcntl(passed_fd, F_DUPFD_CLOEXEC, 0);
+                status = (record_fd == -1) ? -1 : record_start(record_fd);
+            }
+            break;
+
+        case STACHE_OP_TRACE:
+            if (!(req->flags & STACHE_REQ_OUTPUT_FD)) {
+                errno = EBADF;
+                status = -1;
+            }
+            else
+                status = (trace_dump(passed_fd) < 0) ? -1 : 0;
+            break;
+
+        default:
+            errno = EOPNOTSUPP;
+            status = -1;
+            break;
+    }
+
+    resp->status = status;
+    resp->error = (status == 0) ? 0 : errno;
+
+    if (cancellable)
+        lane_leave(LANE_REQUEST, entered_ns);
+}
+
+//
+// Waits for the next request of a client. Returns false once the daemon hands
+// over: the connection then goes to the successor, queued requests included.
+//
+static
+bool wait_for_request(int fd)
+{
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = drain_fd, .events = POLLIN },
+    };
+
+    while (poll(fds, 2, -1) < 0 && errno == EINTR)
+        ;
+
+    return !(fds[1].revents & POLLIN);
+}
+
+static
+int hand_over_connection(int fd)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&handover_lock);
+    // The successor must be listening before it gets clients.
+    while (handover_channel != -1 && !state_sent)
+        pthread_cond_wait(&handover_changed, &handover_lock);
+    if (handover_channel != -1)
+        ret = handover_send(handover_channel, HANDOVER_CLIENT, &fd, 1);
+    pthread_mutex_unlock(&handover_lock);
+
+    if (ret < 0)
+        ALOGE("Cannot hand a client over: %s", strerror(errno));
+    return ret;
+}
+
+//
+// Creates an anonymous file for the handover state. Older C libraries lack the
+// memfd_create() wrapper, and older kernels the call: an unlinked file does too.
+//
+static
+int create_state_file()
+{
+#ifdef __NR_memfd_create
+    int fd = syscall(__NR_memfd_create, "stache-handover", MFD_CLOEXEC);
+    if (fd != -1 || errno != ENOSYS)
+        return fd;
+#endif
+
+    return open(HANDOVER_STATE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+//
+// Hands the daemon over to the successor on the other end of _channel_, then
+// exits. Only returns if the handover could not start.
+//
+static
+void hand_over_daemon(int channel)
+{
+    uint64_t value = 1;
+    int inotify = -1;
+
+    pthread_mutex_lock(&handover_lock);
+    bool busy = (handover_channel != -1);
+    if (!busy)
+        handover_channel = channel;
+    pthread_mutex_unlock(&handover_lock);
+    if (busy) {
+        errno = EBUSY;
+        return;
+    }
+
+    int state_fd = create_state_file();
+    int stream_fd = (state_fd == -1) ? -1 : fcntl(state_fd, F_DUPFD_CLOEXEC, 0);
+    FILE *state = (stream_fd == -1) ? NULL : fdopen(stream_fd, "w");
+    if (state == NULL) {
+        int err = errno;
+        if (stream_fd != -1)
+            close(stream_fd);
+        if (state_fd != -1)
+            close(state_fd);
+        pthread_mutex_lock(&handover_lock);
+        handover_channel = -1;
+        pthread_mutex_unlock(&handover_lock);
+        errno = err;
+        return;
+    }
+
+    // No way back from here: a failure ends the daemon, as a restart would.
+    write(drain_fd, &value, sizeof(value));
+    pthread_mutex_lock(&handover_lock);
+    while (accepting)
+        pthread_cond_wait(&handover_changed, &handover_lock);
+    pthread_mutex_unlock(&handover_lock);
+
+    // Sections are self-delimiting: one failing to save only costs its cache.
+    if (features_save(state) < 0 || backend_save(state) < 0)
+        ALOGE("Cannot save the feature caches for the successor");
+    if (usage_save(state, &inotify) < 0)
+        ALOGE("Cannot save the usage tracker for the successor");
+    if (fclose(state) != 0)
+        ALOGE("Cannot write the state for the successor: %s", strerror(errno));
+
+    int fds[HANDOVER_MAX_FDS] = { listen_fd, state_fd, inotify };
+    if (handover_send(channel, HANDOVER_STATE, fds, (inotify != -1) ? 3 : 2) < 0) {
+        ALOGE("Handover failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(state_fd);
+
+    pthread_mutex_lock(&handover_lock);
+    state_sent = true;
+    pthread_cond_broadcast(&handover_changed);
+    // Requests in progress complete here, then their connections follow.
+    while (nr_connections > 1)
+        pthread_cond_wait(&handover_changed, &handover_lock);
+    handover_send(channel, HANDOVER_DONE, NULL, 0);
+    pthread_mutex_unlock(&handover_lock);
+
+    exit(EXIT_SUCCESS);
+}
+
+//
+// Serves one client connection. Runs on its own thread so that slow
+// key derivations do not hold up other clients.
+//
+static
+void *handle_client(void *arg)
+{
+    struct client_connection *conn = arg;
+    int fd = conn->fd;
+    uint32_t connection_id = conn->id;
+    int passed_fd = -1;
+    struct stache_request *req = malloc(sizeof(*req));
+    struct stache_response *resp = calloc(1, sizeof(*resp));
+    char *secret = NULL;
+
+    uint64_t connected_ns = stats_now();
+    trace_phase(STATS_ACCEPT, conn->accepted_ns, 0, 0);
+    free(conn);
+
+    if (req == NULL || resp == NULL)
+        goto out;
+
+    while (true) {
+        struct ext4_crypt_options opts;
+        bool valid = false;
+
+        if (!wait_for_request(fd)) {
+            hand_over_connection(fd);
+            break;
+        }
+
+        if (receive_request(fd, req, &secret, &passed_fd) < 0) {
+            if (errno != 0)
+                trace_record(TRACE_ERROR, TRACE_ERR_RECEIVE, 0, errno, 0);
+            if (errno != ENOMEM)
+                break;
+
+            // Out of secure memory: this request fails, the connection stays.
+            memset(resp, 0, STACHE_RESPONSE_HEADER_SZ);
+            resp->status = -1;
+            resp->error = ENOMEM;
+            send_response(fd, resp);
+            continue;
+        }
+
+        uint64_t started_ns = stats_now();
+        if (req->op != STACHE_OP_RECORD && req->op != STACHE_OP_HANDOVER)
+            record_request(connection_id, req);
+
+        memset(resp, 0, STACHE_RESPONSE_HEADER_SZ);
+        bool privileged = (req->flags & STACHE_REQ_SECRET_RAW_KEY) || changes_state(req->op) ||
+                          req->op == STACHE_OP_TRACE || req->op == STACHE_OP_RECORD ||
+                          req->op == STACHE_OP_HANDOVER;
+        if (privileged && !is_trusted_peer(fd)) {
+            resp->status = -1;
+            resp->error = EPERM;
+        }
+        else if (names_container(req) && confine_path(req->path, sizeof(req->path)) < 0) {
+            resp->status = -1;
+            resp->error = errno;
+        }
+        else if (request_to_options(req, secret, passed_fd, &opts) < 0) {
+            resp->status = -1;
+            resp->error = EINVAL;
+        }
+        else
+            valid = true;
+        trace_phase(STATS_PARSE, started_ns, 0, valid ? 0 : resp->error);
+
+        struct cancel_token cancel = {
+            .deadline_ns = req->deadline_ns,
+            .client_fd = fd,
+        };
+        opts.cancel = &cancel;
+
+        if (valid && req->op == STACHE_OP_HANDOVER) {
+            hand_over_daemon(fd);
+            resp->status = -1;
+            resp->error = errno;
+            valid = false;
+        }
+
+        if (valid) {
+            dispatch_request(req, opts, passed_fd, resp);
+
+            uint64_t duration_ns = stats_now() - started_ns;
+            stats_record(request_phase(req->op), duration_ns);
+            trace_record(TRACE_REQUEST, req->op, trace_hash_string(req->path), resp->error, duration_ns);
+        }
+
+        send_response(fd, resp);
+
+        if (passed_fd != -1) {
+            close(passed_fd);
+            passed_fd = -1;
+        }
+        secmem_free(secret);
+        secret = NULL;
+    }
+
+out:
+    trace_record(TRACE_DISCONNECT, 0, 0, 0, stats_now() - connected_ns);
+    secmem_free(secret);
+    free(req);
+    free(resp);
+    close(fd);
+
+    pthread_mutex_lock(&handover_lock);
+    nr_connections--;
+    pthread_cond_broadcast(&handover_changed);
+    pthread_mutex_unlock(&handover_lock);
+    return NULL;
+}
+
+static
+void spawn_client(int fd, uint64_t accepted_ns)
+{
+    struct client_connection *conn = malloc(sizeof(*conn));
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->id = next_connection_id++;
+    conn->accepted_ns = accepted_ns;
+
+    unsigned limit = is_trusted_peer(fd) ? MAX_CONNECTIONS : MAX_CONNECTIONS - RESERVED_CONNECTIONS;
+    pthread_mutex_lock(&handover_lock);
+    bool full = (nr_connections >= limit);
+    if (!full)
+        nr_connections++;
+    pthread_mutex_unlock(&handover_lock);
+    if (full) {
+        trace_record(TRACE_ERROR, TRACE_ERR_ACCEPT, 0, EAGAIN, 0);
+        close(fd);
+        free(conn);
+        return;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, handle_client, conn);
+    if (err != 0) {
+        trace_record(TRACE_ERROR, TRACE_ERR_THREAD, 0, err, 0);
+        close(fd);
+        free(conn);
+
+        pthread_mutex_lock(&handover_lock);
+        nr_connections--;
+        pthread_mutex_unlock(&handover_lock);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+//
+// Starts the background services, unless they were taken over from a predecessor.
+//
+static
+void start_services()
+{
+    if (random_pool_start() < 0)
+        ALOGE("Cannot start the random pool, using the generator directly");
+
+    if (!features_probed() && features_probe(STACHE_DATA_DIR, NULL) < 0)
+        ALOGE("Cannot probe encryption features in %s", STACHE_DATA_DIR);
+
+    if (!usage_resumed && usage_start(STACHE_DATA_DIR) < 0)
+        ALOGE("Cannot track the usage of containers in %s", STACHE_DATA_DIR);
+}
+
+//
+// Accepts clients until the daemon hands over, then waits for the handover to end it.
+//
+static
+void serve()
+{
+    pthread_mutex_lock(&handover_lock);
+    accepting = true;
+    pthread_mutex_unlock(&handover_lock);
+
+    while (1) {
+        struct pollfd fds[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = drain_fd, .events = POLLIN },
+        };
+
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents & POLLIN)
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        int ret_fd = accept4(listen_fd, (struct sockaddr*) NULL, NULL, SOCK_CLOEXEC);
+        if (ret_fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                trace_record(TRACE_ERROR, TRACE_ERR_ACCEPT, 0, errno, 0);
+            continue;
+        }
+
+        spawn_client(ret_fd, stats_now());
+    }
+
+    pthread_mutex_lock(&handover_lock);
+    accepting = false;
+    pthread_cond_broadcast(&handover_changed);
+    pthread_mutex_unlock(&handover_lock);
+
+    while (1)
+        pause();
+}
+
 int open_socket()
 {
     int rc = 0, stage = 0;
-    int ret_fd;
 
-	listen_fd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	listen_fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
     if (listen_fd < 0) {
         stage = 1;
         goto error;
@@ -117,13 +1006,19 @@ int open_socket()
         goto error;
     }
 
-    while(1) {
-        ret_fd = accept(listen_fd, (struct sockaddr*) NULL, NULL);
-        ALOGE("Recieved data on socket: %i", ret_fd);
-        close(ret_fd);
-        sleep(1);
+    if (crypto_init() == -1) {
+        stage = 4;
+        goto error;
+    }
+
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if (drain_fd == -1) {
+        stage = 5;
+        goto error;
     }
 
+    start_services();
+    serve();
 
 error:
     ALOGE("Unable to create stache control service (stage=%d, rc=%d)", stage, rc);
@@ -146,38 +1041,275 @@ void close_socket()
     }
 }
 
+//
+// Adopts the clients the predecessor hands over once their requests complete.
+//
+static
+void *receive_connections(void *arg)
+{
+    int channel = (int) (intptr_t) arg;
+    struct handover_message message;
+    int fds[HANDOVER_MAX_FDS];
+    unsigned nr_fds;
+    int type;
+
+    while ((type = handover_receive(channel, &message, fds, &nr_fds)) == HANDOVER_CLIENT) {
+        for (unsigned i = 1; i < nr_fds; i++)
+            close(fds[i]);
+        if (nr_fds > 0)
+            spawn_client(fds[0], stats_now());
+    }
+
+    if (type != HANDOVER_DONE)
+        ALOGE("Handover ended early, some clients may be lost");
+    close(channel);
+    return NULL;
+}
+
+static
+void restore_state(int state_fd, int inotify)
+{
+    struct handover_reader state, section;
+    uint32_t type;
+    int ret;
+
+    if (handover_load_state(state_fd, &state) < 0) {
+        ALOGE("Cannot load the state of the predecessor: %s", strerror(errno));
+        return;
+    }
+
+    while ((ret = handover_next_section(&state, &type, &section)) > 0) {
+        switch (type) {
+            case HANDOVER_SECTION_FEATURES:
+                ret = features_restore(&section);
+                break;
+            case HANDOVER_SECTION_FILESYSTEMS:
+                ret = backend_restore(&section);
+                break;
+            case HANDOVER_SECTION_USAGE:
+                ret = usage_resume(STACHE_DATA_DIR, inotify, &section);
+                usage_resumed = (ret == 0);
+                break;
+            default:
+                // Written by a newer daemon: nothing we can use.
+                ret = 0;
+                break;
+        }
+        if (ret < 0)
+            ALOGE("Cannot restore state section %u, rebuilding it", type);
+    }
+    if (ret < 0)
+        ALOGE("State of the predecessor is corrupt");
+
+    handover_release_state(&state);
+}
+
+//
+// Replaces the running daemon: takes over its listening socket, its caches and
+// its clients, then serves. Falls back to starting afresh if no daemon answers.
+//
+static
+int take_over()
+{
+    struct stache_request req;
+    struct handover_message message;
+    int fds[HANDOVER_MAX_FDS];
+    unsigned nr_fds = 0;
+
+    int channel = client_connect();
+    if (channel == -1) {
+        ALOGE("No daemon to take over, starting afresh");
+        open_socket();
+        return EXIT_FAILURE;
+    }
+
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if (drain_fd == -1 || crypto_init() == -1) {
+        ALOGE("Cannot prepare the takeover");
+        close(channel);
+        return EXIT_FAILURE;
+    }
+
+    client_init_request(&req, STACHE_OP_HANDOVER, NULL);
+    if (send(channel, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+        ALOGE("Cannot request the handover: %s", strerror(errno));
+        close(channel);
+        return EXIT_FAILURE;
+    }
+
+    int type = handover_receive(channel, &message, fds, &nr_fds);
+    if (type != HANDOVER_STATE || nr_fds < 2) {
+        ALOGE("Daemon refused the handover: %s", strerror(type < 0 ? errno : EPROTO));
+        for (unsigned i = 0; i < nr_fds; i++)
+            close(fds[i]);
+        close(channel);
+        return EXIT_FAILURE;
+    }
+
+    listen_fd = fds[0];
+    int inotify = (nr_fds > 2) ? fds[2] : -1;
+
+    // State of another layout is only a cache: rebuild it instead.
+    if (message.version == HANDOVER_STATE_VERSION)
+        restore_state(fds[1], inotify);
+    if (!usage_resumed && inotify != -1)
+        close(inotify);
+    close(fds[1]);
+
+    start_services();
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, receive_connections, (void *) (intptr_t) channel);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        ALOGE("Cannot adopt the clients of the predecessor: %s", strerror(err));
+        close(channel);
+    }
+
+    serve();
+    return EXIT_SUCCESS;
+}
+
+int stache_cli(int argc, char *argv[]);
+
 int main(int argc, char **argv)
 {
+    // Lets the daemon and the tools run without an encrypting kernel, for load tests.
+    const char *backend = getenv("STACHE_BACKEND");
+    if (backend != NULL && backend_use(backend) < 0)
+        return EXIT_FAILURE;
+
+    // Keeps derivations off slow cores on heterogeneous CPUs.
+    const char *cpus = getenv("STACHE_CPUS");
+    if (cpus != NULL && placement_configure(cpus) < 0)
+        return EXIT_FAILURE;
+
+    if (argc == 2 && strcmp(argv[1], "takeover") == 0)
+        return take_over();
+
+    if (argc > 1)
+        return stache_cli(argc, argv);
+
     open_socket();
 #if 0
     close_socket();
 #endif
 }
 
-int crypt(int argc, char *argv[])
+//
+// Sends a query to the running daemon and prints the answer. With _output_fd_
+// other than -1, the daemon writes the answer there itself.
+//
+static
+int query_daemon(int op, const char *path, int output_fd, const char *what)
+{
+    struct stache_request req;
+    struct stache_response *resp = malloc(sizeof(*resp));
+    int ret = -1;
+
+    int fd = client_connect();
+    if ( fd == -1 || resp == NULL )
+        goto out;
+
+    client_init_request(&req, op, path);
+    if ( output_fd != -1 ) {
+        req.flags = STACHE_REQ_OUTPUT_FD;
+        fflush(stdout);
+    }
+    if ( client_transact(fd, &req, NULL, output_fd, resp) < 0 )
+        goto out;
+
+    if ( resp->status != 0 ) {
+        fprintf(stderr, "Cannot get %s: %s\n", what, strerror(resp->error));
+        goto out;
+    }
+
+    fwrite(resp->message, 1, resp->message_size, stdout);
+    ret = 0;
+
+out:
+    if ( fd != -1 )
+        close(fd);
+    free(resp);
+    return ret;
+}
+
+//
+// Sends a daemon request of operation _op_ which writes into _path_, or which
+// carries no descriptor at all when _path_ is NULL.
+//
+static
+int daemon_output_request(int op, const char *path, const char *what)
+{
+    struct stache_request req;
+    struct stache_response *resp = malloc(sizeof(*resp));
+    int ret = -1;
+    int out = -1;
+    int fd = -1;
+
+    if ( path != NULL ) {
+        out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if ( out == -1 ) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            goto out;
+        }
+    }
+
+    fd = client_connect();
+    if ( fd == -1 || resp == NULL )
+        goto out;
+
+    client_init_request(&req, op, NULL);
+    if ( out != -1 )
+        req.flags = STACHE_REQ_OUTPUT_FD;
+    if ( client_transact(fd, &req, NULL, out, resp) < 0 )
+        goto out;
+
+    if ( resp->status != 0 ) {
+        fprintf(stderr, "Cannot %s: %s\n", what, strerror(resp->error));
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if ( fd != -1 )
+        close(fd);
+    if ( out != -1 )
+        close(out);
+    free(resp);
+    return ret;
+}
+
+int stache_cli(int argc, char *argv[])
 {
     const char *program = basename(argv[0]);
     int c, opt_index;
     size_t desc_len;
-    struct ext4_crypt_options opts = {
-        .verbose = false,
-        .contents_cipher = "aes-256-xts",
-        .filename_cipher = "aes-256-cts",
-        .filename_padding = 4,
-        .key_descriptor = { 0 },
-        .requires_descriptor = true,
-    };
+    struct ext4_crypt_options opts;
+
+    init_crypt_options(&opts);
 
     while ( true ) {
         static struct option long_options[] = {
-            { "help",         no_argument,        0, 'h' },
-            { "verbose",      no_argument,        0, 'v' },
-            { "name-padding", required_argument,  0, 'p' },
-            { "key-desc",     required_argument,  0, 'd' },
+            { "help",           no_argument,        0, 'h' },
+            { "verbose",        no_argument,        0, 'v' },
+            { "name-padding",   required_argument,  0, 'p' },
+            { "key-desc",       required_argument,  0, 'd' },
+            { "passphrase-fd",  required_argument,  0, 's' },
+            { "key-fd",         required_argument,  0, 'k' },
+            { "policy-version", required_argument,  0, 'P' },
+            { "cipher",         required_argument,  0, 'c' },
+            { "warm",           no_argument,        0, 'w' },
+            { "evict",          no_argument,        0, 'e' },
+            { "rate",           required_argument,  0, 'r' },
             { 0, 0, 0, 0 },
         };
 
-        c = getopt_long(argc, argv, "hvp:d:", long_options, &opt_index);
+        c = getopt_long(argc, argv, "hvwep:d:s:k:P:c:r:", long_options, &opt_index);
         if ( c == -1 )
             break;
 
@@ -190,6 +1322,22 @@ int crypt(int argc, char *argv[])
                 opts.verbose = true;
                 break;
 
+            case 'w':
+                opts.warm = true;
+                break;
+
+            case 'e':
+                opts.evict = true;
+                break;
+
+            case 'r':
+                opts.rate_limit = strtoull(optarg, NULL, 10) << 20;
+                if ( opts.rate_limit == 0 ) {
+                    fprintf(stderr, "Invalid rate limit: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
             case 'p':
                 opts.filename_padding = atoi(optarg);
                 if ( !is_valid_padding(opts.filename_padding) ) {
@@ -209,26 +1357,61 @@ int crypt(int argc, char *argv[])
                 opts.requires_descriptor = false;
                 break;
 
+            case 's':
+            case 'k':
+                opts.secret_fd = atoi(optarg);
+                opts.secret_is_key = (c == 'k');
+                if ( opts.secret_fd < 0 || fcntl(opts.secret_fd, F_GETFD) == -1 ) {
+                    fprintf(stderr, "Invalid file descriptor: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'c':
+                if ( strcmp(optarg, CIPHER_AUTO) != 0 && cipher_preset_filenames(optarg) == NULL ) {
+                    fprintf(stderr, "Invalid cipher %s: must be aes-256-xts, aes-128-cbc-essiv, adiantum or auto\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                opts.contents_cipher = optarg;
+                if ( strcmp(optarg, CIPHER_AUTO) != 0 )
+                    opts.filename_cipher = (char *) cipher_preset_filenames(optarg);
+                break;
+
+            case 'P':
+                opts.policy_version = atoi(optarg);
+                if ( opts.policy_version != 1 && opts.policy_version != 2 ) {
+                    fprintf(stderr, "Invalid policy version: must be 1 or 2\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
             default:
                 usage(program);
                 return EXIT_FAILURE;
         }
     }
 
-    if ( optind + 1 >= argc ) {
+    if ( optind >= argc ) {
         usage(program);
         return EXIT_FAILURE;
     }
 
     int status = 0;
     const char *command = argv[optind];
-    const char *dir_path = argv[optind + 1];
+    const char *dir_path = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+
+    // Only daemon queries go without a directory.
+    if ( dir_path == NULL && strcmp(command, "stats") != 0 && strcmp(command, "record-stop") != 0 ) {
+        usage(program);
+        return EXIT_FAILURE;
+    }
 
     if ( strcmp(command, "help") == 0 ) {
         usage(program);
     }
     else if ( strcmp(command, "status") == 0 ) {
-        status = container_status(dir_path);
+        status = container_status(dir_path, stdout);
     }
     else if ( strcmp(command, "create") == 0 ) {
         status = container_create(dir_path, opts);
@@ -237,7 +1420,39 @@ int crypt(int argc, char *argv[])
         status = container_attach(dir_path, opts);
     }
     else if ( strcmp(command, "detach") == 0 ) {
-        status = container_detach(dir_path, opts);
+        status = container_detach(dir_path, opts, stdout);
+    }
+    else if ( strcmp(command, "migrate") == 0 ) {
+        status = container_migrate(dir_path, opts);
+    }
+    else if ( strcmp(command, "rekey") == 0 ) {
+        status = container_rekey(dir_path, opts);
+    }
+    else if ( strcmp(command, "stats") == 0 ) {
+        status = query_daemon(STACHE_OP_STATS, NULL, STDOUT_FILENO, "statistics");
+    }
+    else if ( strcmp(command, "usage") == 0 ) {
+        // The daemon does not share our working directory.
+        char real_path[PATH_MAX];
+        status = (realpath(dir_path, real_path) == NULL) ? -1 : query_daemon(STACHE_OP_USAGE, real_path, -1, "usage");
+        if ( status < 0 && errno == ENOENT )
+            fprintf(stderr, "Cannot find %s\n", dir_path);
+    }
+    else if ( strcmp(command, "trace") == 0 ) {
+        status = daemon_output_request(STACHE_OP_TRACE, dir_path, "dump the trace");
+    }
+    else if ( strcmp(command, "record") == 0 ) {
+        status = daemon_output_request(STACHE_OP_RECORD, dir_path, "start recording");
+    }
+    else if ( strcmp(command, "record-stop") == 0 ) {
+        status = daemon_output_request(STACHE_OP_RECORD, NULL, "stop recording");
+    }
+    else if ( strcmp(command, "features") == 0 ) {
+        status = crypto_init();
+        if ( status == 0 )
+            status = features_probe(dir_path, NULL);
+        if ( status == 0 )
+            features_print(stdout);
     }
     else {
         fprintf(stderr, "Error: unrecognized command %s\n", command);
@@ -245,5 +1460,8 @@ int crypt(int argc, char *argv[])
         status = -1;
     }
 
+    // Background warm-up dies with the process: let it complete.
+    warm_wait_all();
+
     return (status == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -47,17 +47,37 @@
 #include <asm-generic/ioctl.h>
 #include <keyutils.h>
 #include <libgen.h>
+#include <limits.h>
 
 /* Include kernel definitions */
 // TODO: find a some way to import these directly from the kernel
 #include "kernel/pfk.h"
 #include "kernel/ext4_crypto.h"
 #include "kernel/ext4.h"
+#include "kernel/fscrypt.h"
 
 /* Import EXT4 encryption related definitions that for some reason AREN'T
  * defined in the kernel */
+#include "metadata.h"
 #include "ext4_crypto_config.h"
 
+#include "secmem.h"
+#include "handover.h"
+#include "backend.h"
+#include "feature_matrix.h"
+#include "walk.h"
+#include "usage.h"
+#include "warm.h"
+#include "evict.h"
+#include "copy.h"
+#include "stats.h"
+#include "trace.h"
+#include "random_pool.h"
+#include "lane.h"
+#include "placement.h"
+
+#define STACHE_DATA_DIR "/data/stache"
+
 #define UNUSED __attribute__((unused))
 #define VERBOSE_PRINT(opts, format, args...) ({      \
     if ( opts.verbose )                              \
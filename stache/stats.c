@@ -0,0 +1,290 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stache.h"
+
+struct stats_counter {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t buckets[STATS_NR_BUCKETS];
+};
+
+//
+// Only its owner thread writes to a block, so plain relaxed loads and stores
+// suffice. Blocks of exited threads are handed over to new threads along with
+// their counts, which keeps their number bounded by the peak thread count.
+//
+struct stats_block {
+    struct stats_block *next;           // all blocks
+    struct stats_block *next_free;
+    struct stats_counter phases[NR_STATS_PHASES];
+};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *stats_blocks = NULL;
+static struct stats_block *stats_free_blocks = NULL;
+static unsigned stats_nr_blocks = 0;
+static uint64_t stats_started_ns;
+// Cached copy of the thread specific value, which only serves the destructor.
+static __thread struct stats_block *local_block;
+
+uint64_t stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void release_block(void *arg)
+{
+    struct stats_block *block = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    block->next_free = stats_free_blocks;
+    stats_free_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static
+void stats_init()
+{
+    pthread_key_create(&stats_key, release_block);
+    stats_started_ns = stats_now();
+}
+
+static
+struct stats_block *thread_block()
+{
+    if ( local_block != NULL )
+        return local_block;
+
+    pthread_once(&stats_once, stats_init);
+
+    struct stats_block *block;
+
+    pthread_mutex_lock(&stats_lock);
+    block = stats_free_blocks;
+    if ( block != NULL )
+        stats_free_blocks = block->next_free;
+    else if ( (block = calloc(1, sizeof(*block))) != NULL ) {
+        block->next = stats_blocks;
+        stats_blocks = block;
+        stats_nr_blocks++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if ( block != NULL ) {
+        pthread_setspecific(stats_key, block);
+        local_block = block;
+    }
+    return block;
+}
+
+static
+unsigned bucket_index(uint64_t value)
+{
+    if ( value < STATS_SUB_BUCKETS )
+        return value;
+
+    unsigned exponent = 63 - __builtin_clzll(value);
+    if ( exponent > STATS_MAX_EXPONENT )
+        return STATS_NR_BUCKETS - 1;
+
+    unsigned mantissa = (value >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + mantissa;
+}
+
+//
+// Lowest value of a bucket.
+//
+static
+uint64_t bucket_value(unsigned index)
+{
+    if ( index < STATS_SUB_BUCKETS )
+        return index;
+
+    unsigned exponent = index / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    uint64_t mantissa = index % STATS_SUB_BUCKETS;
+    return (STATS_SUB_BUCKETS + mantissa) << (exponent - STATS_SUB_BITS);
+}
+
+static inline
+void counter_add(atomic_uint_fast64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+//
+// Preserves errno, so that it can sit between a system call and its error handling.
+//
+void stats_record(enum stats_phase phase, uint64_t elapsed_ns)
+{
+    struct stats_block *block = local_block;
+    if ( block == NULL ) {
+        int saved_errno = errno;
+        block = thread_block();
+        errno = saved_errno;
+    }
+
+    if ( block == NULL || phase >= NR_STATS_PHASES )
+        return;
+
+    struct stats_counter *counter = &block->phases[phase];
+    counter_add(&counter->buckets[bucket_index(elapsed_ns)], 1);
+    counter_add(&counter->sum_ns, elapsed_ns);
+    if ( elapsed_ns > atomic_load_explicit(&counter->max_ns, memory_order_relaxed) )
+        atomic_store_explicit(&counter->max_ns, elapsed_ns, memory_order_relaxed);
+    // Last, so that a snapshot never counts more samples than its buckets hold.
+    counter_add(&counter->count, 1);
+}
+
+void stats_snapshot(struct stats_snapshot *snapshot)
+{
+    pthread_once(&stats_once, stats_init);
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    pthread_mutex_lock(&stats_lock);
+    snapshot->uptime_ns = stats_now() - stats_started_ns;
+    snapshot->nr_threads = stats_nr_blocks;
+
+    for ( struct stats_block *block = stats_blocks; block; block = block->next ) {
+        for ( int phase = 0; phase < NR_STATS_PHASES; phase++ ) {
+            struct stats_counter *counter = &block->phases[phase];
+            struct stats_histogram *histogram = &snapshot->phases[phase];
+
+            histogram->count += atomic_load_explicit(&counter->count, memory_order_relaxed);
+            histogram->sum_ns += atomic_load_explicit(&counter->sum_ns, memory_order_relaxed);
+
+            uint64_t max_ns = atomic_load_explicit(&counter->max_ns, memory_order_relaxed);
+            if ( max_ns > histogram->max_ns )
+                histogram->max_ns = max_ns;
+
+            for ( unsigned i = 0; i < STATS_NR_BUCKETS; i++ )
+                histogram->buckets[i] += atomic_load_explicit(&counter->buckets[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+//
+// Adds one sample to a private histogram, for tools measuring on their own.
+//
+void stats_histogram_add(struct stats_histogram *histogram, uint64_t value_ns)
+{
+    histogram->buckets[bucket_index(value_ns)]++;
+    histogram->sum_ns += value_ns;
+    if ( value_ns > histogram->max_ns )
+        histogram->max_ns = value_ns;
+    histogram->count++;
+}
+
+//
+// Merges _from_ into _into_.
+//
+void stats_histogram_merge(struct stats_histogram *into, const struct stats_histogram *from)
+{
+    for ( unsigned i = 0; i < STATS_NR_BUCKETS; i++ )
+        into->buckets[i] += from->buckets[i];
+    into->sum_ns += from->sum_ns;
+    if ( from->max_ns > into->max_ns )
+        into->max_ns = from->max_ns;
+    into->count += from->count;
+}
+
+uint64_t stats_percentile(const struct stats_histogram *histogram, double percentile)
+{
+    uint64_t total = 0;
+    for ( unsigned i = 0; i < STATS_NR_BUCKETS; i++ )
+        total += histogram->buckets[i];
+
+    if ( total == 0 )
+        return 0;
+
+    uint64_t rank = (uint64_t) (total * percentile / 100.0);
+    uint64_t seen = 0;
+    for ( unsigned i = 0; i < STATS_NR_BUCKETS; i++ ) {
+        seen += histogram->buckets[i];
+        if ( seen > rank ) {
+            // Middle of the bucket, capped by the largest sample seen.
+            uint64_t value = bucket_value(i);
+            if ( i + 1 < STATS_NR_BUCKETS )
+                value += (bucket_value(i + 1) - value) / 2;
+            return value < histogram->max_ns ? value : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+static const char *phase_names[NR_STATS_PHASES] = {
+    [STATS_ACCEPT] = "accept",
+    [STATS_PARSE] = "parse",
+    [STATS_OPEN] = "open",
+    [STATS_POLICY] = "policy",
+    [STATS_KEY_SEARCH] = "key-search",
+    [STATS_KEY_ADD] = "key-add",
+    [STATS_KEY_REMOVE] = "key-remove",
+    [STATS_KDF] = "kdf",
+    [STATS_KEY_VERIFY] = "key-verify",
+    [STATS_REQUEST_STATUS] = "req-status",
+    [STATS_REQUEST_CREATE] = "req-create",
+    [STATS_REQUEST_ATTACH] = "req-attach",
+    [STATS_REQUEST_DETACH] = "req-detach",
+    [STATS_REQUEST_OTHER] = "req-other",
+};
+
+const char *stats_phase_name(enum stats_phase phase)
+{
+    return (phase < NR_STATS_PHASES) ? phase_names[phase] : "unknown";
+}
+
+void stats_print(const struct stats_snapshot *snapshot, FILE *out)
+{
+    fprintf(out, "Uptime: %llu s, %u threads\n",
+            (unsigned long long) (snapshot->uptime_ns / 1000000000ULL), snapshot->nr_threads);
+    fprintf(out, "%-12s %10s %10s %10s %10s %10s %10s\n",
+            "phase", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+    for ( int phase = 0; phase < NR_STATS_PHASES; phase++ ) {
+        const struct stats_histogram *histogram = &snapshot->phases[phase];
+        if ( histogram->count == 0 )
+            continue;
+
+        fprintf(out, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                stats_phase_name(phase),
+                (unsigned long long) histogram->count,
+                histogram->sum_ns / 1e3 / histogram->count,
+                stats_percentile(histogram, 50) / 1e3,
+                stats_percentile(histogram, 90) / 1e3,
+                stats_percentile(histogram, 99) / 1e3,
+                histogram->max_ns / 1e3);
+    }
+}
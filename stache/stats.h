@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Latency statistics of the daemon.
+ *
+ * Every thread records into its own block, without locks or shared cache lines;
+ * a snapshot sums up the blocks. Latencies go into log-linear histograms in the
+ * spirit of HdrHistogram: exact below 8 ns, then 8 buckets per power of two,
+ * for a relative error under 12.5%.
+ */
+
+enum stats_phase {
+    STATS_ACCEPT,           // from accept() to the client thread running
+    STATS_PARSE,            // request validation and translation
+    STATS_OPEN,             // opening the directory and checking its filesystem
+    STATS_POLICY,           // encryption policy ioctls
+    STATS_KEY_SEARCH,       // keyring searches and key status queries
+    STATS_KEY_ADD,
+    STATS_KEY_REMOVE,
+    STATS_KDF,              // passphrase derivation
+    STATS_KEY_VERIFY,       // check of the derived key against the container verifier
+    STATS_REQUEST_STATUS,   // total time of a request, per operation
+    STATS_REQUEST_CREATE,
+    STATS_REQUEST_ATTACH,
+    STATS_REQUEST_DETACH,
+    STATS_REQUEST_OTHER,
+    NR_STATS_PHASES,
+};
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXPONENT 47           // about 39 hours
+#define STATS_NR_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+struct stats_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_NR_BUCKETS];
+};
+
+struct stats_snapshot {
+    uint64_t uptime_ns;
+    unsigned nr_threads;                // blocks ever allocated
+    struct stats_histogram phases[NR_STATS_PHASES];
+};
+
+uint64_t stats_now();
+void stats_record(enum stats_phase, uint64_t elapsed_ns);
+
+static inline void stats_record_since(enum stats_phase phase, uint64_t started_ns)
+{
+    stats_record(phase, stats_now() - started_ns);
+}
+
+void stats_snapshot(struct stats_snapshot *);
+void stats_histogram_add(struct stats_histogram *, uint64_t value_ns);
+void stats_histogram_merge(struct stats_histogram *into, const struct stats_histogram *from);
+uint64_t stats_percentile(const struct stats_histogram *, double percentile);
+const char *stats_phase_name(enum stats_phase);
+void stats_print(const struct stats_snapshot *, FILE *out);
+
+#endif /* _STATS_H */
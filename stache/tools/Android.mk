@@ -0,0 +1,34 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    stache_trace.c
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+	$(stache_c_includes)
+
+LOCAL_STATIC_LIBRARIES := libstache
+LOCAL_SHARED_LIBRARIES := $(stache_shared_libraries)
+
+LOCAL_MODULE := stache_trace
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    stache_replay.c
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+	$(stache_c_includes)
+
+LOCAL_STATIC_LIBRARIES := libstache
+LOCAL_SHARED_LIBRARIES := $(stache_shared_libraries)
+
+LOCAL_MODULE := stache_replay
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
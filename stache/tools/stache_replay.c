@@ -0,0 +1,483 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stache.h"
+#include "protocol.h"
+#include "client.h"
+#include "record.h"
+
+/*
+ * Replays a recording made by 'stache record <file>' against the running
+ * daemon, paced as recorded, N times faster, or as fast as possible.
+ *
+ * Requests of one recorded connection are replayed in order on one
+ * connection by the same worker; connections are spread over the workers.
+ * When paced, latency is measured from the time a request was due rather
+ * than from the time it could be sent, so that a daemon falling behind
+ * shows up in the percentiles instead of slowing the replay down.
+ */
+
+#define REPLAY_MAX_OPS 16
+#define REPLAY_SECRET_SZ 32        // for secrets passed by descriptor, of unknown size
+
+struct replay_item {
+    struct record_entry entry;
+    char contents_cipher[32];
+    char filename_cipher[32];
+    char *path;
+};
+
+struct replay_result {
+    unsigned long long errors;
+    unsigned long long failures;      // no response at all
+    struct stats_histogram latency;
+};
+
+struct replay_worker {
+    pthread_t thread;
+    unsigned index;
+    struct replay_result results[REPLAY_MAX_OPS];
+};
+
+static struct replay_item *items;
+static size_t nr_items;
+static unsigned nr_workers = 4;
+static double speed = 1.0;
+static const char *prefix_from;
+static const char *prefix_to;
+static char secret[STACHE_MAX_SECRET_SZ];
+static size_t secret_size;
+static bool secret_given;
+static int null_fd = -1;
+static uint64_t replay_started_ns;
+
+static
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <recording>\n", program);
+    fprintf(stderr, "Replays requests recorded by 'stache record' against the running daemon.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -x <FACTOR>:     Replay FACTOR times faster than recorded, 0 for as fast as possible\n");
+    fprintf(stderr, "                   (default is 1).\n");
+    fprintf(stderr, "  -c <COUNT>:      Number of concurrent workers (default is 4).\n");
+    fprintf(stderr, "  -r <FROM=TO>:    Replace the FROM prefix of recorded paths by TO.\n");
+    fprintf(stderr, "  -s <FILE>:       Send the contents of FILE as secret, instead of random bytes of\n");
+    fprintf(stderr, "                   the recorded size.\n");
+    fprintf(stderr, "  -j:              Report in JSON.\n");
+    fprintf(stderr, "  -h:              Display this help.\n");
+}
+
+static
+const char *op_name(unsigned op)
+{
+    switch ( op ) {
+        case STACHE_OP_STATUS:  return "status";
+        case STACHE_OP_CREATE:  return "create";
+        case STACHE_OP_ATTACH:  return "attach";
+        case STACHE_OP_DETACH:  return "detach";
+        case STACHE_OP_MIGRATE: return "migrate";
+        case STACHE_OP_REKEY:   return "rekey";
+        case STACHE_OP_STATS:   return "stats";
+        case STACHE_OP_TRACE:   return "trace";
+        case STACHE_OP_RECORD:  return "record";
+        case STACHE_OP_USAGE:   return "usage";
+        default:                return "unknown";
+    }
+}
+
+static
+int load_recording(const char *filename)
+{
+    struct record_file_header header;
+    struct record_entry entry;
+    struct stache_request *req = malloc(sizeof(*req));
+    size_t capacity = 0;
+    int ret = -1;
+    int rc;
+
+    FILE *file = fopen(filename, "rbe");
+    if ( file == NULL ) {
+        fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+        free(req);
+        return -1;
+    }
+
+    if ( req == NULL )
+        goto out;
+
+    if ( fread(&header, sizeof(header), 1, file) != 1 ||
+         memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) != 0 ) {
+        fprintf(stderr, "%s is not a stached recording.\n", filename);
+        goto out;
+    }
+
+    while ( (rc = record_read(file, &entry, req)) == 1 ) {
+        if ( nr_items == capacity ) {
+            size_t new_capacity = capacity ? capacity * 2 : 1024;
+            struct replay_item *new_items = realloc(items, new_capacity * sizeof(*items));
+            if ( new_items == NULL )
+                goto out;
+            items = new_items;
+            capacity = new_capacity;
+        }
+
+        struct replay_item *item = &items[nr_items];
+        item->entry = entry;
+        memcpy(item->contents_cipher, req->contents_cipher, sizeof(item->contents_cipher));
+        memcpy(item->filename_cipher, req->filename_cipher, sizeof(item->filename_cipher));
+        item->path = strdup(req->path);
+        if ( item->path == NULL )
+            goto out;
+        nr_items++;
+    }
+
+    if ( rc < 0 ) {
+        fprintf(stderr, "Truncated recording: %s\n", filename);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    fclose(file);
+    free(req);
+    return ret;
+}
+
+static
+void build_request(const struct replay_item *item, struct stache_request *req)
+{
+    const struct record_entry *entry = &item->entry;
+    const char *path = item->path;
+    size_t from_len = prefix_from ? strlen(prefix_from) : 0;
+
+    memset(req, 0, sizeof(*req));
+    req->version = STACHE_PROTOCOL_VERSION;
+    req->op = entry->op;
+    req->flags = entry->flags;
+    req->filename_padding = entry->filename_padding;
+    req->policy_version = entry->policy_version;
+    req->rate_limit = entry->rate_limit;
+    memcpy(req->key_descriptor, entry->key_descriptor, sizeof(req->key_descriptor));
+    memcpy(req->contents_cipher, item->contents_cipher, sizeof(req->contents_cipher));
+    memcpy(req->filename_cipher, item->filename_cipher, sizeof(req->filename_cipher));
+
+    if ( from_len && strncmp(path, prefix_from, from_len) == 0 )
+        snprintf(req->path, sizeof(req->path), "%s%s", prefix_to, path + from_len);
+    else
+        snprintf(req->path, sizeof(req->path), "%s", path);
+
+    // Secrets are never recorded: descriptor-passed ones are sent inline as well.
+    if ( entry->flags & (STACHE_REQ_SECRET_INLINE | STACHE_REQ_SECRET_FD) ) {
+        req->flags &= ~STACHE_REQ_SECRET_FD;
+        req->flags |= STACHE_REQ_SECRET_INLINE;
+        req->secret_size = secret_given ? secret_size : entry->secret_size;
+        if ( req->secret_size == 0 || req->secret_size > secret_size )
+            req->secret_size = secret_given ? secret_size : REPLAY_SECRET_SZ;
+    }
+}
+
+static
+void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000ULL,
+        .tv_nsec = deadline_ns % 1000000000ULL,
+    };
+
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+        ;
+}
+
+static
+void *replay_worker(void *arg)
+{
+    struct replay_worker *worker = arg;
+    struct stache_request *req = malloc(sizeof(*req));
+    struct stache_response *resp = malloc(sizeof(*resp));
+    uint32_t connection = 0;
+    int fd = -1;
+
+    if ( req == NULL || resp == NULL )
+        goto out;
+
+    for ( size_t i = 0; i < nr_items; i++ ) {
+        const struct replay_item *item = &items[i];
+
+        if ( item->entry.connection % nr_workers != worker->index )
+            continue;
+
+        // Connection boundaries are part of the load.
+        if ( fd != -1 && item->entry.connection != connection ) {
+            close(fd);
+            fd = -1;
+        }
+
+        build_request(item, req);
+
+        uint64_t due_ns = replay_started_ns;
+        if ( speed > 0 ) {
+            due_ns += (uint64_t) (item->entry.offset_ns / speed);
+            sleep_until(due_ns);
+        }
+        else
+            due_ns = stats_now();
+
+        if ( item->entry.timeout_ms != 0 )
+            req->deadline_ns = due_ns + item->entry.timeout_ms * 1000000ULL;
+
+        struct replay_result *result = &worker->results[req->op < REPLAY_MAX_OPS ? req->op : 0];
+
+        if ( fd == -1 ) {
+            fd = client_connect();
+            connection = item->entry.connection;
+        }
+
+        int passed_fd = (req->flags & STACHE_REQ_OUTPUT_FD) ? null_fd : -1;
+        if ( fd == -1 || client_transact(fd, req, secret, passed_fd, resp) < 0 ) {
+            result->failures++;
+            if ( fd != -1 ) {
+                close(fd);
+                fd = -1;
+            }
+            continue;
+        }
+
+        stats_histogram_add(&result->latency, stats_now() - due_ns);
+        if ( resp->status != 0 )
+            result->errors++;
+    }
+
+out:
+    if ( fd != -1 )
+        close(fd);
+    free(req);
+    free(resp);
+    return NULL;
+}
+
+static
+void print_results(const struct replay_result *results, double elapsed_s, bool json)
+{
+    struct replay_result total;
+    bool first = true;
+
+    memset(&total, 0, sizeof(total));
+    for ( unsigned op = 0; op < REPLAY_MAX_OPS; op++ ) {
+        stats_histogram_merge(&total.latency, &results[op].latency);
+        total.errors += results[op].errors;
+        total.failures += results[op].failures;
+    }
+
+    if ( json ) {
+        printf("{\"requests\": %llu, \"errors\": %llu, \"failures\": %llu, \"seconds\": %.3f, "
+               "\"throughput\": %.1f, \"ops\": {",
+               (unsigned long long) total.latency.count, total.errors, total.failures,
+               elapsed_s, elapsed_s > 0 ? total.latency.count / elapsed_s : 0);
+    }
+    else {
+        printf("%-10s %10s %8s %8s %10s %10s %10s %10s %10s\n",
+               "op", "count", "errors", "failed", "req/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    }
+
+    for ( unsigned op = 0; op <= REPLAY_MAX_OPS; op++ ) {
+        const struct replay_result *result = (op == REPLAY_MAX_OPS) ? &total : &results[op];
+        const char *name = (op == REPLAY_MAX_OPS) ? "total" : op_name(op);
+        const struct stats_histogram *latency = &result->latency;
+
+        if ( latency->count == 0 && result->failures == 0 )
+            continue;
+
+        if ( json ) {
+            if ( op == REPLAY_MAX_OPS )
+                break;
+            printf("%s\"%s\": {\"count\": %llu, \"errors\": %llu, \"failures\": %llu, "
+                   "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                   first ? "" : ", ", name,
+                   (unsigned long long) latency->count, result->errors, result->failures,
+                   (unsigned long long) stats_percentile(latency, 50),
+                   (unsigned long long) stats_percentile(latency, 99),
+                   (unsigned long long) stats_percentile(latency, 99.9),
+                   (unsigned long long) latency->max_ns);
+            first = false;
+            continue;
+        }
+
+        printf("%-10s %10llu %8llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               name, (unsigned long long) latency->count, result->errors, result->failures,
+               elapsed_s > 0 ? latency->count / elapsed_s : 0,
+               stats_percentile(latency, 50) / 1e3, stats_percentile(latency, 99) / 1e3,
+               stats_percentile(latency, 99.9) / 1e3, latency->max_ns / 1e3);
+    }
+
+    if ( json )
+        printf("}}\n");
+}
+
+static
+int load_secret(const char *filename)
+{
+    if ( filename != NULL ) {
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        ssize_t n = (fd == -1) ? -1 : read(fd, secret, sizeof(secret));
+        if ( fd != -1 )
+            close(fd);
+        if ( n <= 0 ) {
+            fprintf(stderr, "Cannot read the secret from %s\n", filename);
+            return -1;
+        }
+        secret_size = n;
+        secret_given = true;
+        return 0;
+    }
+
+    // Recorded sizes are kept, the bytes are random.
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 || read(fd, secret, sizeof(secret)) != sizeof(secret) ) {
+        fprintf(stderr, "Cannot read random bytes: %s\n", strerror(errno));
+        if ( fd != -1 )
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    secret_size = sizeof(secret);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = basename(argv[0]);
+    const char *secret_file = NULL;
+    struct replay_worker *workers = NULL;
+    bool json = false;
+    int ret = EXIT_FAILURE;
+    char *separator;
+    int c;
+
+    while ( (c = getopt(argc, argv, "x:c:r:s:jh")) != -1 ) {
+        switch ( c ) {
+            case 'x':
+                speed = strtod(optarg, NULL);
+                if ( speed < 0 ) {
+                    usage(program);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'c':
+                nr_workers = strtoul(optarg, NULL, 10);
+                if ( nr_workers == 0 ) {
+                    usage(program);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'r':
+                separator = strchr(optarg, '=');
+                if ( separator == NULL ) {
+                    usage(program);
+                    return EXIT_FAILURE;
+                }
+                *separator = '\0';
+                prefix_from = optarg;
+                prefix_to = separator + 1;
+                break;
+
+            case 's':
+                secret_file = optarg;
+                break;
+
+            case 'j':
+                json = true;
+                break;
+
+            case 'h':
+                usage(program);
+                return EXIT_SUCCESS;
+
+            default:
+                usage(program);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ( optind >= argc ) {
+        usage(program);
+        return EXIT_FAILURE;
+    }
+
+    if ( load_recording(argv[optind]) < 0 || load_secret(secret_file) < 0 )
+        goto out;
+
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    workers = calloc(nr_workers, sizeof(*workers));
+    if ( null_fd == -1 || workers == NULL )
+        goto out;
+
+    replay_started_ns = stats_now();
+    unsigned nr_started = 0;
+    for ( ; nr_started < nr_workers; nr_started++ ) {
+        workers[nr_started].index = nr_started;
+        if ( pthread_create(&workers[nr_started].thread, NULL, replay_worker, &workers[nr_started]) != 0 ) {
+            fprintf(stderr, "Cannot start worker %u\n", nr_started);
+            break;
+        }
+    }
+    for ( unsigned i = 0; i < nr_started; i++ )
+        pthread_join(workers[i].thread, NULL);
+
+    double elapsed_s = (stats_now() - replay_started_ns) / 1e9;
+    if ( nr_started < nr_workers )
+        goto out;
+
+    struct replay_result *results = calloc(REPLAY_MAX_OPS, sizeof(*results));
+    if ( results == NULL )
+        goto out;
+    for ( unsigned i = 0; i < nr_workers; i++ ) {
+        for ( unsigned op = 0; op < REPLAY_MAX_OPS; op++ ) {
+            stats_histogram_merge(&results[op].latency, &workers[i].results[op].latency);
+            results[op].errors += workers[i].results[op].errors;
+            results[op].failures += workers[i].results[op].failures;
+        }
+    }
+
+    print_results(results, elapsed_s, json);
+    free(results);
+    ret = EXIT_SUCCESS;
+
+out:
+    if ( null_fd != -1 )
+        close(null_fd);
+    for ( size_t i = 0; i < nr_items; i++ )
+        free(items[i].path);
+    free(items);
+    free(workers);
+    return ret;
+}
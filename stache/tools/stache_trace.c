@@ -0,0 +1,276 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <errno.h>
+#include <time.h>
+
+#include "stache.h"
+#include "protocol.h"
+
+/*
+ * Decodes a trace dumped by 'stache trace <file>'.
+ */
+
+struct summary {
+    uint16_t type;
+    uint16_t op;
+    unsigned long long count;
+    unsigned long long errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <trace file>\n", program);
+    fprintf(stderr, "Decodes a stached event trace.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s:              Summary per event instead of the event list.\n");
+    fprintf(stderr, "  -e:              Only events that failed.\n");
+    fprintf(stderr, "  -h:              Display this help.\n");
+}
+
+static
+const char *op_name(uint16_t op)
+{
+    switch ( op ) {
+        case STACHE_OP_STATUS:  return "status";
+        case STACHE_OP_CREATE:  return "create";
+        case STACHE_OP_ATTACH:  return "attach";
+        case STACHE_OP_DETACH:  return "detach";
+        case STACHE_OP_MIGRATE: return "migrate";
+        case STACHE_OP_REKEY:   return "rekey";
+        case STACHE_OP_STATS:   return "stats";
+        case STACHE_OP_TRACE:   return "trace";
+        case STACHE_OP_RECORD:  return "record";
+        case STACHE_OP_USAGE:   return "usage";
+        default:                return "unknown";
+    }
+}
+
+static
+const char *error_name(uint16_t op)
+{
+    switch ( op ) {
+        case TRACE_ERR_ACCEPT:  return "accept";
+        case TRACE_ERR_THREAD:  return "thread";
+        case TRACE_ERR_RECEIVE: return "receive";
+        case TRACE_ERR_SEND:    return "send";
+        case TRACE_ERR_RECORD:  return "record";
+        default:                return "unknown";
+    }
+}
+
+static
+void describe(const struct trace_event *event, const char **type, const char **name)
+{
+    switch ( event->type ) {
+        case TRACE_REQUEST:
+            *type = "request";
+            *name = op_name(event->op);
+            break;
+        case TRACE_PHASE:
+            *type = "phase";
+            *name = stats_phase_name(event->op);
+            break;
+        case TRACE_ERROR:
+            *type = "error";
+            *name = error_name(event->op);
+            break;
+        case TRACE_DISCONNECT:
+            *type = "disconnect";
+            *name = "-";
+            break;
+        case TRACE_CANCEL:
+            *type = "cancel";
+            *name = lane_name(event->op);
+            break;
+        default:
+            *type = "unknown";
+            *name = "-";
+            break;
+    }
+}
+
+static
+int compare_events(const void *a, const void *b)
+{
+    const struct trace_event *x = a, *y = b;
+    return (x->timestamp_ns > y->timestamp_ns) - (x->timestamp_ns < y->timestamp_ns);
+}
+
+static
+int compare_summaries(const void *a, const void *b)
+{
+    const struct summary *x = a, *y = b;
+    return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+static
+void print_event(const struct trace_file_header *header, const struct trace_event *event)
+{
+    // Monotonic timestamps are placed on the wall clock of the dump.
+    uint64_t wall_ns = header->realtime_ns - (header->monotonic_ns - event->timestamp_ns);
+    time_t seconds = wall_ns / 1000000000ULL;
+    struct tm tm;
+    char date[32];
+    const char *type, *name;
+
+    localtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%m-%d %H:%M:%S", &tm);
+    describe(event, &type, &name);
+
+    printf("%s.%06llu %6u %-10s %-12s %08x %10.1f us",
+           date, (unsigned long long) (wall_ns % 1000000000ULL) / 1000, event->tid,
+           type, name, event->hash, event->duration_ns / 1e3);
+    if ( event->error != 0 )
+        printf("  error: %s", strerror(event->error));
+    printf("\n");
+}
+
+static
+void print_summary(const struct trace_event *events, uint32_t nr_events, bool errors_only)
+{
+    struct summary *summaries = calloc(nr_events ? nr_events : 1, sizeof(*summaries));
+    unsigned nr_summaries = 0;
+
+    if ( summaries == NULL )
+        return;
+
+    for ( uint32_t i = 0; i < nr_events; i++ ) {
+        const struct trace_event *event = &events[i];
+        unsigned j;
+
+        if ( errors_only && event->error == 0 )
+            continue;
+
+        for ( j = 0; j < nr_summaries; j++ ) {
+            if ( summaries[j].type == event->type && summaries[j].op == event->op )
+                break;
+        }
+        if ( j == nr_summaries ) {
+            summaries[j].type = event->type;
+            summaries[j].op = event->op;
+            nr_summaries++;
+        }
+
+        summaries[j].count++;
+        summaries[j].errors += (event->error != 0);
+        summaries[j].total_ns += event->duration_ns;
+        if ( event->duration_ns > summaries[j].max_ns )
+            summaries[j].max_ns = event->duration_ns;
+    }
+
+    qsort(summaries, nr_summaries, sizeof(*summaries), compare_summaries);
+
+    printf("%-10s %-12s %10s %8s %12s %12s %12s\n",
+           "type", "event", "count", "errors", "total(ms)", "mean(us)", "max(us)");
+    for ( unsigned i = 0; i < nr_summaries; i++ ) {
+        struct trace_event key = { .type = summaries[i].type, .op = summaries[i].op };
+        const char *type, *name;
+
+        describe(&key, &type, &name);
+        printf("%-10s %-12s %10llu %8llu %12.1f %12.1f %12.1f\n",
+               type, name, summaries[i].count, summaries[i].errors,
+               summaries[i].total_ns / 1e6,
+               summaries[i].total_ns / 1e3 / summaries[i].count,
+               summaries[i].max_ns / 1e3);
+    }
+
+    free(summaries);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = basename(argv[0]);
+    struct trace_file_header header;
+    struct trace_event *events = NULL;
+    bool summary = false;
+    bool errors_only = false;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    while ( (c = getopt(argc, argv, "seh")) != -1 ) {
+        switch ( c ) {
+            case 's':
+                summary = true;
+                break;
+
+            case 'e':
+                errors_only = true;
+                break;
+
+            case 'h':
+                usage(program);
+                return EXIT_SUCCESS;
+
+            default:
+                usage(program);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ( optind >= argc ) {
+        usage(program);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[optind], "rbe");
+    if ( file == NULL ) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if ( fread(&header, sizeof(header), 1, file) != 1 ||
+         memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+         header.event_size != sizeof(struct trace_event) ) {
+        fprintf(stderr, "%s is not a stached trace.\n", argv[optind]);
+        goto out;
+    }
+
+    events = calloc(header.nr_events ? header.nr_events : 1, sizeof(*events));
+    if ( events == NULL || fread(events, sizeof(*events), header.nr_events, file) != header.nr_events ) {
+        fprintf(stderr, "Truncated trace: %s\n", argv[optind]);
+        goto out;
+    }
+
+    qsort(events, header.nr_events, sizeof(*events), compare_events);
+
+    if ( summary )
+        print_summary(events, header.nr_events, errors_only);
+    else {
+        for ( uint32_t i = 0; i < header.nr_events; i++ ) {
+            if ( !errors_only || events[i].error != 0 )
+                print_event(&header, &events[i]);
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+out:
+    free(events);
+    fclose(file);
+    return ret;
+}
@@ -0,0 +1,216 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "stache.h"
+
+//
+// The owner thread fills the slot, then publishes it by moving _head_ with
+// release semantics. A reader copies the ring and then drops whatever the
+// writer may have overwritten meanwhile. Rings of exited threads are reused.
+//
+struct trace_ring {
+    struct trace_ring *next;            // all rings
+    struct trace_ring *next_free;
+    uint32_t tid;
+    atomic_uint_fast64_t head;          // number of events ever written
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings = NULL;
+static struct trace_ring *trace_free_rings = NULL;
+static atomic_bool trace_enabled = true;
+// Cached copy of the thread specific value, which only serves the destructor.
+static __thread struct trace_ring *local_ring;
+
+static
+void release_ring(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    pthread_mutex_lock(&trace_lock);
+    ring->next_free = trace_free_rings;
+    trace_free_rings = ring;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static
+void trace_init()
+{
+    pthread_key_create(&trace_key, release_ring);
+}
+
+static
+struct trace_ring *thread_ring()
+{
+    if ( local_ring != NULL )
+        return local_ring;
+
+    pthread_once(&trace_once, trace_init);
+
+    struct trace_ring *ring;
+
+    pthread_mutex_lock(&trace_lock);
+    ring = trace_free_rings;
+    if ( ring != NULL )
+        trace_free_rings = ring->next_free;
+    else if ( (ring = calloc(1, sizeof(*ring))) != NULL ) {
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if ( ring != NULL ) {
+        ring->tid = syscall(SYS_gettid);
+        pthread_setspecific(trace_key, ring);
+        local_ring = ring;
+    }
+    return ring;
+}
+
+void trace_set_enabled(bool enabled)
+{
+    atomic_store(&trace_enabled, enabled);
+}
+
+//
+// Preserves errno, like stats_record().
+//
+void trace_record(uint16_t type, uint16_t op, uint32_t hash, int32_t error, uint64_t duration_ns)
+{
+    if ( !atomic_load_explicit(&trace_enabled, memory_order_relaxed) )
+        return;
+
+    struct trace_ring *ring = local_ring;
+    if ( ring == NULL ) {
+        int saved_errno = errno;
+        ring = thread_ring();
+        errno = saved_errno;
+        if ( ring == NULL )
+            return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_event *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+    event->timestamp_ns = stats_now();
+    event->duration_ns = duration_ns;
+    event->hash = hash;
+    event->error = error;
+    event->type = type;
+    event->op = op;
+    event->tid = ring->tid;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+//
+// FNV-1a, enough to tell directories and keys apart without recording them.
+//
+uint32_t trace_hash(const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261u;
+
+    for ( size_t i = 0; i < size; i++ ) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t trace_hash_string(const char *string)
+{
+    return trace_hash(string, strlen(string));
+}
+
+//
+// Copies the stable events of a ring into _out_, returns their count.
+//
+static
+unsigned snapshot_ring(struct trace_ring *ring, struct trace_event *out)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for ( uint64_t i = first; i < head; i++ )
+        out[i - first] = ring->events[i & (TRACE_RING_SIZE - 1)];
+
+    // Slots the writer reached while copying, the one in flight included, may be torn.
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t new_head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t safe_from = new_head + 1 > TRACE_RING_SIZE ? new_head + 1 - TRACE_RING_SIZE : 0;
+    if ( safe_from <= first )
+        return head - first;
+    if ( safe_from >= head )
+        return 0;
+
+    memmove(out, out + (safe_from - first), (head - safe_from) * sizeof(*out));
+    return head - safe_from;
+}
+
+int trace_dump(int fd)
+{
+    struct trace_file_header header;
+    struct timespec realtime;
+    struct trace_event *events = NULL;
+    unsigned nr_rings = 0, total = 0;
+    int ret = -1;
+
+    pthread_once(&trace_once, trace_init);
+
+    pthread_mutex_lock(&trace_lock);
+    for ( struct trace_ring *ring = trace_rings; ring; ring = ring->next )
+        nr_rings++;
+
+    events = malloc((size_t) (nr_rings ? nr_rings : 1) * TRACE_RING_SIZE * sizeof(*events));
+    if ( events != NULL ) {
+        for ( struct trace_ring *ring = trace_rings; ring; ring = ring->next )
+            total += snapshot_ring(ring, events + total);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if ( events == NULL )
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.event_size = sizeof(struct trace_event);
+    header.nr_events = total;
+    header.realtime_ns = (uint64_t) realtime.tv_sec * 1000000000ULL + realtime.tv_nsec;
+    header.monotonic_ns = stats_now();
+
+    size_t size = total * sizeof(*events);
+    if ( write(fd, &header, sizeof(header)) == sizeof(header) &&
+         write(fd, events, size) == (ssize_t) size )
+        ret = total;
+
+    free(events);
+    return ret;
+}
@@ -0,0 +1,87 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary event trace of the daemon.
+ *
+ * Events are fixed-size records written by each thread into its own ring,
+ * without formatting or locking, so that tracing can stay on in production.
+ * A dump collects the rings into a file decoded offline by stache_trace.
+ */
+
+#define TRACE_MAGIC "STTRACE1"
+#define TRACE_RING_SIZE 1024            // events per thread, a power of two
+
+enum trace_event_type {
+    TRACE_REQUEST = 1,      // op: enum stache_op, duration: whole request
+    TRACE_PHASE,            // op: enum stats_phase
+    TRACE_ERROR,            // op: enum trace_error
+    TRACE_DISCONNECT,       // duration: whole connection
+    TRACE_CANCEL,           // op: enum work_lane, duration: time spent queued
+};
+
+enum trace_error {
+    TRACE_ERR_ACCEPT = 1,
+    TRACE_ERR_THREAD,
+    TRACE_ERR_RECEIVE,
+    TRACE_ERR_SEND,
+    TRACE_ERR_RECORD,
+};
+
+struct trace_event {
+    uint64_t timestamp_ns;      // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    uint32_t hash;              // of the directory path or key descriptor, 0 if none
+    int32_t error;              // errno, 0 on success
+    uint16_t type;
+    uint16_t op;
+    uint32_t tid;
+} __attribute__((__packed__));
+
+struct trace_file_header {
+    char magic[8];
+    uint32_t event_size;
+    uint32_t nr_events;
+    uint64_t realtime_ns;       // wall clock at dump time
+    uint64_t monotonic_ns;      // monotonic clock at dump time
+} __attribute__((__packed__));
+
+void trace_set_enabled(bool enabled);
+void trace_record(uint16_t type, uint16_t op, uint32_t hash, int32_t error, uint64_t duration_ns);
+uint32_t trace_hash(const void *data, size_t size);
+uint32_t trace_hash_string(const char *string);
+
+// Records a phase both in the statistics and in the trace.
+static inline void trace_phase(enum stats_phase phase, uint64_t started_ns, uint32_t hash, int error)
+{
+    uint64_t duration_ns = stats_now() - started_ns;
+
+    stats_record(phase, duration_ns);
+    trace_record(TRACE_PHASE, phase, hash, error, duration_ns);
+}
+
+// Writes all the rings to _fd_. Returns the number of events written, or -1.
+int trace_dump(int fd);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,931 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "stache.h"
+
+#define USAGE_HASH_SIZE 4096
+#define USAGE_EVENT_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | \
+                          IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define USAGE_EVENT_BUFFER_SZ 16384
+
+struct usage_container;
+
+struct usage_dir {
+    int wd;
+    struct usage_container *container;
+    uint64_t bytes;                 // of its direct entries
+    uint64_t inodes;
+    bool dirty;
+    bool fresh;                     // created since the walk, its subdirectories may be unwatched
+    struct usage_dir *next;         // in its hash bucket
+    struct usage_dir *next_dirty;
+    char path[];
+};
+
+struct usage_container {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    struct usage_record usage;      // maintained by the tracker thread
+    struct usage_record published;  // what readers get, never a walk in progress
+    bool changed;                   // since the last flush
+    bool needs_reconcile;
+    uint64_t reconcile_started_ns;
+};
+
+// Guards everything below. Only the tracker thread and its walkers change the
+// directories; the containers are also added to by usage_track().
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usage_container *containers[USAGE_MAX_CONTAINERS];
+static unsigned nr_containers;
+static struct usage_dir *dirs[USAGE_HASH_SIZE];
+static struct usage_dir *dirty_dirs;
+static uint64_t dirty_since_ns;
+static bool watches_exhausted;
+
+static int inotify_fd = -1;
+static int wake_fd = -1;
+static pthread_t tracker;
+static atomic_bool stopping;               // the state is being handed over
+
+// Entries of the directory being read by a walker thread.
+static __thread uint64_t walk_bytes;
+static __thread uint64_t walk_inodes;
+
+static
+struct usage_dir *find_dir(int wd)
+{
+    for ( struct usage_dir *dir = dirs[wd % USAGE_HASH_SIZE]; dir; dir = dir->next ) {
+        if ( dir->wd == wd )
+            return dir;
+    }
+
+    return NULL;
+}
+
+//
+// Replaces the totals of a directory, adjusting its container by the difference.
+//
+static
+void set_dir_totals(struct usage_dir *dir, uint64_t bytes, uint64_t inodes)
+{
+    struct usage_record *usage = &dir->container->usage;
+
+    if ( dir->bytes == bytes && dir->inodes == inodes )
+        return;
+
+    usage->bytes += bytes - dir->bytes;
+    usage->inodes += inodes - dir->inodes;
+    usage->updated_at = time(NULL);
+    dir->bytes = bytes;
+    dir->inodes = inodes;
+    dir->container->changed = true;
+}
+
+//
+// Forgets a directory and what it held. _unwatch_ is false when the kernel
+// already dropped the watch.
+//
+static
+void remove_dir(struct usage_dir *dir, bool unwatch)
+{
+    struct usage_dir **link;
+
+    set_dir_totals(dir, 0, 0);
+
+    for ( link = &dirs[dir->wd % USAGE_HASH_SIZE]; *link != dir; link = &(*link)->next )
+        ;
+    *link = dir->next;
+
+    if ( dir->dirty ) {
+        for ( link = &dirty_dirs; *link != dir; link = &(*link)->next_dirty )
+            ;
+        *link = dir->next_dirty;
+    }
+
+    if ( unwatch )
+        inotify_rm_watch(inotify_fd, dir->wd);
+    free(dir);
+}
+
+//
+// Watches a directory of _container_ and returns its record, new or existing.
+//
+static
+struct usage_dir *watch_directory(struct usage_container *container, const char *path)
+{
+    int wd = inotify_add_watch(inotify_fd, path, USAGE_EVENT_MASK);
+    if ( wd == -1 ) {
+        if ( errno == ENOSPC && !watches_exhausted ) {
+            fprintf(stderr, "Out of inotify watches: usage of large containers is only updated by full walks.\n");
+            watches_exhausted = true;
+        }
+        return NULL;
+    }
+
+    struct usage_dir *dir = find_dir(wd);
+    if ( dir != NULL ) {
+        if ( dir->container == container && strcmp(dir->path, path) == 0 )
+            return dir;
+
+        // The same directory under another name: start over.
+        remove_dir(dir, false);
+    }
+
+    size_t len = strlen(path);
+    dir = calloc(1, sizeof(*dir) + len + 1);
+    if ( dir == NULL ) {
+        inotify_rm_watch(inotify_fd, wd);
+        return NULL;
+    }
+
+    dir->wd = wd;
+    dir->container = container;
+    memcpy(dir->path, path, len + 1);
+    dir->next = dirs[wd % USAGE_HASH_SIZE];
+    dirs[wd % USAGE_HASH_SIZE] = dir;
+    return dir;
+}
+
+static
+void mark_dirty(struct usage_dir *dir, uint64_t now_ns)
+{
+    if ( dir->dirty )
+        return;
+
+    dir->dirty = true;
+    dir->next_dirty = dirty_dirs;
+    dirty_dirs = dir;
+    if ( dirty_since_ns == 0 )
+        dirty_since_ns = now_ns;
+}
+
+//
+// Watches _name_, a new subdirectory of _parent_, and has it scanned. Its own
+// subdirectories may predate the watch, so the scan watches those in turn.
+// Called with usage_lock held.
+//
+static
+void watch_new_directory(struct usage_container *container, const char *parent,
+                         const char *name, uint64_t now_ns)
+{
+    char path[PATH_MAX];
+
+    // A truncated path would watch some other directory: leave it to the next walk.
+    if ( (size_t) snprintf(path, sizeof(path), "%s/%s", parent, name) >= sizeof(path) )
+        return;
+
+    struct usage_dir *child = watch_directory(container, path);
+    if ( child != NULL ) {
+        child->fresh = true;
+        mark_dirty(child, now_ns);
+    }
+}
+
+//
+// Sums the space and inodes of the direct entries of a watched directory, and
+// watches the subdirectories of a fresh one.
+//
+static
+int scan_directory(struct usage_dir *watched, uint64_t now_ns, uint64_t *bytes, uint64_t *inodes)
+{
+    struct dirent *entry;
+    struct stat st;
+
+    int fd = open(watched->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+    if ( dir == NULL ) {
+        if ( fd != -1 )
+            close(fd);
+        return -1;
+    }
+
+    *bytes = *inodes = 0;
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+            continue;
+
+        if ( fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 ) {
+            *bytes += (uint64_t) st.st_blocks * 512;
+            (*inodes)++;
+
+            if ( watched->fresh && S_ISDIR(st.st_mode) ) {
+                pthread_mutex_lock(&usage_lock);
+                watch_new_directory(watched->container, watched->path, entry->d_name, now_ns);
+                pthread_mutex_unlock(&usage_lock);
+            }
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static
+void reconcile_thread_start(struct tree_walk UNUSED *walk)
+{
+    walk_set_io_priority(IOPRIO_CLASS_IDLE, 0);
+    placement_apply(WORK_SCAN);
+}
+
+static
+int reconcile_entry(struct tree_walk UNUSED *walk, int dirfd, const char *name,
+                    const char UNUSED *path, unsigned char UNUSED d_type)
+{
+    struct stat st;
+
+    if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 ) {
+        walk_bytes += (uint64_t) st.st_blocks * 512;
+        walk_inodes++;
+    }
+
+    return 0;
+}
+
+//
+// Watches a directory once it was read. Changes made while it was being read
+// are missed until the next walk.
+//
+static
+void reconcile_directory(struct tree_walk *walk, int UNUSED dirfd, const char *path)
+{
+    struct usage_container *container = walk->arg;
+    char full_path[PATH_MAX];
+    int length;
+
+    if ( strcmp(path, ".") == 0 )
+        length = snprintf(full_path, sizeof(full_path), "%s", container->path);
+    else
+        length = snprintf(full_path, sizeof(full_path), "%s/%s", container->path, path);
+
+    // A truncated path would watch some other directory: go without a watch.
+    bool too_long = ((size_t) length >= sizeof(full_path));
+    if ( too_long )
+        fprintf(stderr, "Cannot watch %s/%s: path is too long.\n", container->path, path);
+
+    pthread_mutex_lock(&usage_lock);
+    struct usage_dir *dir = too_long ? NULL : watch_directory(container, full_path);
+    if ( dir != NULL )
+        set_dir_totals(dir, walk_bytes, walk_inodes);
+    else {
+        // Counted, but only refreshed by the next walk.
+        container->usage.bytes += walk_bytes;
+        container->usage.inodes += walk_inodes;
+    }
+    pthread_mutex_unlock(&usage_lock);
+
+    walk_bytes = walk_inodes = 0;
+}
+
+//
+// Drops the watches of a container. Called with usage_lock held.
+//
+static
+void forget_directories(struct usage_container *container)
+{
+    for ( unsigned i = 0; i < USAGE_HASH_SIZE; i++ ) {
+        struct usage_dir *dir = dirs[i];
+        while ( dir ) {
+            struct usage_dir *next = dir->next;
+            if ( dir->container == container )
+                remove_dir(dir, true);
+            dir = next;
+        }
+    }
+}
+
+//
+// Rebuilds the totals and watches of a container with a parallel walk.
+//
+static
+void reconcile(struct usage_container *container, uint64_t now_ns)
+{
+    struct tree_walk walk = {
+        .nr_threads = USAGE_WALK_THREADS,
+        .on_entry = reconcile_entry,
+        .on_thread_start = reconcile_thread_start,
+        .on_directory_done = reconcile_directory,
+        .arg = container,
+        .cancel = &stopping,
+    };
+    struct stat st;
+
+    pthread_mutex_lock(&usage_lock);
+    forget_directories(container);
+    container->usage.bytes = 0;
+    container->usage.inodes = 0;
+    container->needs_reconcile = false;
+    container->reconcile_started_ns = now_ns;
+    pthread_mutex_unlock(&usage_lock);
+
+    int ret = tree_walk(container->path, &walk);
+
+    pthread_mutex_lock(&usage_lock);
+    if ( ret == 0 && stat(container->path, &st) == 0 ) {
+        container->dev = st.st_dev;
+        container->ino = st.st_ino;
+        container->usage.version = USAGE_RECORD_VERSION;
+        container->usage.updated_at = container->usage.reconciled_at = time(NULL);
+        container->changed = true;
+    }
+    else {
+        // Keep what was known: the partial totals of a failed walk mean nothing.
+        forget_directories(container);
+        container->usage = container->published;
+        if ( atomic_load(&stopping) )
+            container->needs_reconcile = true;
+        else
+            fprintf(stderr, "Cannot measure the usage of %s: %s\n", container->path, strerror(walk.error));
+    }
+    pthread_mutex_unlock(&usage_lock);
+}
+
+static
+void handle_event(const struct inotify_event *event, uint64_t now_ns)
+{
+    if ( event->mask & IN_Q_OVERFLOW ) {
+        for ( unsigned i = 0; i < nr_containers; i++ )
+            containers[i]->needs_reconcile = true;
+        return;
+    }
+
+    struct usage_dir *dir = find_dir(event->wd);
+    if ( dir == NULL )
+        return;
+
+    struct usage_container *container = dir->container;
+
+    if ( event->mask & IN_IGNORED ) {
+        // The container itself went away, or was replaced by a migration.
+        if ( strcmp(dir->path, container->path) == 0 )
+            container->needs_reconcile = true;
+        remove_dir(dir, false);
+        return;
+    }
+
+    // Events about the directory itself do not change its entries.
+    if ( event->len == 0 )
+        return;
+
+    if ( event->mask & IN_ISDIR ) {
+        if ( event->mask & (IN_MOVED_FROM | IN_MOVED_TO) ) {
+            // A whole tree came or went, or paths we know changed.
+            container->needs_reconcile = true;
+        }
+        else if ( event->mask & IN_CREATE )
+            watch_new_directory(container, dir->path, event->name, now_ns);
+    }
+
+    mark_dirty(dir, now_ns);
+}
+
+static
+void read_events(char *buf)
+{
+    ssize_t n;
+
+    while ( (n = read(inotify_fd, buf, USAGE_EVENT_BUFFER_SZ)) > 0 ) {
+        uint64_t now_ns = stats_now();
+
+        pthread_mutex_lock(&usage_lock);
+        for ( ssize_t offset = 0; offset < n; ) {
+            const struct inotify_event *event = (const struct inotify_event *) (buf + offset);
+            handle_event(event, now_ns);
+            offset += sizeof(*event) + event->len;
+        }
+        pthread_mutex_unlock(&usage_lock);
+    }
+}
+
+//
+// Rescans the directories that changed, new subdirectories of fresh ones
+// included. Only this thread removes directories, so the one being read
+// stays valid without the lock.
+//
+static
+void process_dirty()
+{
+    uint64_t now_ns = stats_now();
+
+    while ( true ) {
+        uint64_t bytes, inodes;
+
+        pthread_mutex_lock(&usage_lock);
+        struct usage_dir *dir = dirty_dirs;
+        if ( dir == NULL ) {
+            dirty_since_ns = 0;
+            pthread_mutex_unlock(&usage_lock);
+            break;
+        }
+        dirty_dirs = dir->next_dirty;
+        dir->dirty = false;
+        pthread_mutex_unlock(&usage_lock);
+
+        int ret = scan_directory(dir, now_ns, &bytes, &inodes);
+
+        pthread_mutex_lock(&usage_lock);
+        dir->fresh = false;
+        if ( ret == 0 )
+            set_dir_totals(dir, bytes, inodes);
+        else if ( errno != ENOENT )
+            dir->container->needs_reconcile = true;
+        // Removed directories get IN_IGNORED, which drops them.
+        pthread_mutex_unlock(&usage_lock);
+    }
+}
+
+static
+void flush_usage(struct usage_container *container)
+{
+    struct usage_record usage;
+
+    pthread_mutex_lock(&usage_lock);
+    usage = container->published;
+    container->changed = false;
+    pthread_mutex_unlock(&usage_lock);
+
+    int fd = open(container->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( fd == -1 || metadata_set_usage(fd, &usage) < 0 )
+        fprintf(stderr, "Cannot save the usage of %s: %s\n", container->path, strerror(errno));
+    if ( fd != -1 )
+        close(fd);
+}
+
+static
+void *usage_thread(void UNUSED *arg)
+{
+    char *buf = malloc(USAGE_EVENT_BUFFER_SZ);
+    uint64_t last_flush_ns = stats_now();
+
+    if ( buf == NULL )
+        return NULL;
+
+    walk_set_io_priority(IOPRIO_CLASS_IDLE, 0);
+    placement_apply(WORK_SCAN);
+
+    while ( !atomic_load(&stopping) ) {
+        struct pollfd fds[2] = {
+            { .fd = inotify_fd, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+        };
+        uint64_t value;
+
+        poll(fds, 2, dirty_dirs ? USAGE_RESCAN_DELAY_MS : 1000);
+        if ( fds[1].revents & POLLIN )
+            read(wake_fd, &value, sizeof(value));
+        if ( fds[0].revents & POLLIN )
+            read_events(buf);
+
+        uint64_t now_ns = stats_now();
+        if ( dirty_dirs && now_ns - dirty_since_ns >= USAGE_RESCAN_DELAY_MS * 1000000ULL )
+            process_dirty();
+
+        pthread_mutex_lock(&usage_lock);
+        unsigned count = nr_containers;
+        pthread_mutex_unlock(&usage_lock);
+
+        for ( unsigned i = 0; i < count && !atomic_load(&stopping); i++ ) {
+            struct usage_container *container = containers[i];
+
+            if ( container->needs_reconcile ||
+                 now_ns - container->reconcile_started_ns >= USAGE_RECONCILE_INTERVAL_S * 1000000000ULL )
+                reconcile(container, now_ns);
+
+            pthread_mutex_lock(&usage_lock);
+            if ( container->usage.version != 0 )
+                container->published = container->usage;
+            pthread_mutex_unlock(&usage_lock);
+        }
+
+        if ( now_ns - last_flush_ns >= USAGE_FLUSH_INTERVAL_S * 1000000000ULL ) {
+            for ( unsigned i = 0; i < count; i++ ) {
+                if ( containers[i]->changed && containers[i]->published.version != 0 )
+                    flush_usage(containers[i]);
+            }
+            last_flush_ns = now_ns;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int usage_track(const char *path)
+{
+    struct usage_container *container = NULL;
+    char real_path[PATH_MAX];
+    struct stat st;
+
+    // Without the tracker, as in the command line tool, metadata is all there is.
+    if ( inotify_fd == -1 )
+        return 0;
+
+    if ( realpath(path, real_path) == NULL || stat(real_path, &st) != 0 )
+        return -1;
+
+    pthread_mutex_lock(&usage_lock);
+    for ( unsigned i = 0; i < nr_containers; i++ ) {
+        if ( strcmp(containers[i]->path, real_path) == 0 ) {
+            container = containers[i];
+            break;
+        }
+    }
+
+    if ( container != NULL ) {
+        // Same path, new directory: it was migrated or rekeyed.
+        if ( container->dev != st.st_dev || container->ino != st.st_ino )
+            container->needs_reconcile = true;
+    }
+    else if ( nr_containers < USAGE_MAX_CONTAINERS && (container = calloc(1, sizeof(*container))) != NULL ) {
+        snprintf(container->path, sizeof(container->path), "%s", real_path);
+        container->dev = st.st_dev;
+        container->ino = st.st_ino;
+        container->needs_reconcile = true;
+
+        int fd = open(real_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ( fd != -1 ) {
+            if ( metadata_get_usage(fd, &container->published) == 0 )
+                container->usage = container->published;
+            close(fd);
+        }
+
+        containers[nr_containers++] = container;
+    }
+    pthread_mutex_unlock(&usage_lock);
+
+    if ( container == NULL ) {
+        fprintf(stderr, "Cannot track the usage of %s: too many containers.\n", real_path);
+        return -1;
+    }
+
+    uint64_t value = 1;
+    write(wake_fd, &value, sizeof(value));
+    return 0;
+}
+
+//
+// Tracks the containers found directly under _data_dir_.
+//
+static
+void track_containers(const char *data_dir)
+{
+    struct dirent *entry;
+
+    DIR *dir = opendir(data_dir);
+    if ( dir != NULL ) {
+        while ( (entry = readdir(dir)) != NULL ) {
+            char path[PATH_MAX];
+            struct stache_policy policy;
+            const struct crypt_backend *backend;
+            bool has_policy = false;
+
+            if ( entry->d_name[0] == '.' || entry->d_type != DT_DIR )
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", data_dir, entry->d_name);
+            int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if ( fd == -1 )
+                continue;
+
+            if ( backend_get_policy(fd, &policy, &has_policy, &backend) == 0 && has_policy )
+                usage_track(path);
+            close(fd);
+        }
+        closedir(dir);
+    }
+}
+
+int usage_start(const char *data_dir)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( inotify_fd == -1 || wake_fd == -1 ) {
+        fprintf(stderr, "Cannot set up usage tracking: %s\n", strerror(errno));
+        goto error;
+    }
+
+    track_containers(data_dir);
+
+    // Joinable, for the handover to stop it.
+    int err = pthread_create(&tracker, NULL, usage_thread, NULL);
+    if ( err == 0 )
+        return 0;
+
+    fprintf(stderr, "Cannot start usage tracking: %s\n", strerror(err));
+
+error:
+    if ( inotify_fd != -1 )
+        close(inotify_fd);
+    if ( wake_fd != -1 )
+        close(wake_fd);
+    inotify_fd = wake_fd = -1;
+    return -1;
+}
+
+struct saved_container {
+    uint64_t dev;
+    uint64_t ino;
+    struct usage_record usage;
+    struct usage_record published;
+    uint64_t reconcile_started_ns;  // CLOCK_MONOTONIC is shared by both daemons
+    uint8_t changed;
+    uint8_t needs_reconcile;
+    uint16_t path_size;
+    // followed by the path, unterminated
+} __attribute__((__packed__));
+
+struct saved_dir {
+    int32_t wd;
+    uint32_t container;             // index in the saved containers
+    uint64_t bytes;
+    uint64_t inodes;
+    uint8_t dirty;
+    uint16_t path_size;
+    // followed by the path, unterminated
+} __attribute__((__packed__));
+
+static
+unsigned container_index(const struct usage_container *container)
+{
+    unsigned i = 0;
+
+    while ( containers[i] != container )
+        i++;
+
+    return i;
+}
+
+//
+// Writes the containers and watched directories. Called with usage_lock held.
+//
+static
+void write_state(FILE *out)
+{
+    uint32_t count = nr_containers;
+
+    fwrite(&count, sizeof(count), 1, out);
+    for ( unsigned i = 0; i < nr_containers; i++ ) {
+        const struct usage_container *container = containers[i];
+        struct saved_container saved = {
+            .dev = container->dev,
+            .ino = container->ino,
+            .usage = container->usage,
+            .published = container->published,
+            .reconcile_started_ns = container->reconcile_started_ns,
+            .changed = container->changed,
+            .needs_reconcile = container->needs_reconcile,
+            .path_size = strlen(container->path),
+        };
+
+        fwrite(&saved, sizeof(saved), 1, out);
+        fwrite(container->path, saved.path_size, 1, out);
+    }
+
+    count = 0;
+    for ( unsigned i = 0; i < USAGE_HASH_SIZE; i++ ) {
+        for ( struct usage_dir *dir = dirs[i]; dir; dir = dir->next )
+            count++;
+    }
+
+    fwrite(&count, sizeof(count), 1, out);
+    for ( unsigned i = 0; i < USAGE_HASH_SIZE; i++ ) {
+        for ( struct usage_dir *dir = dirs[i]; dir; dir = dir->next ) {
+            struct saved_dir saved = {
+                .wd = dir->wd,
+                .container = container_index(dir->container),
+                .bytes = dir->bytes,
+                .inodes = dir->inodes,
+                .dirty = dir->dirty,
+                .path_size = strlen(dir->path),
+            };
+
+            fwrite(&saved, sizeof(saved), 1, out);
+            fwrite(dir->path, saved.path_size, 1, out);
+        }
+    }
+}
+
+//
+// Rebuilds the containers and watched directories saved by a predecessor.
+//
+static
+int read_state(struct handover_reader *section)
+{
+    uint32_t count;
+    uint64_t now_ns = stats_now();
+
+    if ( handover_read(section, &count, sizeof(count)) < 0 || count > USAGE_MAX_CONTAINERS )
+        return -1;
+
+    for ( uint32_t i = 0; i < count; i++ ) {
+        struct saved_container saved;
+        struct usage_container *container;
+
+        if ( handover_read(section, &saved, sizeof(saved)) < 0 || saved.path_size >= PATH_MAX )
+            return -1;
+        if ( (container = calloc(1, sizeof(*container))) == NULL )
+            return -1;
+        containers[nr_containers++] = container;
+
+        if ( handover_read(section, container->path, saved.path_size) < 0 )
+            return -1;
+        container->dev = saved.dev;
+        container->ino = saved.ino;
+        container->usage = saved.usage;
+        container->published = saved.published;
+        container->reconcile_started_ns = saved.reconcile_started_ns;
+        container->changed = saved.changed;
+        container->needs_reconcile = saved.needs_reconcile;
+    }
+
+    if ( handover_read(section, &count, sizeof(count)) < 0 )
+        return -1;
+
+    for ( uint32_t i = 0; i < count; i++ ) {
+        struct saved_dir saved;
+
+        if ( handover_read(section, &saved, sizeof(saved)) < 0 || saved.path_size >= PATH_MAX ||
+             saved.container >= nr_containers || saved.wd < 0 )
+            return -1;
+
+        struct usage_dir *dir = calloc(1, sizeof(*dir) + saved.path_size + 1);
+        if ( dir == NULL )
+            return -1;
+
+        dir->wd = saved.wd;
+        dir->container = containers[saved.container];
+        dir->bytes = saved.bytes;
+        dir->inodes = saved.inodes;
+        dir->next = dirs[dir->wd % USAGE_HASH_SIZE];
+        dirs[dir->wd % USAGE_HASH_SIZE] = dir;
+
+        if ( handover_read(section, dir->path, saved.path_size) < 0 )
+            return -1;
+        if ( saved.dirty )
+            mark_dirty(dir, now_ns);
+    }
+
+    return 0;
+}
+
+int usage_save(FILE *out, int *inotify)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    uint64_t value = 1;
+
+    *inotify = -1;
+    if ( inotify_fd == -1 )
+        return 0;
+
+    // Events not read yet stay queued on the inotify descriptor, for the successor.
+    atomic_store(&stopping, true);
+    write(wake_fd, &value, sizeof(value));
+    pthread_join(tracker, NULL);
+
+    FILE *section = open_memstream(&buf, &size);
+    if ( section == NULL )
+        return -1;
+
+    pthread_mutex_lock(&usage_lock);
+    write_state(section);
+    pthread_mutex_unlock(&usage_lock);
+
+    bool failed = ferror(section);
+    if ( fclose(section) != 0 || failed ) {
+        free(buf);
+        return -1;
+    }
+
+    int ret = handover_write_section(out, HANDOVER_SECTION_USAGE, buf, size);
+    free(buf);
+    if ( ret == 0 )
+        *inotify = inotify_fd;
+    return ret;
+}
+
+int usage_resume(const char *data_dir, int inotify, struct handover_reader *section)
+{
+    inotify_fd = inotify;
+    atomic_store(&stopping, false);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( wake_fd == -1 ) {
+        fprintf(stderr, "Cannot set up usage tracking: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if ( read_state(section) < 0 ) {
+        fprintf(stderr, "Cannot resume usage tracking: malformed state.\n");
+        goto error;
+    }
+
+    // Picks up containers created while the predecessor was draining.
+    track_containers(data_dir);
+
+    int err = pthread_create(&tracker, NULL, usage_thread, NULL);
+    if ( err == 0 )
+        return 0;
+
+    fprintf(stderr, "Cannot start usage tracking: %s\n", strerror(err));
+
+error:
+    for ( unsigned i = 0; i < USAGE_HASH_SIZE; i++ ) {
+        while ( dirs[i] ) {
+            struct usage_dir *next = dirs[i]->next;
+            free(dirs[i]);
+            dirs[i] = next;
+        }
+    }
+    dirty_dirs = NULL;
+    dirty_since_ns = 0;
+    while ( nr_containers > 0 )
+        free(containers[--nr_containers]);
+
+    close(inotify_fd);
+    if ( wake_fd != -1 )
+        close(wake_fd);
+    inotify_fd = wake_fd = -1;
+    return -1;
+}
+
+int usage_get(int dirfd, struct usage_record *usage, bool *live)
+{
+    struct stat st;
+
+    *live = false;
+    if ( inotify_fd != -1 && fstat(dirfd, &st) == 0 ) {
+        pthread_mutex_lock(&usage_lock);
+        for ( unsigned i = 0; i < nr_containers; i++ ) {
+            struct usage_container *container = containers[i];
+
+            if ( container->dev == st.st_dev && container->ino == st.st_ino && container->published.version != 0 ) {
+                *usage = container->published;
+                *live = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&usage_lock);
+
+        if ( *live )
+            return 0;
+    }
+
+    return metadata_get_usage(dirfd, usage);
+}
+
+static
+void print_time(FILE *out, uint64_t seconds)
+{
+    time_t t = seconds;
+    struct tm tm;
+    char date[32];
+
+    localtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s", date);
+}
+
+void usage_print(const struct usage_record *usage, bool live, FILE *out)
+{
+    fprintf(out, "Disk usage:       %.1f MiB in %llu inodes\n",
+            usage->bytes / 1048576.0, (unsigned long long) usage->inodes);
+    fprintf(out, "Usage updated:    ");
+    print_time(out, usage->updated_at);
+    fprintf(out, live ? " (tracked)\n" : " (saved)\n");
+    fprintf(out, "Last full scan:   ");
+    if ( usage->reconciled_at != 0 )
+        print_time(out, usage->reconciled_at);
+    else
+        fprintf(out, "never");
+    fprintf(out, "\n");
+}
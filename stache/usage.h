@@ -0,0 +1,58 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USAGE_H
+#define _USAGE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+ * Per-container disk usage, kept up to date incrementally by stached.
+ *
+ * Every directory of a tracked container is watched with inotify. An event
+ * marks its directory dirty, and dirty directories are rescanned on their
+ * own after a short delay, adjusting the container totals by the difference:
+ * the cost of an update is the size of one directory, not of the container.
+ * A parallel walk rebuilds the totals from scratch when a container starts
+ * being tracked, when events were lost, and periodically to absorb drift.
+ * Totals are persisted in the container metadata, so that any process reads
+ * them in O(1).
+ */
+
+#define USAGE_MAX_CONTAINERS 64
+#define USAGE_RESCAN_DELAY_MS 500           // lets bursts of events coalesce
+#define USAGE_FLUSH_INTERVAL_S 30
+#define USAGE_RECONCILE_INTERVAL_S (6 * 3600)
+#define USAGE_WALK_THREADS 4
+
+// Starts tracking the containers found directly under _data_dir_, on a background thread.
+int usage_start(const char *data_dir);
+// Starts tracking one more container, once the tracker runs.
+int usage_track(const char *path);
+// Fills _usage_ from the tracker when it follows the container, from the metadata otherwise.
+// _live_ tells which.
+int usage_get(int dirfd, struct usage_record *usage, bool *live);
+// Stops the tracker and saves its state for a successor daemon. _inotify_ receives
+// the descriptor the saved watches belong to, -1 if there is none.
+int usage_save(FILE *out, int *inotify);
+// Tracks again from the state saved by a predecessor, without walking the containers
+// it knew, and starts tracking the other ones under _data_dir_.
+int usage_resume(const char *data_dir, int inotify, struct handover_reader *section);
+void usage_print(const struct usage_record *, bool live, FILE *out);
+
+#endif /* _USAGE_H */
@@ -0,0 +1,268 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "stache.h"
+
+#define WALK_MAX_THREADS 64
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define GETDENTS_BUFFER_SZ 32768
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk_item {
+    struct walk_item *next;
+    char path[];
+};
+
+struct walk_state {
+    struct tree_walk *walk;
+    int root_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_item *queue;
+    unsigned busy;              // workers currently reading a directory
+    bool stop;
+};
+
+static
+bool walk_cancelled(struct walk_state *state)
+{
+    return state->stop || (state->walk->cancel && atomic_load(state->walk->cancel));
+}
+
+//
+// Queues a directory, given its path relative to the root. Caller holds the lock.
+//
+static
+int push_directory(struct walk_state *state, const char *path)
+{
+    size_t len = strlen(path);
+    struct walk_item *item = malloc(sizeof(*item) + len + 1);
+    if ( item == NULL )
+        return -1;
+
+    memcpy(item->path, path, len + 1);
+    item->next = state->queue;
+    state->queue = item;
+    pthread_cond_signal(&state->cond);
+    return 0;
+}
+
+//
+// Reads one directory and dispatches its entries.
+//
+static
+int walk_directory(struct walk_state *state, const char *path, char *buf)
+{
+    struct tree_walk *walk = state->walk;
+    char child[PATH_MAX];
+    int ret = 0;
+
+    int dirfd = openat(state->root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ( dirfd == -1 )
+        return (errno == ENOENT) ? 0 : -1;
+
+    atomic_fetch_add(&walk->nr_directories, 1);
+
+    while ( ret == 0 && !walk_cancelled(state) ) {
+        long n = syscall(SYS_getdents64, dirfd, buf, GETDENTS_BUFFER_SZ);
+        if ( n <= 0 ) {
+            ret = (n < 0) ? -1 : 0;
+            break;
+        }
+
+        for ( long offset = 0; offset < n && ret == 0; ) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *) (buf + offset);
+            const char *name = dirent->d_name;
+            offset += dirent->d_reclen;
+
+            if ( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 )
+                continue;
+
+            // A truncated path would name another file: stop the walk rather than pass it on.
+            int len = (strcmp(path, ".") == 0) ? snprintf(child, sizeof(child), "%s", name)
+                                               : snprintf(child, sizeof(child), "%s/%s", path, name);
+            if ( len < 0 || (size_t) len >= sizeof(child) ) {
+                errno = ENAMETOOLONG;
+                ret = -1;
+                break;
+            }
+
+            atomic_fetch_add(&walk->nr_entries, 1);
+            if ( walk->on_entry && walk->on_entry(walk, dirfd, name, child, dirent->d_type) < 0 ) {
+                ret = -1;
+                break;
+            }
+
+            unsigned char type = dirent->d_type;
+            if ( type == DT_UNKNOWN ) {
+                struct stat st;
+                if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) )
+                    type = DT_DIR;
+            }
+
+            if ( type == DT_DIR ) {
+                pthread_mutex_lock(&state->lock);
+                ret = push_directory(state, child);
+                pthread_mutex_unlock(&state->lock);
+            }
+        }
+    }
+
+    if ( ret == 0 && walk->on_directory_done && !walk_cancelled(state) )
+        walk->on_directory_done(walk, dirfd, path);
+
+    close(dirfd);
+    return ret;
+}
+
+static
+void *walk_worker(void *arg)
+{
+    struct walk_state *state = arg;
+    char *buf = malloc(GETDENTS_BUFFER_SZ);
+
+    if ( state->walk->on_thread_start )
+        state->walk->on_thread_start(state->walk);
+
+    pthread_mutex_lock(&state->lock);
+    while ( true ) {
+        while ( state->queue == NULL && state->busy > 0 && !state->stop )
+            pthread_cond_wait(&state->cond, &state->lock);
+
+        // Done when nothing is queued and nobody can queue more.
+        if ( state->stop || state->queue == NULL || buf == NULL )
+            break;
+
+        struct walk_item *item = state->queue;
+        state->queue = item->next;
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        int ret = walk_cancelled(state) ? 0 : walk_directory(state, item->path, buf);
+        free(item);
+
+        pthread_mutex_lock(&state->lock);
+        state->busy--;
+        if ( ret < 0 && state->walk->error == 0 ) {
+            state->walk->error = errno ? errno : EIO;
+            state->stop = true;
+        }
+        if ( walk_cancelled(state) )
+            state->stop = true;
+        pthread_cond_broadcast(&state->cond);
+    }
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+
+    free(buf);
+    return NULL;
+}
+
+//
+// Walks the tree under _root_ with _walk->nr_threads_ threads.
+// Returns -1 with _walk->error_ set if an entry or directory failed.
+//
+int tree_walk(const char *root, struct tree_walk *walk)
+{
+    pthread_t threads[WALK_MAX_THREADS];
+    unsigned nr_threads = walk->nr_threads;
+    unsigned started = 0;
+    struct walk_state state = {
+        .walk = walk,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .queue = NULL,
+        .busy = 0,
+        .stop = false,
+    };
+
+    if ( nr_threads == 0 )
+        nr_threads = 1;
+    if ( nr_threads > WALK_MAX_THREADS )
+        nr_threads = WALK_MAX_THREADS;
+
+    atomic_store(&walk->nr_entries, 0);
+    atomic_store(&walk->nr_directories, 0);
+    walk->error = 0;
+
+    state.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( state.root_fd == -1 ) {
+        walk->error = errno;
+        fprintf(stderr, "Cannot open %s: %s\n", root, strerror(errno));
+        return -1;
+    }
+
+    if ( push_directory(&state, ".") < 0 ) {
+        walk->error = ENOMEM;
+        close(state.root_fd);
+        return -1;
+    }
+
+    for ( ; started < nr_threads; started++ ) {
+        if ( pthread_create(&threads[started], NULL, walk_worker, &state) != 0 )
+            break;
+    }
+
+    // Without any thread, walk on the caller's.
+    if ( started == 0 )
+        walk_worker(&state);
+
+    for ( unsigned i = 0; i < started; i++ )
+        pthread_join(threads[i], NULL);
+
+    while ( state.queue ) {
+        struct walk_item *item = state.queue;
+        state.queue = item->next;
+        free(item);
+    }
+
+    close(state.root_fd);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+    if ( walk->error ) {
+        errno = walk->error;
+        return -1;
+    }
+    return 0;
+}
+
+void walk_set_io_priority(int ioprio_class, int level)
+{
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(ioprio_class, level));
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WALK_H
+#define _WALK_H
+
+#include <stdatomic.h>
+
+/*
+ * Parallel directory tree walker.
+ *
+ * Directories are read with getdents64 by a pool of threads sharing a queue,
+ * and every entry is handed to a callback along with its parent directory.
+ */
+
+struct tree_walk;
+
+// Called for every entry below the root. _dirfd_ is the parent directory, _path_
+// the path relative to the root. A negative return aborts the walk, as does a path
+// longer than PATH_MAX (with ENAMETOOLONG).
+typedef int (*walk_entry_fn)(struct tree_walk *, int dirfd, const char *name,
+                             const char *path, unsigned char d_type);
+// Called once on each worker thread before it starts.
+typedef void (*walk_thread_fn)(struct tree_walk *);
+// Called on the same thread once all entries of a directory were dispatched.
+// _path_ is "." for the root.
+typedef void (*walk_directory_fn)(struct tree_walk *, int dirfd, const char *path);
+
+struct tree_walk {
+    unsigned nr_threads;
+    walk_entry_fn on_entry;
+    walk_thread_fn on_thread_start;
+    walk_directory_fn on_directory_done;    // optional
+    void *arg;
+    atomic_bool *cancel;            // optional, the walk stops early when set
+
+    // Results
+    atomic_ullong nr_entries;
+    atomic_ullong nr_directories;
+    int error;
+};
+
+int tree_walk(const char *root, struct tree_walk *);
+
+// I/O scheduling classes, for background walks.
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+// Sets the I/O priority of the calling thread.
+void walk_set_io_priority(int ioprio_class, int level);
+
+#endif /* _WALK_H */
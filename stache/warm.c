@@ -0,0 +1,338 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "stache.h"
+
+enum warm_state {
+    WARM_RUNNING,
+    WARM_DONE,
+    WARM_CANCELLED,
+    WARM_FAILED,
+};
+
+struct warm_job {
+    struct warm_job *next;
+    dev_t dev;
+    ino_t ino;
+    char path[PATH_MAX];
+    atomic_bool cancel;
+    enum warm_state state;
+    uint64_t started_ns;
+    uint64_t elapsed_ns;
+    unsigned long long nr_entries;
+    unsigned long long nr_readahead;
+};
+
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warm_cond = PTHREAD_COND_INITIALIZER;
+static struct warm_job *warm_jobs = NULL;
+
+static
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Warm-up must not compete with foreground I/O.
+//
+static
+void warm_thread_start(struct tree_walk UNUSED *walk)
+{
+    walk_set_io_priority(IOPRIO_CLASS_IDLE, 0);
+    placement_apply(WORK_WARM);
+}
+
+//
+// Loads the inode of every entry; reading the directory already decrypted the names.
+//
+static
+int warm_entry(struct tree_walk UNUSED *walk, int dirfd, const char *name,
+               const char UNUSED *path, unsigned char UNUSED d_type)
+{
+    struct stat st;
+
+    fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+//
+// Opens _path_ below _root_fd_ one component at a time. The manifest is written
+// by the app: ".." and symbolic links are refused all along the path, or it
+// could have root read ahead files outside the container.
+//
+static
+int open_beneath(int root_fd, char *path)
+{
+    char *saveptr;
+    char *name = strtok_r(path, "/", &saveptr);
+    int dirfd = root_fd;
+
+    while ( name != NULL ) {
+        char *next = strtok_r(NULL, "/", &saveptr);
+        int fd = -1;
+
+        if ( strcmp(name, "..") == 0 )
+            errno = EACCES;
+        else
+            fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | (next != NULL ? O_DIRECTORY : 0));
+
+        if ( dirfd != root_fd )
+            close(dirfd);
+        if ( fd == -1 || next == NULL )
+            return fd;
+
+        dirfd = fd;
+        name = next;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+//
+// Reads ahead the files listed in the manifest, one path relative to the container per line.
+//
+static
+int readahead_manifest(struct warm_job *job, unsigned long long *count)
+{
+    char line[PATH_MAX];
+
+    *count = 0;
+    int root_fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( root_fd == -1 )
+        return 0;
+
+    int manifest_fd = openat(root_fd, WARM_MANIFEST, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    FILE *manifest = (manifest_fd == -1) ? NULL : fdopen(manifest_fd, "r");
+    if ( manifest == NULL ) {
+        if ( manifest_fd != -1 )
+            close(manifest_fd);
+        close(root_fd);
+        return 0;
+    }
+
+    while ( !atomic_load(&job->cancel) && fgets(line, sizeof(line), manifest) ) {
+        line[strcspn(line, "\n")] = '\0';
+        if ( line[0] == '\0' || line[0] == '#' || line[0] == '/' )
+            continue;
+
+        int fd = open_beneath(root_fd, line);
+        if ( fd == -1 )
+            continue;
+
+        struct stat st;
+        if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ) {
+            readahead(fd, 0, st.st_size);
+            (*count)++;
+        }
+        close(fd);
+    }
+
+    close(root_fd);
+    fclose(manifest);
+    return 0;
+}
+
+static
+void *warm_worker(void *arg)
+{
+    struct warm_job *job = arg;
+    struct tree_walk walk = {
+        .nr_threads = WARM_THREADS,
+        .on_entry = warm_entry,
+        .on_thread_start = warm_thread_start,
+        .arg = job,
+        .cancel = &job->cancel,
+    };
+
+    walk_set_io_priority(IOPRIO_CLASS_IDLE, 0);
+    placement_apply(WORK_WARM);
+
+    unsigned long long nr_readahead = 0;
+    int ret = tree_walk(job->path, &walk);
+    if ( ret == 0 )
+        ret = readahead_manifest(job, &nr_readahead);
+
+    pthread_mutex_lock(&warm_lock);
+    job->nr_entries = atomic_load(&walk.nr_entries);
+    job->nr_readahead = nr_readahead;
+    job->elapsed_ns = monotonic_ns() - job->started_ns;
+    if ( atomic_load(&job->cancel) )
+        job->state = WARM_CANCELLED;
+    else
+        job->state = (ret == 0) ? WARM_DONE : WARM_FAILED;
+
+    if ( job->state == WARM_DONE )
+        fprintf(stderr, "%s: warmed %llu entries and %llu files in %llu ms.\n", job->path,
+                job->nr_entries, job->nr_readahead, (unsigned long long) job->elapsed_ns / 1000000);
+
+    pthread_cond_broadcast(&warm_cond);
+    pthread_mutex_unlock(&warm_lock);
+    return NULL;
+}
+
+static
+struct warm_job *find_job(dev_t dev, ino_t ino)
+{
+    for ( struct warm_job *job = warm_jobs; job != NULL; job = job->next ) {
+        if ( job->dev == dev && job->ino == ino )
+            return job;
+    }
+
+    return NULL;
+}
+
+//
+// Cancels a job and waits for its worker to finish. Caller holds the lock.
+//
+static
+void stop_job(struct warm_job *job)
+{
+    atomic_store(&job->cancel, true);
+    while ( job->state == WARM_RUNNING )
+        pthread_cond_wait(&warm_cond, &warm_lock);
+}
+
+//
+// Starts warming the container at _dir_path_ in the background.
+// A previous warm-up of the same container is cancelled first.
+//
+int warm_start(const char *dir_path)
+{
+    struct stat st;
+
+    if ( stat(dir_path, &st) != 0 ) {
+        fprintf(stderr, "Cannot warm %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    warm_cancel(dir_path);
+
+    struct warm_job *job = calloc(1, sizeof(*job));
+    if ( job == NULL )
+        return -1;
+
+    job->dev = st.st_dev;
+    job->ino = st.st_ino;
+    strncpy(job->path, dir_path, sizeof(job->path) - 1);
+    atomic_init(&job->cancel, false);
+    job->state = WARM_RUNNING;
+    job->started_ns = monotonic_ns();
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&warm_lock);
+    int err = pthread_create(&thread, &attr, warm_worker, job);
+    pthread_attr_destroy(&attr);
+    if ( err != 0 ) {
+        pthread_mutex_unlock(&warm_lock);
+        fprintf(stderr, "Cannot start warm-up of %s.\n", dir_path);
+        free(job);
+        return -1;
+    }
+
+    job->next = warm_jobs;
+    warm_jobs = job;
+    pthread_mutex_unlock(&warm_lock);
+    return 0;
+}
+
+//
+// Cancels the warm-up of a container, if any, and waits for it to stop.
+// Must be called before the key goes away.
+//
+void warm_cancel(const char *dir_path)
+{
+    struct stat st;
+
+    if ( stat(dir_path, &st) != 0 )
+        return;
+
+    pthread_mutex_lock(&warm_lock);
+    struct warm_job *job = find_job(st.st_dev, st.st_ino);
+    if ( job != NULL ) {
+        stop_job(job);
+
+        for ( struct warm_job **link = &warm_jobs; *link != NULL; link = &(*link)->next ) {
+            if ( *link == job ) {
+                *link = job->next;
+                break;
+            }
+        }
+        free(job);
+    }
+    pthread_mutex_unlock(&warm_lock);
+}
+
+//
+// Waits for every warm-up to finish.
+//
+void warm_wait_all()
+{
+    pthread_mutex_lock(&warm_lock);
+    for ( struct warm_job *job = warm_jobs; job != NULL; job = job->next ) {
+        while ( job->state == WARM_RUNNING )
+            pthread_cond_wait(&warm_cond, &warm_lock);
+    }
+    pthread_mutex_unlock(&warm_lock);
+}
+
+//
+// Prints the warm-up state of a container, including its time-to-warm.
+//
+void warm_print_status(const char *dir_path, FILE *out)
+{
+    static const char *state_names[] = {
+        [WARM_RUNNING] = "running",
+        [WARM_DONE] = "done",
+        [WARM_CANCELLED] = "cancelled",
+        [WARM_FAILED] = "failed",
+    };
+    struct stat st;
+
+    if ( stat(dir_path, &st) != 0 )
+        return;
+
+    pthread_mutex_lock(&warm_lock);
+    struct warm_job *job = find_job(st.st_dev, st.st_ino);
+    if ( job != NULL ) {
+        uint64_t elapsed = (job->state == WARM_RUNNING) ? monotonic_ns() - job->started_ns : job->elapsed_ns;
+
+        fprintf(out, "Warm-up:          %s after %llu ms (%llu entries, %llu files read ahead)\n",
+                state_names[job->state], (unsigned long long) elapsed / 1000000,
+                job->nr_entries, job->nr_readahead);
+    }
+    pthread_mutex_unlock(&warm_lock);
+}
@@ -0,0 +1,35 @@
+/**
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WARM_H
+#define _WARM_H
+
+/*
+ * Background warm-up of a container after attach: walks the tree at idle I/O
+ * priority so that filenames are decrypted and inodes loaded before apps need
+ * them, and reads ahead the files listed in the container manifest.
+ */
+
+#define WARM_MANIFEST ".stache_warm"
+#define WARM_THREADS 4
+
+int warm_start(const char *dir_path);
+void warm_cancel(const char *dir_path);
+void warm_wait_all();
+void warm_print_status(const char *dir_path, FILE *out);
+
+#endif /* _WARM_H */